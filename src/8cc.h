@@ -41,6 +41,8 @@ enum {
     ENC_WCHAR,
 };
 
+typedef struct Arena Arena;
+
 typedef struct Map {
     struct Map *parent;
     char **key;
@@ -48,12 +50,15 @@ typedef struct Map {
     int size;
     int nelem;
     int nused;
+    Arena *arena;  // where its storage is, or NULL if malloc'd
+    bool symbols;  // keys are interned strings
 } Map;
 
 typedef struct {
     void **body;
     int len;
     int nalloc;
+    Arena *arena;
 } Vector;
 
 typedef struct {
@@ -94,6 +99,7 @@ typedef struct {
     bool bol;      // true if the token is at the beginning of a line
     int count;     // token number in a file, counting from 0.
     Set *hideset;  // used by the preprocessor for macro expansion
+    int unroll;    // UNROLL_FORCE or UNROLL_NEVER after #pragma unroll or nounroll
     union {
         // TKEYWORD
         int id;
@@ -287,6 +293,101 @@ typedef struct Node {
     };
 } Node;
 
+// A counted for loop, recorded by the parser for loop.c.
+typedef struct {
+    Node *loop;  // compound statement built by read_for_stmt
+    Node *init;
+    Node *cond;
+    Node *step;
+    Node *body;
+    char *end;   // target of break
+    int unroll;  // as a #pragma before the loop or its function asks
+} Loop;
+
+// Instructions of the minivm assembly that ir.c represents.
+enum {
+    I_LABEL,
+    I_INT,
+    I_NIL,
+    I_REG,
+    I_ADD,
+    I_SUB,
+    I_MUL,
+    I_DIV,
+    I_MOD,
+    I_BOR,
+    I_BAND,
+    I_BXOR,
+    I_BSHL,
+    I_BSHR,
+    I_GET,
+    I_SET,
+    I_ADDR,
+    I_ARR,
+    I_CALL,
+    I_DCALL,
+    I_GETCHAR,
+    I_PUTCHAR,
+    I_JUMP,
+    I_BEQ,
+    I_BLT,
+    I_RET,
+    I_EXIT,
+    NUM_IOPS,
+};
+
+// Alias classes of memory accesses. T_ANY aliases every class.
+enum {
+    T_ANY,
+    T_INT,
+    T_PTR,
+    T_FLOAT,
+};
+
+typedef struct {
+    int op;
+    int dst;  // destination register, -1 if none
+    int nargs;
+    int args[3];
+    long imm;
+    char *sym;        // label name, call target or addr operand
+    char *target[2];  // jump target; for beq/blt the false and true targets
+    int tag;          // alias class of get and set
+    bool dead;
+} Insn;
+
+typedef struct Block {
+    int id;
+    int beg;  // first instruction
+    int end;  // one past the last instruction
+    Vector *succs;
+    Vector *preds;
+    struct Block *idom;
+    Vector *kids;
+    int rpo;
+    Vector *frontier;  // dominance frontier
+    uint64_t *livein;
+    uint64_t *liveout;
+} Block;
+
+typedef struct {
+    char *name;
+    Vector *insns;
+    Vector *blocks;
+    Map *labels;  // label name -> Block
+    int nregs;
+    int *ndefs;
+    int *nuses;
+    int *defat;  // instruction index of the definition of single-def registers
+    int *blockof;
+    Map *counts;  // label -> executions + 1 according to the profile, or NULL
+} Func;
+
+#define BITS_WORDS(n) (((n) + 63) / 64)
+#define BIT_SET(s, i) ((s)[(i) / 64] |= (uint64_t)1 << ((i) % 64))
+#define BIT_CLR(s, i) ((s)[(i) / 64] &= ~((uint64_t)1 << ((i) % 64)))
+#define BIT_GET(s, i) (((s)[(i) / 64] >> ((i) % 64)) & 1)
+
 extern Type *type_void;
 extern Type *type_bool;
 extern Type *type_char;
@@ -304,6 +405,7 @@ extern Type *type_double;
 extern Type *type_ldouble;
 
 #define EMPTY_MAP ((Map){})
+#define EMPTY_SYMBOL_MAP ((Map){.symbols = true})
 #define EMPTY_VECTOR ((Vector){})
 
 // encoding.c
@@ -311,8 +413,49 @@ Buffer *to_utf16(char *p, int len);
 Buffer *to_utf32(char *p, int len);
 void write_utf8(Buffer *b, uint32_t rune);
 
+// arena.c
+enum {
+    MEM_TOKEN,
+    MEM_NODE,
+    MEM_TYPE,
+    MEM_CONTAINER,
+    MEM_IR,
+    MEM_STRING,
+    NUM_MEM_KINDS,
+};
+
+extern bool mem_report;
+Arena *make_arena(char *name);
+void *arena_alloc(Arena *a, int kind, size_t size);
+void arena_reset(Arena *a);
+Arena *use_arena(Arena *a);
+Arena *use_token_arena(Arena *a);
+Arena *current_arena(void);
+void *arena_malloc(int kind, size_t size);
+void *arena_calloc(int kind, size_t n, size_t size);
+void *container_alloc(Arena *a, size_t size);
+void *container_grow(Arena *a, void *p, size_t oldsize, size_t size);
+void container_free(Arena *a, void *p, size_t size);
+void print_mem_report(void);
+
+// bc.c
+typedef struct {
+    void *code;
+    size_t codesize;  // in bytes
+    double *data;
+    size_t ndata;
+    char *asmtext;
+    Vector *syms;
+    Vector *srcmap;  // NULL if the file has none
+} Bytecode;
+
+extern bool bc_srcmap;
+void write_bytecode(char *path, void *code, size_t codesize, char *src);
+Bytecode *read_bytecode(char *path);
+
 // buffer.c
 Buffer *make_buffer(void);
+void buf_free(Buffer *b);
 char *buf_body(Buffer *b);
 int buf_len(Buffer *b);
 void buf_write(Buffer *b, char c);
@@ -320,10 +463,27 @@ void buf_append(Buffer *b, char *s, int len);
 void buf_printf(Buffer *b, char *fmt, ...);
 char *vformat(char *fmt, va_list ap);
 char *format(char *fmt, ...);
+char *arena_format(char *fmt, ...);
 char *quote_cstring(char *p);
 char *quote_cstring_len(char *p, int len);
 char *quote_char(char c);
 
+// cache.c
+extern bool runtime_cache;
+extern bool compile_cache;
+extern bool cache_stats;
+void set_cache_dir(char *dir);
+bool set_cache_size(char *s);
+char *cache_key(Vector *files, char *rtsrc, char *config);
+char *cache_get(char *key, size_t *len);
+void cache_put(char *key, char *body, size_t len, char *path);
+void print_cache_stats(void);
+char *runtime_cache_file(char *rtsrc, Vector *files);
+char *read_runtime(char *path);
+char *write_runtime(char *path, Buffer *layout, Buffer *code);
+void note_runtime_refs(char *text, char *code);
+void link_runtime(Buffer *out, char *code);
+
 // cpp.c
 void read_from_string(char *buf);
 bool is_ident(Token *tok, char *s);
@@ -331,6 +491,7 @@ void expect_newline(void);
 void add_include_path(char *path);
 void init_now(void);
 void cpp_init(void);
+void cpp_reset(void);
 Token *peek_token(void);
 Token *read_token(void);
 
@@ -349,6 +510,7 @@ Vector *dict_keys(Dict *dict);
 extern bool enable_warning;
 extern bool dumpsource;
 extern bool warning_is_error;
+extern char *partial_output;
 
 #define STR2(x) #x
 #define STR(x) STR2(x)
@@ -374,11 +536,85 @@ void stream_stash(File *f);
 void stream_unstash(void);
 
 // gen.c
+#define OBJ_DATA (1 << 30)                  // globals of an object until it is linked
+#define OBJ_EXTERN (OBJ_DATA + (1 << 28))   // globals it uses from other objects
+#define OBJ_EXTERN_SIZE (1 << 22)           // words reachable in each of those
 Buffer *emit_end(void);
+double *static_data(int *nwords);
+char *func_location(char *fname);
+void save_layout(Buffer *b);
+void reset_layout(void);
+bool load_layout(char *line);
+void begin_object(void);
+int reserve_memory(int words);
+int find_global(char *name);
+void emit_start(void);
 void emit_toplevel(Node *v);
+void emit_stream(void (*fn)(char *s, int len));
+
+// genc.c
+void emit_c(FILE *out, char *src);
+
+// intern.c
+char *intern(char *s);
+char *intern_len(char *s, int len);
+uint32_t intern_hash(char *s);
+
+// jobs.c
+extern int jobs;
+int job_count(void);
+Vector *run_jobs(Vector *args, char *(*fn)(void *arg));
+
+// link.c
+typedef struct Object Object;
+char *write_object(Buffer *code);
+void write_object_file(FILE *out, FILE *code, Buffer *rest);
+Object *read_object(char *name, char *text);
+bool defines_function(Vector *objs, char *fname);
+Buffer *link_objects(Vector *objs);
+
+// ir.c
+Insn *make_insn(int op);
+Vector *parse_body(char *body);
+Vector *parse_program(char *src);
+void print_insn(Buffer *b, Insn *in);
+bool is_terminator(Insn *in);
+bool is_pure(Insn *in);
+bool is_valuenum(Insn *in);
+bool is_commutative(int op);
+Insn *insn_at(Func *f, int i);
+Block *label_block(Func *f, char *label);
+void build_cfg(Func *f);
+Vector *compute_dominators(Func *f);
+bool dominates(Block *a, Block *b);
+void compute_frontiers(Func *f, Vector *rpo);
+void count_defs_uses(Func *f);
+bool is_ssa(Func *f, int reg);
+bool def_reaches(Func *f, int reg, int at);
+Vector **use_lists(Func *f);
+void compute_liveness(Func *f, Vector *rpo);
+int build_ssa(Func *f, Vector *rpo);
+
+// ipo.c
+int ast_nslots(Node *node);
+Node **ast_slot(Node *node, int i);
+Node *next_child(Node *node, int *i);
+Node *lvalue_var(Node *node);
+bool needs_whole_program(void);
+Vector *optimize_program(Vector *toplevels);
+bool is_readonly_func(char *name);
+Dict *register_globals(char *fname);
+int tree_size(Node *node);
+
+// jit.c
+bool jit_run(char *src);
+
+// loop.c
+void optimize_loops(Node *func, Vector *loops);
 
 // lex.c
 void lex_init(char *filename);
+void lex_keep_tokens(void);
 char *get_base_file(void);
 void skip_cond_incl(void);
 char *read_header_file_name(bool *std);
@@ -392,12 +628,90 @@ Token *lex(void);
 // map.c
 Map *make_map(void);
 Map *make_map_parent(Map *parent);
+Map *make_symbol_map(void);
+Map *make_symbol_map_parent(Map *parent);
 void *map_get(Map *m, char *key);
 void map_put(Map *m, char *key, void *val);
 void map_remove(Map *m, char *key);
+void map_clear(Map *m);
 size_t map_len(Map *m);
 
+// opt.c
+extern bool opt_report;
+extern bool opt_strict_aliasing;
+void opt_func(Buffer *out, char *name, Buffer *body);
+
+// pass.c
+enum {
+    PASS_IDIOMS,
+    PASS_UNROLL,
+    PASS_UNREACHABLE,
+    PASS_DEVIRTUALIZE,
+    PASS_INLINE,
+    PASS_CONSTGLOBALS,
+    PASS_IPCP,
+    PASS_EVALUATE,
+    PASS_HEAP2STACK,
+    PASS_SPECIALIZE,
+    PASS_DEADPARAMS,
+    PASS_DEADRETURNS,
+    PASS_DEADCALLS,
+    PASS_READONLY,
+    PASS_REGGLOBALS,
+    PASS_PLACEMENT,
+    PASS_SSA,
+    PASS_GVN,
+    PASS_COPYPROP,
+    PASS_MEMORY,
+    PASS_DCE,
+    PASS_COALESCE,
+    PASS_LAYOUT,
+    NUM_PASSES,
+};
+
+extern bool pass_stats;
+bool set_opt_level(char *s);
+bool set_pass(char *name, bool on);
+bool set_dump_after(char *name);
+char *pass_name(int pass);
+char *pass_config(void);
+bool pass_enabled(int pass);
+void pass_start(int pass, long size);
+void pass_stop(int pass);
+bool pass_finish(int pass, long size);
+void print_pass_list(FILE *out);
+void print_pass_stats(void);
+
+// profile.c
+extern bool profile_generate;
+extern char *profile_out;
+extern char *profile_in;
+void read_profile(char *path);
+bool has_profile(void);
+long profile_func_count(char *fname);
+long profile_block_count(char *fname, int n, int nlabels);
+long profile_label_count(char *label);
+long profile_edge_count(char *caller, char *callee);
+long profile_max_edge(void);
+void write_profile_output(char *buf, size_t len);
+
 // parse.c
+enum {
+    UNROLL_DEFAULT,
+    UNROLL_FORCE,
+    UNROLL_NEVER,
+};
+
+extern Arena *body_arena;
+Node *make_ast(Node *tmpl);
+Node *ast_binop(Type *ty, int kind, Node *left, Node *right);
+Node *ast_inttype(Type *ty, long val);
+Node *ast_funcall(Type *ftype, char *fname, Vector *args);
+Node *ast_if(Node *cond, Node *then, Node *els);
+Node *ast_compound_stmt(Vector *stmts);
+Node *ast_jump(char *label);
+Node *ast_dest(char *label);
+Type *builtin_type(char *name);
 char *make_tempname(void);
 char *make_label(void);
 bool is_inttype(Type *ty);
@@ -405,8 +719,10 @@ bool is_flotype(Type *ty);
 void *make_pair(void *first, void *second);
 int eval_intexpr(Node *node, Node **addr);
 Node *read_expr(void);
+Vector *read_toplevel(void);
 Vector *read_toplevels(void);
 void parse_init(void);
+void parse_reset(void);
 char *fullpath(char *path);
 
 // set.c
@@ -0,0 +1,203 @@
+/*
+ * Arenas.
+ *
+ * Most of what the compiler allocates lives until it exits, and what does
+ * not tends to die together: the nodes, types and tokens of a function
+ * body are not needed once the function has been emitted, nor is the IR of
+ * opt.c once the function has been optimized. An arena hands out memory
+ * from large chunks and gives all of it back at once.
+ *
+ * Tokens, nodes, types and the IR are allocated with arena_malloc from the
+ * arena in use, or from a global arena that is never reset. Tokens read
+ * while no arena is in use, such as those of declarations, go to the token
+ * arena instead if one is set, which main.c resets after each toplevel.
+ * Vectors, maps and dicts made while an arena is in use keep their storage
+ * in it, and grow there; others use malloc and free what they outgrow.
+ * Their storage comes in powers of two, and what a container outgrows in
+ * an arena is kept for the next one that needs as much.
+ * Strings are not put in arenas that are reset, but interned strings have
+ * an arena of their own. Whatever must outlive the body it is made in,
+ * such as macros defined in it and struct tags, which are not scoped, is
+ * made with no arena in use.
+ *
+ * -fmem-report prints how many bytes of each kind every arena handed out
+ * and the most it held in chunks at once, then the peak resident size of
+ * the whole process, which also counts what is malloc'd outside arenas.
+ */
+
+#include "8cc.h"
+#include <sys/resource.h>
+
+#define CHUNK_SIZE (64 * 1024)
+#define NUM_CLASSES 48
+
+typedef struct Chunk {
+    struct Chunk *next;
+    size_t size;
+    char body[];
+} Chunk;
+
+struct Arena {
+    char *name;
+    Chunk *chunks;  // the one being filled first
+    size_t used;    // bytes taken in it
+    size_t held;    // bytes in all chunks
+    size_t peak;
+    size_t bytes[NUM_MEM_KINDS];
+    void *spare[NUM_CLASSES];  // container storage given back, by size
+    Arena *next;
+};
+
+bool mem_report = false;
+
+static Arena *arenas;
+static Arena *current;
+static Arena *tokens;
+
+Arena *make_arena(char *name) {
+    Arena *a = calloc(1, sizeof(Arena));
+    a->name = name;
+    Arena **p = &arenas;
+    while (*p)
+        p = &(*p)->next;
+    *p = a;
+    return a;
+}
+
+void *arena_alloc(Arena *a, int kind, size_t size) {
+    size = (size + 7) & ~(size_t)7;
+    if (!a->chunks || a->used + size > a->chunks->size) {
+        size_t n = size > CHUNK_SIZE ? size : CHUNK_SIZE;
+        Chunk *c = malloc(sizeof(Chunk) + n);
+        c->size = n;
+        c->next = a->chunks;
+        a->chunks = c;
+        a->used = 0;
+        a->held += n;
+        if (a->held > a->peak)
+            a->peak = a->held;
+    }
+    void *r = a->chunks->body + a->used;
+    a->used += size;
+    a->bytes[kind] += size;
+    return r;
+}
+
+// Frees everything allocated in the arena but keeps a chunk for reuse.
+void arena_reset(Arena *a) {
+    if (!a->chunks)
+        return;
+    Chunk *c = a->chunks->next;
+    while (c) {
+        Chunk *next = c->next;
+        a->held -= c->size;
+        free(c);
+        c = next;
+    }
+    a->chunks->next = NULL;
+    a->used = 0;
+    memset(a->spare, 0, sizeof(a->spare));
+}
+
+// Makes arena_malloc allocate from `a`, or from the global arena if it is
+// NULL, and returns the arena in use before.
+Arena *use_arena(Arena *a) {
+    Arena *r = current;
+    current = a;
+    return r;
+}
+
+Arena *current_arena(void) {
+    return current;
+}
+
+// Makes arena_malloc allocate tokens from `a` while no arena is in use,
+// and returns the token arena set before.
+Arena *use_token_arena(Arena *a) {
+    Arena *r = tokens;
+    tokens = a;
+    return r;
+}
+
+void *arena_malloc(int kind, size_t size) {
+    static Arena *global;
+    if (current)
+        return arena_alloc(current, kind, size);
+    if (kind == MEM_TOKEN && tokens)
+        return arena_alloc(tokens, kind, size);
+    if (!global)
+        global = make_arena("global");
+    return arena_alloc(global, kind, size);
+}
+
+void *arena_calloc(int kind, size_t n, size_t size) {
+    void *r = arena_malloc(kind, n * size);
+    memset(r, 0, n * size);
+    return r;
+}
+
+// The list of spare storage for `size` bytes, or -1 if it is not a power
+// of two that can hold the link.
+static int size_class(size_t size) {
+    for (int k = 3; k < NUM_CLASSES; k++)
+        if (size == (size_t)1 << k)
+            return k;
+    return -1;
+}
+
+// Storage of a container made in `a`, or with malloc if it is NULL.
+void *container_alloc(Arena *a, size_t size) {
+    if (!a)
+        return malloc(size);
+    int k = size_class(size);
+    if (k >= 0 && a->spare[k]) {
+        void *r = a->spare[k];
+        a->spare[k] = *(void **)r;
+        return r;
+    }
+    return arena_alloc(a, MEM_CONTAINER, size);
+}
+
+// Moves storage of `oldsize` bytes into `size` bytes.
+void *container_grow(Arena *a, void *p, size_t oldsize, size_t size) {
+    if (!a)
+        return realloc(p, size);
+    void *r = container_alloc(a, size);
+    if (oldsize) {
+        memcpy(r, p, oldsize);
+        container_free(a, p, oldsize);
+    }
+    return r;
+}
+
+// Frees storage of `size` bytes.
+void container_free(Arena *a, void *p, size_t size) {
+    if (!a) {
+        free(p);
+        return;
+    }
+    int k = size_class(size);
+    if (p && k >= 0) {
+        *(void **)p = a->spare[k];
+        a->spare[k] = p;
+    }
+}
+
+void print_mem_report(void) {
+    if (!mem_report)
+        return;
+    static char *kinds[NUM_MEM_KINDS] = {"tokens", "nodes", "types", "containers", "ir", "strings"};
+    fprintf(stderr, "%-10s", "arena");
+    for (int i = 0; i < NUM_MEM_KINDS; i++)
+        fprintf(stderr, " %11s", kinds[i]);
+    fprintf(stderr, " %11s\n", "chunk peak");
+    for (Arena *a = arenas; a; a = a->next) {
+        fprintf(stderr, "%-10s", a->name);
+        for (int i = 0; i < NUM_MEM_KINDS; i++)
+            fprintf(stderr, " %11zu", a->bytes[i]);
+        fprintf(stderr, " %11zu\n", a->peak);
+    }
+    struct rusage ru;
+    if (!getrusage(RUSAGE_SELF, &ru))
+        fprintf(stderr, "peak resident size of the process: %ld kB\n", ru.ru_maxrss);
+}
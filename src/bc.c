@@ -0,0 +1,188 @@
+/*
+ * Bytecode files.
+ *
+ * -o <file>.bc writes the assembled program into a file that minivm-cc
+ * runs again without the front end. It starts with a header and a table of
+ * sections, in the byte order of the host:
+ *
+ *   header    "minivmbc", format version, number of sections
+ *   section   kind, offset and size in bytes, for each section
+ *
+ * The code section is the vm_opcode_t array made by vm_asm. The data
+ * section is the static data image: the words of memory that are known when
+ * the program is compiled. The entry code in the code section still stores
+ * them before main runs, so the image describes the program rather than
+ * being loaded by the interpreter. The assembly section keeps the program text for -jon, and the symbol
+ * table has the NUL-terminated names of the functions in the order of the
+ * function table of jit.c and genc.c. With -g, the source map has the file
+ * and line of each of them, in the same order, empty if not known.
+ *
+ * Every section starts at a multiple of 16 bytes, so a file is loaded with
+ * mmap and used in place.
+ */
+
+#include <sys/mman.h>
+
+#include "8cc.h"
+
+#define BC_MAGIC "minivmbc"
+#define BC_VERSION 1
+#define BC_ALIGN 16
+
+enum {
+    BC_CODE = 1,
+    BC_DATA,
+    BC_ASM,
+    BC_SYMS,
+    BC_SRCMAP,
+};
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t nsections;
+} BcHeader;
+
+typedef struct {
+    uint32_t kind;
+    uint32_t pad;
+    uint64_t offset;
+    uint64_t size;
+} BcSection;
+
+bool bc_srcmap = false;
+
+/*
+ * Writing
+ */
+
+static void add_section(Vector *v, int kind, void *body, size_t size) {
+    BcSection *s = calloc(1, sizeof(BcSection));
+    s->kind = kind;
+    s->size = size;
+    vec_push(v, make_pair(s, body));
+}
+
+static Buffer *names(Vector *funcs, bool locations) {
+    Buffer *b = make_buffer();
+    for (int i = 0; i < vec_len(funcs); i++) {
+        char *name = ((void **)vec_get(funcs, i))[0];
+        if (locations) {
+            char *loc = strncmp(name, "func.", 5) ? NULL : func_location(name + 5);
+            name = loc ? loc : "";
+        }
+        buf_printf(b, "%s", name);
+        buf_write(b, '\0');
+    }
+    return b;
+}
+
+void write_bytecode(char *path, void *code, size_t codesize, char *src) {
+    Vector *funcs = parse_program(src);
+    if (!funcs)
+        error("cannot write %s: the program has an unknown instruction", path);
+    Vector *sections = make_vector();
+    int ndata;
+    double *data = static_data(&ndata);
+    add_section(sections, BC_CODE, code, codesize);
+    add_section(sections, BC_DATA, data, ndata * sizeof(double));
+    add_section(sections, BC_ASM, src, strlen(src) + 1);
+    Buffer *syms = names(funcs, false);
+    add_section(sections, BC_SYMS, buf_body(syms), buf_len(syms));
+    if (bc_srcmap) {
+        Buffer *srcmap = names(funcs, true);
+        add_section(sections, BC_SRCMAP, buf_body(srcmap), buf_len(srcmap));
+    }
+
+    FILE *out = fopen(path, "wb");
+    if (!out)
+        error("cannot write %s: %s", path, strerror(errno));
+    BcHeader header = {BC_MAGIC, BC_VERSION, vec_len(sections)};
+    fwrite(&header, sizeof(header), 1, out);
+    size_t off = sizeof(BcHeader) + vec_len(sections) * sizeof(BcSection);
+    for (int i = 0; i < vec_len(sections); i++) {
+        BcSection *s = ((void **)vec_get(sections, i))[0];
+        off = (off + BC_ALIGN - 1) & ~(size_t)(BC_ALIGN - 1);
+        s->offset = off;
+        off += s->size;
+        fwrite(s, sizeof(BcSection), 1, out);
+    }
+    for (int i = 0; i < vec_len(sections); i++) {
+        void **pair = vec_get(sections, i);
+        BcSection *s = pair[0];
+        while (ftell(out) < (long)s->offset)
+            fputc(0, out);
+        fwrite(pair[1], 1, s->size, out);
+    }
+    fclose(out);
+}
+
+/*
+ * Loading
+ */
+
+// Splits a section of NUL-terminated strings.
+static Vector *split_names(char *path, char *p, size_t size) {
+    if (size && p[size - 1] != '\0')
+        error("%s: bad string table", path);
+    Vector *r = make_vector();
+    for (char *end = p + size; p < end; p += strlen(p) + 1)
+        vec_push(r, p);
+    return r;
+}
+
+Bytecode *read_bytecode(char *path) {
+    FILE *file = fopen(path, "rb");
+    if (!file)
+        error("cannot open %s: %s", path, strerror(errno));
+    fseek(file, 0, SEEK_END);
+    size_t size = ftell(file);
+    if (size < sizeof(BcHeader))
+        error("%s: not a bytecode file", path);
+    // Private and writable, so that nothing is copied unless the VM writes
+    // into its code.
+    char *p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fileno(file), 0);
+    fclose(file);
+    if (p == MAP_FAILED)
+        error("cannot map %s: %s", path, strerror(errno));
+    BcHeader *header = (BcHeader *)p;
+    if (memcmp(header->magic, BC_MAGIC, 8))
+        error("%s: not a bytecode file", path);
+    if (header->version != BC_VERSION)
+        error("%s: bytecode version %u, expected %d", path, header->version, BC_VERSION);
+    if (sizeof(BcHeader) + header->nsections * sizeof(BcSection) > size)
+        error("%s: truncated bytecode file", path);
+
+    Bytecode *bc = calloc(1, sizeof(Bytecode));
+    BcSection *sections = (BcSection *)(header + 1);
+    for (uint32_t i = 0; i < header->nsections; i++) {
+        BcSection *s = &sections[i];
+        if (s->offset > size || s->size > size - s->offset || s->offset % BC_ALIGN)
+            error("%s: bad section %u", path, i);
+        char *body = p + s->offset;
+        switch (s->kind) {
+            case BC_CODE:
+                bc->code = body;
+                bc->codesize = s->size;
+                break;
+            case BC_DATA:
+                bc->data = (double *)body;
+                bc->ndata = s->size / sizeof(double);
+                break;
+            case BC_ASM:
+                if (s->size == 0 || body[s->size - 1] != '\0')
+                    error("%s: bad assembly section", path);
+                bc->asmtext = body;
+                break;
+            case BC_SYMS:
+                bc->syms = split_names(path, body, s->size);
+                break;
+            case BC_SRCMAP:
+                bc->srcmap = split_names(path, body, s->size);
+                break;
+        }
+    }
+    if (!bc->code)
+        error("%s: no code section", path);
+    return bc;
+}
@@ -4,6 +4,8 @@
 
 #define INIT_SIZE 8
 
+// Buffers are never made in an arena: what they hold ends up as token
+// values and names, which often outlive the function they are made in.
 Buffer *make_buffer() {
     Buffer *r = malloc(sizeof(Buffer));
     r->body = malloc(INIT_SIZE);
@@ -12,11 +14,14 @@ Buffer *make_buffer() {
     return r;
 }
 
+void buf_free(Buffer *b) {
+    free(b->body);
+    free(b);
+}
+
 static void realloc_body(Buffer *b) {
     int newsize = b->nalloc * 2;
-    char *body = malloc(newsize);
-    memcpy(body, b->body, b->len);
-    b->body = body;
+    b->body = realloc(b->body, newsize);
     b->nalloc = newsize;
 }
 
@@ -80,6 +85,19 @@ char *format(char *fmt, ...) {
     return r;
 }
 
+// Like format, but in the arena in use, so that the string goes with it.
+char *arena_format(char *fmt, ...) {
+    va_list ap;
+    va_start(ap, fmt);
+    int len = vsnprintf(NULL, 0, fmt, ap);
+    va_end(ap);
+    char *r = arena_malloc(MEM_STRING, len + 1);
+    va_start(ap, fmt);
+    vsnprintf(r, len + 1, fmt, ap);
+    va_end(ap);
+    return r;
+}
+
 static char *quote(char c) {
     switch (c) {
         case '"':
@@ -0,0 +1,506 @@
+/*
+ * Caches kept across runs.
+ *
+ * Cache files live in the directory given with -fcache-dir, in
+ * $MINIVM_CACHE, or in minivm-cc under $XDG_CACHE_HOME or ~/.cache. Each is
+ * named by a hash of everything its contents depend on, including the
+ * build of the compiler itself, so an entry that no longer matches is
+ * never found again instead of having to be invalidated.
+ *
+ * The runtime library, all of rt/src but start.c, is compiled on its own
+ * the first time and kept as its assembly and the layout of its globals
+ * (see gen.c). A program then only compiles its own files and start.c
+ * after the runtime's globals, and the runtime functions it reaches are
+ * linked in after its own.
+ *
+ * With -fcache, the output of a whole compilation is kept too, named by
+ * the hash of the preprocessed tokens of its input files, the options and
+ * the runtime sources. Entries are evicted least recently used first once
+ * they take more than -fcache-size megabytes.
+ */
+
+#include <dirent.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <utime.h>
+
+#include "8cc.h"
+
+#define RUNTIME_MARK "minivm-runtime 1"
+#define CACHE_SIZE 256  // megabytes of compiled outputs kept by default
+
+int getpid(void);
+
+bool runtime_cache = true;
+bool compile_cache = false;
+bool cache_stats = false;
+static char *cachedir;
+static long cachesize = CACHE_SIZE;
+
+/*
+ * Hashing
+ */
+
+static uint64_t hash_bytes(uint64_t h, void *p, size_t n) {
+    // FNV-1a
+    for (size_t i = 0; i < n; i++) {
+        h ^= ((uint8_t *)p)[i];
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+static uint64_t hash_string(uint64_t h, char *s) {
+    return hash_bytes(h, s, strlen(s) + 1);
+}
+
+static uint64_t hash_file(uint64_t h, char *path) {
+    FILE *file = fopen(path, "rb");
+    if (!file)
+        return hash_string(h, "missing");
+    char chunk[4096];
+    size_t size;
+    while ((size = fread(chunk, 1, sizeof(chunk), file)) > 0)
+        h = hash_bytes(h, chunk, size);
+    fclose(file);
+    return h;
+}
+
+// Identifies the build of the compiler: its own executable, or the time it
+// was compiled where that cannot be read.
+static uint64_t build_id(void) {
+    static uint64_t id;
+    if (!id) {
+        id = hash_string(14695981039346656037ULL, __DATE__ " " __TIME__);
+        FILE *file = fopen("/proc/self/exe", "rb");
+        if (file) {
+            fclose(file);
+            id = hash_file(14695981039346656037ULL, "/proc/self/exe");
+        }
+    }
+    return id;
+}
+
+// Everything besides the input that changes the compiler's output.
+static uint64_t options_hash(void) {
+    uint64_t h = hash_string(build_id(), pass_config());
+    return hash_string(h, opt_strict_aliasing ? "strict-aliasing" : "no-strict-aliasing");
+}
+
+static int compare_names(const void *a, const void *b) {
+    return strcmp(*(char **)a, *(char **)b);
+}
+
+// Hashes the names and contents of all files under a directory.
+static uint64_t hash_tree(uint64_t h, char *dir) {
+    DIR *d = opendir(dir);
+    if (!d)
+        return hash_string(h, "missing");
+    Vector *names = make_vector();
+    for (struct dirent *e; (e = readdir(d));)
+        if (e->d_name[0] != '.')
+            vec_push(names, strdup(e->d_name));
+    closedir(d);
+    qsort(vec_body(names), vec_len(names), sizeof(char *), compare_names);
+    for (int i = 0; i < vec_len(names); i++) {
+        char *path = format("%s/%s", dir, vec_get(names, i));
+        struct stat st;
+        if (stat(path, &st))
+            continue;
+        h = hash_string(h, vec_get(names, i));
+        h = S_ISDIR(st.st_mode) ? hash_tree(h, path) : hash_file(h, path);
+    }
+    return h;
+}
+
+/*
+ * Files
+ */
+
+static bool make_dir(char *path) {
+    struct stat st;
+    return !mkdir(path, 0755) || (!stat(path, &st) && S_ISDIR(st.st_mode));
+}
+
+// Returns the cache directory, or NULL if there is none that can be used.
+static char *cache_dir(void) {
+    static char *dir;
+    static bool done;
+    if (done)
+        return dir;
+    done = true;
+    if (cachedir)
+        return dir = make_dir(cachedir) ? cachedir : NULL;
+    char *env = getenv("MINIVM_CACHE");
+    if (env && *env)
+        return dir = make_dir(env) ? env : NULL;
+    char *base = getenv("XDG_CACHE_HOME");
+    if (!base || !*base) {
+        char *home = getenv("HOME");
+        if (!home || !*home)
+            return NULL;
+        base = format("%s/.cache", home);
+        if (!make_dir(base))
+            return NULL;
+    }
+    char *path = format("%s/minivm-cc", base);
+    return dir = make_dir(path) ? path : NULL;
+}
+
+// Returns the contents of a file with a NUL after them, and their length
+// in `len` unless it is NULL.
+static char *read_all(char *path, size_t *len) {
+    FILE *file = fopen(path, "rb");
+    if (!file)
+        return NULL;
+    Buffer *b = make_buffer();
+    char chunk[4096];
+    size_t size;
+    while ((size = fread(chunk, 1, sizeof(chunk), file)) > 0)
+        buf_append(b, chunk, size);
+    fclose(file);
+    if (len)
+        *len = buf_len(b);
+    buf_write(b, '\0');
+    return buf_body(b);
+}
+
+// Writes through a temporary file, so that a concurrent run never reads a
+// partial entry. Failing to write only means that nothing is cached.
+static void write_all(char *path, char *body, size_t len) {
+    char *tmp = format("%s.%d.tmp", path, getpid());
+    FILE *file = fopen(tmp, "wb");
+    if (!file)
+        return;
+    bool ok = fwrite(body, 1, len, file) == len;
+    ok = !fclose(file) && ok;
+    if (!ok || rename(tmp, path))
+        remove(tmp);
+}
+
+// Like write_all, for the contents of the file `from`.
+static void copy_all(char *path, char *from) {
+    FILE *in = fopen(from, "rb");
+    if (!in)
+        return;
+    char *tmp = format("%s.%d.tmp", path, getpid());
+    FILE *file = fopen(tmp, "wb");
+    if (!file) {
+        fclose(in);
+        return;
+    }
+    char chunk[4096];
+    size_t size;
+    bool ok = true;
+    while ((size = fread(chunk, 1, sizeof(chunk), in)) > 0)
+        ok = fwrite(chunk, 1, size, file) == size && ok;
+    ok = !ferror(in) && ok;
+    fclose(in);
+    ok = !fclose(file) && ok;
+    if (!ok || rename(tmp, path))
+        remove(tmp);
+}
+
+/*
+ * Precompiled runtime
+ */
+
+// Returns the cache file for the runtime compiled from `files` with the
+// headers in `rtsrc`/include, or NULL if it cannot be cached.
+char *runtime_cache_file(char *rtsrc, Vector *files) {
+    if (!runtime_cache || profile_generate || has_profile())
+        return NULL;
+    char *dir = cache_dir();
+    if (!dir)
+        return NULL;
+    uint64_t h = options_hash();
+    for (int i = 0; i < vec_len(files); i++) {
+        h = hash_string(h, vec_get(files, i));
+        h = hash_file(h, vec_get(files, i));
+    }
+    h = hash_tree(h, format("%s/include", rtsrc));
+    return format("%s/rt-%016llx.vasm", dir, (unsigned long long)h);
+}
+
+// Applies the layout in the text of a runtime cache file to gen.c and
+// returns the assembly of the functions that follows it.
+static char *apply_runtime(char *text) {
+    char *p = text;
+    char *nl = strchr(p, '\n');
+    if (!nl || strncmp(p, RUNTIME_MARK "\n", nl - p + 1))
+        return NULL;
+    reset_layout();
+    for (p = nl + 1; (nl = strchr(p, '\n')); p = nl + 1) {
+        *nl = '\0';
+        if (!strcmp(p, "code"))
+            return nl + 1;
+        if (!load_layout(p))
+            break;
+    }
+    reset_layout();
+    return NULL;
+}
+
+char *read_runtime(char *path) {
+    char *text = read_all(path, NULL);
+    return text ? apply_runtime(text) : NULL;
+}
+
+// Stores a freshly compiled runtime and applies it like one read back.
+char *write_runtime(char *path, Buffer *layout, Buffer *code) {
+    Buffer *b = make_buffer();
+    buf_printf(b, RUNTIME_MARK "\n%.*scode\n%.*s", buf_len(layout), buf_body(layout), buf_len(code), buf_body(code));
+    write_all(path, buf_body(b), buf_len(b));
+    char *r = apply_runtime(buf_body(b));
+    if (!r)
+        error("internal error: bad runtime layout");
+    return r;
+}
+
+// The functions of the runtime being linked, and those of them found to be
+// needed so far.
+static char *rtcode;
+static Map *rtbodies;    // name -> assembly
+static Vector *rtnames;  // in the order of the runtime
+static Map *rtlive;
+static Vector *rtwork;   // live functions not scanned yet
+
+static void load_runtime(char *code) {
+    if (code == rtcode)
+        return;
+    rtcode = code;
+    rtbodies = make_map();
+    rtnames = make_vector();
+    rtlive = make_map();
+    rtwork = make_vector();
+    char *name = NULL;
+    char *start = NULL;
+    for (char *p = code; *p;) {
+        char *nl = strchr(p, '\n');
+        char *next = nl ? nl + 1 : p + strlen(p);
+        if (!strncmp(p, "func ", 5)) {
+            name = format("%.*s", (int)strcspn(p + 5, " \n"), p + 5);
+            start = p;
+        } else if (name && !strncmp(p, "end", 3)) {
+            map_put(rtbodies, name, format("%.*s", (int)(next - start), start));
+            vec_push(rtnames, name);
+            name = NULL;
+        }
+        p = next;
+    }
+}
+
+// Marks the runtime functions that `text` calls or takes the address of.
+static void scan_refs(char *text) {
+    for (char *p = text; (p = strstr(p, "func.")); p += 5) {
+        char name[256];
+        snprintf(name, sizeof(name), "%.*s", (int)strcspn(p, " \n"), p);
+        if (map_get(rtbodies, name) && !map_get(rtlive, name)) {
+            char *s = strdup(name);
+            map_put(rtlive, s, (void *)1);
+            vec_push(rtwork, s);
+        }
+    }
+}
+
+// Takes note of what assembly written out before link_runtime needs of
+// the runtime in `code`.
+void note_runtime_refs(char *text, char *code) {
+    load_runtime(code);
+    scan_refs(text);
+}
+
+// Appends the runtime functions that the program in `out`, or noted by
+// note_runtime_refs, calls or takes the address of, directly or through
+// other runtime functions.
+void link_runtime(Buffer *out, char *code) {
+    load_runtime(code);
+    scan_refs(buf_body(out));
+    while (vec_len(rtwork))
+        scan_refs(map_get(rtbodies, vec_pop(rtwork)));
+    for (int i = 0; i < vec_len(rtnames); i++)
+        if (map_get(rtlive, vec_get(rtnames, i)))
+            buf_printf(out, "%s\n", (char *)map_get(rtbodies, vec_get(rtnames, i)));
+}
+
+/*
+ * Compilation cache
+ */
+
+void set_cache_dir(char *dir) {
+    cachedir = dir;
+    compile_cache = true;
+}
+
+bool set_cache_size(char *s) {
+    char *end;
+    long n = strtol(s, &end, 10);
+    if (*end || n <= 0)
+        return false;
+    cachesize = n;
+    compile_cache = true;
+    return true;
+}
+
+// Hashes what the preprocessor makes of a file, so that changes to
+// comments, layout or unused macros keep the key. #pragma unroll and
+// nounroll are kept on the token after them.
+static uint64_t hash_tokens(uint64_t h, char *path) {
+    lex_init(path);
+    cpp_init();
+    for (;;) {
+        Token *tok = read_token();
+        if (tok->kind == TEOF)
+            break;
+        h = hash_bytes(h, &tok->kind, sizeof(tok->kind));
+        if (tok->kind == TSTRING) {
+            h = hash_bytes(h, &tok->enc, sizeof(tok->enc));
+            h = hash_bytes(h, tok->sval, tok->slen);
+        } else {
+            h = hash_string(h, tok2s(tok));
+        }
+        // Source maps have the lines of functions.
+        if (bc_srcmap) {
+            h = hash_string(h, tok->file->name);
+            h = hash_bytes(h, &tok->line, sizeof(tok->line));
+        }
+        if (tok->unroll)
+            h = hash_bytes(h, &tok->unroll, sizeof(tok->unroll));
+    }
+    cpp_reset();
+    return h;
+}
+
+// Returns the key of the compilation of `files` with the runtime in
+// `rtsrc` (NULL for none) into an output described by `config`, or NULL if
+// it cannot be cached.
+char *cache_key(Vector *files, char *rtsrc, char *config) {
+    if (!cache_dir())
+        return NULL;
+    uint64_t h = hash_string(options_hash(), config);
+    if (profile_in)
+        h = hash_file(h, profile_in);
+    h = rtsrc ? hash_tree(h, rtsrc) : hash_string(h, "no runtime");
+    for (int i = 0; i < vec_len(files); i++) {
+        char *path = vec_get(files, i);
+        if (!strcmp(path, "/dev/stdin"))
+            return NULL;
+        char *ext = strrchr(path, '.');
+        if (ext && (!strcmp(ext, ".vasm") || !strcmp(ext, ".o")))
+            h = hash_file(hash_string(h, ext), path);
+        else
+            h = hash_tokens(hash_string(h, "c"), path);
+    }
+    return format("%016llx", (unsigned long long)h);
+}
+
+static char *entry_path(char *key) {
+    return format("%s/%s.out", cache_dir(), key);
+}
+
+// The counts are kept in the cache directory, so that they add up over
+// all the runs that share it.
+static void read_stats(long *hits, long *misses) {
+    *hits = *misses = 0;
+    FILE *file = fopen(format("%s/stats", cache_dir()), "r");
+    if (!file)
+        return;
+    if (fscanf(file, "hits %ld misses %ld", hits, misses) != 2)
+        *hits = *misses = 0;
+    fclose(file);
+}
+
+// Jobs may count at the same time. The counts only grow, so the text
+// written over the old one is never shorter.
+static void count_stat(bool hit) {
+    char *path = format("%s/stats", cache_dir());
+    FILE *file = fopen(path, "r+");
+    if (!file)
+        file = fopen(path, "w+");
+    if (!file)
+        return;
+    flock(fileno(file), LOCK_EX);
+    long hits, misses;
+    if (fscanf(file, "hits %ld misses %ld", &hits, &misses) != 2)
+        hits = misses = 0;
+    if (hit)
+        hits++;
+    else
+        misses++;
+    rewind(file);
+    fprintf(file, "hits %ld misses %ld\n", hits, misses);
+    fclose(file);
+}
+
+// Returns the output stored under `key` and its length, or NULL on a miss.
+// A hit makes the entry the most recently used one.
+char *cache_get(char *key, size_t *len) {
+    char *path = entry_path(key);
+    char *body = read_all(path, len);
+    count_stat(body != NULL);
+    if (body)
+        utime(path, NULL);
+    return body;
+}
+
+typedef struct {
+    char *path;
+    long size;
+    time_t used;
+} Entry;
+
+static int compare_entries(const void *a, const void *b) {
+    time_t x = (*(Entry **)a)->used, y = (*(Entry **)b)->used;
+    return x < y ? -1 : x > y;
+}
+
+static Vector *list_entries(long *total) {
+    Vector *r = make_vector();
+    *total = 0;
+    DIR *d = opendir(cache_dir());
+    if (!d)
+        return r;
+    for (struct dirent *e; (e = readdir(d));) {
+        size_t n = strlen(e->d_name);
+        if (n < 4 || strcmp(e->d_name + n - 4, ".out"))
+            continue;
+        Entry *ent = calloc(1, sizeof(Entry));
+        ent->path = format("%s/%s", cache_dir(), e->d_name);
+        struct stat st;
+        if (stat(ent->path, &st))
+            continue;
+        ent->size = st.st_size;
+        ent->used = st.st_mtime;
+        *total += ent->size;
+        vec_push(r, ent);
+    }
+    closedir(d);
+    return r;
+}
+
+// Stores an output under `key`, given as a string or, if `body` is NULL, as
+// the file it was written to.
+void cache_put(char *key, char *body, size_t len, char *path) {
+    if (body)
+        write_all(entry_path(key), body, len);
+    else
+        copy_all(entry_path(key), path);
+    long total;
+    Vector *entries = list_entries(&total);
+    qsort(vec_body(entries), vec_len(entries), sizeof(Entry *), compare_entries);
+    for (int i = 0; i < vec_len(entries) && total > cachesize << 20; i++) {
+        Entry *ent = vec_get(entries, i);
+        if (!remove(ent->path))
+            total -= ent->size;
+    }
+}
+
+void print_cache_stats(void) {
+    if (!cache_stats || !cache_dir())
+        return;
+    long hits, misses, total;
+    read_stats(&hits, &misses);
+    Vector *entries = list_entries(&total);
+    fprintf(stderr, "cache %s: %ld hits, %ld misses, %d entries, %ld of %ld bytes\n",
+            cache_dir(), hits, misses, vec_len(entries), total, cachesize << 20);
+}
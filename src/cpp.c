@@ -7,9 +7,9 @@
 
 #include "8cc.h"
 
-static Map *macros = &EMPTY_MAP;
+static Map *macros = &EMPTY_SYMBOL_MAP;
 static Map *once = &EMPTY_MAP;
-static Map *keywords = &EMPTY_MAP;
+static Map *keywords = &EMPTY_SYMBOL_MAP;
 static Map *include_guard = &EMPTY_MAP;
 static Vector *cond_incl_stack = &EMPTY_VECTOR;
 static Vector *std_include_path = &EMPTY_VECTOR;
@@ -18,6 +18,7 @@ static struct tm now;
 #endif
 static Token *cpp_token_zero = &(Token){.kind = TNUMBER, .sval = "0"};
 static Token *cpp_token_one = &(Token){.kind = TNUMBER, .sval = "1"};
+static int unroll_pragma = UNROLL_DEFAULT;  // for the next token
 
 typedef void SpecialMacroHandler(Token *tok);
 typedef enum { IN_THEN,
@@ -80,7 +81,7 @@ static Macro *make_special_macro(SpecialMacroHandler *fn) {
 }
 
 static Token *make_macro_token(int position, bool is_vararg) {
-    Token *r = malloc(sizeof(Token));
+    Token *r = arena_malloc(MEM_TOKEN, sizeof(Token));
     r->kind = TMACRO_PARAM;
     r->is_vararg = is_vararg;
     r->hideset = NULL;
@@ -91,7 +92,7 @@ static Token *make_macro_token(int position, bool is_vararg) {
 }
 
 static Token *copy_token(Token *tok) {
-    Token *r = malloc(sizeof(Token));
+    Token *r = arena_malloc(MEM_TOKEN, sizeof(Token));
     *r = *tok;
     return r;
 }
@@ -382,7 +383,7 @@ static bool read_funclike_macro_params(Token *name, Map *param) {
         if (tok->kind == TNEWLINE)
             errort(name, "missing ')' in macro parameter list");
         if (is_keyword(tok, KELLIPSIS)) {
-            map_put(param, "__VA_ARGS__", make_macro_token(pos++, true));
+            map_put(param, intern("__VA_ARGS__"), make_macro_token(pos++, true));
             expect(')');
             return true;
         }
@@ -427,7 +428,7 @@ static Vector *read_funclike_macro_body(Map *param) {
 }
 
 static void read_funclike_macro(Token *name) {
-    Map *param = make_map();
+    Map *param = make_symbol_map();
     bool is_varg = read_funclike_macro_params(name, param);
     Vector *body = read_funclike_macro_body(param);
     hashhash_check(body);
@@ -750,6 +751,10 @@ static void parse_pragma_operand(Token *tok) {
         enable_warning = true;
     } else if (!strcmp(s, "disable_warning")) {
         enable_warning = false;
+    } else if (!strcmp(s, "unroll")) {
+        unroll_pragma = UNROLL_FORCE;
+    } else if (!strcmp(s, "nounroll")) {
+        unroll_pragma = UNROLL_NEVER;
     } else {
         errort(tok, "unknown #pragma: %s", s);
     }
@@ -812,7 +817,7 @@ static void read_linemarker(Token *tok) {
  * #-directive
  */
 
-static void read_directive(Token *hash) {
+static void do_read_directive(Token *hash) {
     Token *tok = lex();
     if (tok->kind == TNEWLINE)
         return;
@@ -861,6 +866,15 @@ err:
     errort(hash, "unsupported preprocessor directive: %s", tok2s(tok));
 }
 
+static void read_directive(Token *hash) {
+    // Macros outlive the toplevel they may be defined in.
+    Arena *arena = use_arena(NULL);
+    Arena *tokens = use_token_arena(NULL);
+    do_read_directive(hash);
+    use_token_arena(tokens);
+    use_arena(arena);
+}
+
 /*
  * Special macros
  */
@@ -904,6 +918,7 @@ static void handle_line_macro(Token *tmpl) {
     make_token_pushback(tmpl, TNUMBER, format("%d", tmpl->file->line));
 }
 
+// C11 6.10.9: _Pragma("...") acts as #pragma ... and leaves no tokens.
 static void handle_pragma_macro(Token *tmpl) {
     expect('(');
     Token *operand = read_token();
@@ -911,7 +926,6 @@ static void handle_pragma_macro(Token *tmpl) {
         errort(operand, "_Pragma takes a string literal, but got %s", tok2s(operand));
     expect(')');
     parse_pragma_operand(operand);
-    make_token_pushback(tmpl, TNUMBER, "1");
 }
 
 static void handle_base_file_macro(Token *tmpl) {
@@ -940,16 +954,16 @@ void add_include_path(char *path) {
 }
 
 static void define_obj_macro(char *name, Token *value) {
-    map_put(macros, name, make_obj_macro(make_vector1(value)));
+    map_put(macros, intern(name), make_obj_macro(make_vector1(value)));
 }
 
 static void define_special_macro(char *name, SpecialMacroHandler *fn) {
-    map_put(macros, name, make_special_macro(fn));
+    map_put(macros, intern(name), make_special_macro(fn));
 }
 
 static void init_keywords() {
-#define op(id, str) map_put(keywords, str, (void *)id);
-#define keyword(id, str, _) map_put(keywords, str, (void *)id);
+#define op(id, str) map_put(keywords, intern(str), (void *)id);
+#define keyword(id, str, _) map_put(keywords, intern(str), (void *)id);
 #include "keyword.inc"
 #undef keyword
 #undef op
@@ -991,6 +1005,13 @@ void cpp_init() {
     init_predefined_macros();
 }
 
+// Forgets the macros and include guards of the files read so far.
+void cpp_reset(void) {
+    macros = make_symbol_map();
+    once = make_map();
+    include_guard = make_map();
+}
+
 /*
  * Public intefaces
  */
@@ -1032,6 +1053,13 @@ Token *read_token() {
             continue;
         }
         assert(tok->kind < MIN_CPP_TOKEN);
-        return maybe_convert_keyword(tok);
+        tok = maybe_convert_keyword(tok);
+        if (unroll_pragma) {
+            // The parser decides whether the pragma is in the right place.
+            tok = copy_token(tok);
+            tok->unroll = unroll_pragma;
+            unroll_pragma = UNROLL_DEFAULT;
+        }
+        return tok;
     }
 }
@@ -3,7 +3,7 @@
 #include "8cc.h"
 
 Dict *make_dict() {
-    Dict *r = malloc(sizeof(Dict));
+    Dict *r = container_alloc(current_arena(), sizeof(Dict));
     r->map = make_map();
     r->key = make_vector();
     return r;
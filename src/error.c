@@ -4,6 +4,7 @@
 
 bool enable_warning = true;
 bool warning_is_error = false;
+char *partial_output;  // removed if compiling fails
 
 static void print_error(char *line, char *pos, char *label, char *fmt, va_list args) {
     fprintf(stderr, "[%s] ", label);
@@ -17,6 +18,8 @@ void errorf(char *line, char *pos, char *fmt, ...) {
     va_start(args, fmt);
     print_error(line, pos, "ERROR", fmt, args);
     va_end(args);
+    if (partial_output)
+        remove(partial_output);
     __builtin_trap();
     // exit(1);
 }
@@ -29,8 +32,11 @@ void warnf(char *line, char *pos, char *fmt, ...) {
     va_start(args, fmt);
     print_error(line, pos, label, fmt, args);
     va_end(args);
-    if (warning_is_error)
+    if (warning_is_error) {
+        if (partial_output)
+            remove(partial_output);
         exit(1);
+    }
 }
 
 char *token_pos(Token *tok) {
@@ -1,8 +1,13 @@
 // Copyright 2012 Rui Ueyama. Released under the MIT license.
 
+#include <limits.h>
+
 #include "8cc.h"
 
 #define BUFFER_EXTRA 0
+#define MEMORY_WORDS 12500000
+#define PROFILE_WORDS 65536  // counters of -fprofile-generate, at the top of memory
+#define DEFERRED_BYTES (1 << 22)
 
 bool dumpsource = true;
 
@@ -10,11 +15,33 @@ static int nregs;
 static Buffer *outbuf = &(Buffer){0, 0, 0};
 static const char *curfunc;
 static Map globals = EMPTY_MAP;
+static Vector globalnames = EMPTY_VECTOR;
 static Map locals;
 static Vector globalzero = EMPTY_VECTOR;
 static Vector globalinit = EMPTY_VECTOR;
-static Vector globalinitval = EMPTY_VECTOR;
+static Vector initcode = EMPTY_VECTOR;  // lowered initializers that are not constants
+static int initregs = 5;                 // registers they take in the entry code
 static int initmem = 16;
+static bool memtags;
+static Dict *regglobals;  // globals kept in registers, name -> written
+static Map globalregs;
+static Vector profkeys = EMPTY_VECTOR;  // record of each profile counter
+static Map profindex = EMPTY_MAP;       // record -> counter + 1
+static Map proflabels = EMPTY_MAP;      // function -> number of labels
+static Map funclocs = EMPTY_MAP;        // function -> "file:line"
+static Map staticglobals = EMPTY_MAP;   // globals not seen by other objects
+static Vector externs = EMPTY_VECTOR;   // globals an object uses but does not define
+static bool objmode;
+static Vector deferred = EMPTY_VECTOR;  // functions left for opt_func
+static long deferredsize;
+static void (*outfn)(char *s, int len);  // takes the output as it is done
+
+typedef struct {
+    char *name;
+    Buffer *body;    // unoptimized
+    Buffer *before;  // output up to the body
+} Deferred;
+static int nlabels;
 int stackn = 0;
 
 static int emit_expr(Node *node);
@@ -24,12 +51,59 @@ static int emit_addr(Node *op);
 #define emit_noindent(...) (buf_printf(outbuf, __VA_ARGS__), newline())
 #define emit(...) emit_noindent("    " __VA_ARGS__)
 
+static void emit_profile_funcs(void);
+static void optimize_deferred(void);
+
+// Hands the output to `fn` whenever no function before it is waiting for
+// opt_func, instead of keeping it all for emit_end, so that it does not
+// grow with the program. `s` is terminated. NULL keeps the output again.
+void emit_stream(void (*fn)(char *s, int len)) {
+    outfn = fn;
+}
+
+static void flush_output(void) {
+    if (!outfn || vec_len(&deferred) || buf_len(outbuf) == 0)
+        return;
+    Buffer *b = outbuf;
+    outbuf = make_buffer();
+    // emit_end returns it for a string, even if nothing more is added.
+    buf_printf(outbuf, "%s", "");
+    buf_write(b, '\0');
+    outfn(buf_body(b), buf_len(b) - 1);
+    buf_free(b);
+}
+
+// Returns the output, or what was not handed to emit_stream's function.
 Buffer *emit_end(void) {
+    if (profile_generate)
+        emit_profile_funcs();
+    optimize_deferred();
+    flush_output();
     Buffer *ret = outbuf;
     outbuf = make_buffer();
     return ret;
 }
 
+// The words of memory that the entry code sets to constants before main
+// runs, for the data section of bytecode files. Words past the end start
+// out as 0.
+double *static_data(int *nwords) {
+    double *r = calloc(initmem + 16, sizeof(double));
+    r[1] = initmem + 16;
+    *nwords = 2;
+    for (int i = 0; i < vec_len(&globalinit); i++) {
+        int *pair = vec_get(&globalinit, i);
+        r[pair[0]] = pair[1];
+        if (pair[1] && pair[0] >= *nwords)
+            *nwords = pair[0] + 1;
+    }
+    return r;
+}
+
+char *func_location(char *fname) {
+    return map_get(&funclocs, fname);
+}
+
 static bool kind_is_int(int kind) {
     return kind == KIND_PTR || kind == KIND_ARRAY || kind == KIND_BOOL || kind == KIND_CHAR || kind == KIND_SHORT || kind == KIND_INT || kind == KIND_LONG || kind == KIND_LLONG || kind == KIND_ENUM;
 }
@@ -42,17 +116,103 @@ static int emit_conv_type(Type *from, Type *to, int reg) {
     return reg;
 }
 
+// Alias class of the word at offset `off` in an object of type `ty`. It is
+// appended to get and set instructions for opt.c, which assumes that
+// accesses with different classes never overlap. Character types and
+// unions may alias anything and are left untagged.
+static char *mem_tag(Type *ty, int off) {
+    if (!memtags)
+        return "";
+    while (ty->kind == KIND_ARRAY || ty->kind == KIND_STRUCT) {
+        if (ty->kind == KIND_ARRAY) {
+            if (ty->ptr->size <= 0)
+                return "";
+            off %= ty->ptr->size;
+            ty = ty->ptr;
+            continue;
+        }
+        if (!ty->is_struct)
+            return "";
+        Vector *keys = dict_keys(ty->fields);
+        Type *found = NULL;
+        for (int i = 0; i < vec_len(keys); i++) {
+            Type *field = dict_get(ty->fields, vec_get(keys, i));
+            if (field->offset <= off && off < field->offset + field->size)
+                found = field;
+        }
+        if (!found)
+            return "";
+        off -= found->offset;
+        ty = found;
+    }
+    switch (ty->kind) {
+        case KIND_BOOL:
+        case KIND_SHORT:
+        case KIND_INT:
+        case KIND_LONG:
+        case KIND_LLONG:
+        case KIND_ENUM:
+            return " :int";
+        case KIND_PTR:
+            return " :ptr";
+        case KIND_FLOAT:
+        case KIND_DOUBLE:
+        case KIND_LDOUBLE:
+            return " :float";
+    }
+    return "";
+}
+
+// Temporaries are defined exactly once so that opt.c can value number them
+// across basic blocks.
+static int emit_int(long num) {
+    int out = nregs++;
+    emit("r%i <- int %li", out, num);
+    return out;
+}
+
+static int profile_counter(char *key) {
+    int n = (intptr_t)map_get(&profindex, key);
+    if (n)
+        return n - 1;
+    if (vec_len(&profkeys) == PROFILE_WORDS)
+        error("too many profile counters");
+    vec_push(&profkeys, key);
+    map_put(&profindex, key, (void *)(intptr_t)vec_len(&profkeys));
+    return vec_len(&profkeys) - 1;
+}
+
+static void emit_profile_count(char *key) {
+    int addr = emit_int(MEMORY_WORDS - PROFILE_WORDS + profile_counter(key));
+    int old = nregs++;
+    emit("r%i <- get r1 r%i :int", old, addr);
+    int one = emit_int(1);
+    int new = nregs++;
+    emit("r%i <- add r%i r%i", new, old, one);
+    emit("set r1 r%i r%i :int", addr, new);
+}
+
 static void emit_label(char *label) {
     emit_noindent("@%s%s", curfunc, label);
+    if (profile_generate)
+        emit_profile_count(format("b %s %d %s", curfunc, nlabels, label));
+    nlabels++;
+}
+
+// Ends the program, after printing the profile with -fprofile-generate.
+static void emit_exit(void) {
+    if (profile_generate)
+        emit("r0 <- call func.__profile_dump r1");
+    emit("exit");
 }
 
 static int emit_add_ri(int reg, int num) {
     if (num == 0) {
         return reg;
     } else {
+        int imm = emit_int(num);
         int out = nregs++;
-        emit("r%i <- int %i", out, num);
-        emit("r%i <- add r%i r%i", out, out, reg);
+        emit("r%i <- add r%i r%i", out, imm, reg);
         return out;
     }
 }
@@ -65,13 +225,56 @@ static int emit_mul_ri(int reg, int num) {
         emit("r%i <- add r%i r%i", out, reg, reg);
         return out;
     } else {
+        int imm = emit_int(num);
         int out = nregs++;
-        emit("r%i <- int %i", out, num);
-        emit("r%i <- mul r%i r%i", out, out, reg);
+        emit("r%i <- mul r%i r%i", out, imm, reg);
         return out;
     }
 }
 
+// Returns the address of a global. In an object, a global that is not
+// defined (yet) gets the next window for link.c to resolve.
+static int global_addr(char *name) {
+    void *r = map_get(&globals, name);
+    if (r || !objmode)
+        return (int)(size_t)r;
+    long addr = OBJ_EXTERN + (long)vec_len(&externs) * OBJ_EXTERN_SIZE;
+    if (addr + OBJ_EXTERN_SIZE > INT_MAX)
+        error("too many external variables in one object");
+    vec_push(&externs, name);
+    map_put(&globals, name, (void *)(size_t)addr);
+    return addr;
+}
+
+static int global_reg(Node *node) {
+    return node->kind == AST_GVAR ? (int)(size_t)map_get(&globalregs, node->varname) : 0;
+}
+
+// Stores the globals that the function writes back from their registers.
+static void emit_store_globals(void) {
+    if (!regglobals)
+        return;
+    Vector *names = dict_keys(regglobals);
+    for (int i = 0; i < vec_len(names); i++) {
+        char *name = vec_get(names, i);
+        if (!dict_get(regglobals, name))
+            continue;
+        emit("r0 <- int %i", global_addr(name));
+        emit("set r1 r0 r%i", (int)(size_t)map_get(&globalregs, name));
+    }
+}
+
+static void emit_load_globals(void) {
+    if (!regglobals)
+        return;
+    Vector *names = dict_keys(regglobals);
+    for (int i = 0; i < vec_len(names); i++) {
+        char *name = vec_get(names, i);
+        emit("r0 <- int %i", global_addr(name));
+        emit("r%i <- get r1 r0", (int)(size_t)map_get(&globalregs, name));
+    }
+}
+
 static void emit_pre_call(void) {
     int reg = nregs++;
     emit("r0 <- int %i", stackn + BUFFER_EXTRA);
@@ -116,6 +319,7 @@ static void emit_branch_bool(Node *node, char *zero, char *nonzero) {
 }
 
 static int emit_assign_to(Node *from, Node *to) {
+    Type *ty = to->ty;
     int offset = 0;
     while (to->kind == AST_STRUCT_REF) {
         Type *field = dict_get(to->struc->ty->fields, to->field);
@@ -131,20 +335,22 @@ static int emit_assign_to(Node *from, Node *to) {
         // lhs += offset;
         for (int i = 0; i < from->ty->size; i++) {
             int where = emit_add_ri(lhs, i + offset);
-            emit("set r1 r%i r%i", where, rhs + i);
+            emit("set r1 r%i r%i%s", where, rhs + i, mem_tag(ty, i));
         }
     } else if (to->kind == AST_LVAR) {
         int out = (int)(size_t)map_get(&locals, to->varname);
         for (int i = 0; i < from->ty->size; i++) {
             int where = emit_add_ri(2, i + out);
-            emit("set r1 r%i r%i", where, rhs + i);
+            emit("set r1 r%i r%i%s", where, rhs + i, mem_tag(ty, i));
         }
+    } else if (global_reg(to)) {
+        emit("r%i <- reg r%i", global_reg(to), rhs);
     } else if (to->kind == AST_GVAR) {
-        int out = (int)(size_t)map_get(&globals, to->varname);
+        int out = global_addr(to->varname);
         // printf("%s: [%i]\n", to->varname, out);
         for (int i = 0; i < from->ty->size; i++) {
             emit("r0 <- int %i", out + i + offset);
-            emit("set r1 r0 r%i", rhs + i);
+            emit("set r1 r0 r%i%s", rhs + i, mem_tag(ty, i));
         }
     } else {
         error("assign to bad thing: `%s`", node2s(to));
@@ -247,13 +453,15 @@ static int emit_binop(Node *node) {
             return ret;
         }
         case '/': {
+            int quo = nregs++;
+            emit("r%i <- div r%i r%i", quo, lhs, rhs);
+            if (!kind_is_int(node->ty->kind))
+                return quo;
+            int one = emit_int(1);
+            int frac = nregs++;
+            emit("r%i <- mod r%i r%i", frac, quo, one);
             int ret = nregs++;
-            emit("r%i <- div r%i r%i", ret, lhs, rhs);
-            if (kind_is_int(node->ty->kind)) {
-                emit("r0 <- int 1");
-                emit("r0 <- mod r%i r0", ret);
-                emit("r%i <- sub r%i r0", ret, ret);
-            }
+            emit("r%i <- sub r%i r%i", ret, quo, frac);
             return ret;
         }
         case '%': {
@@ -461,7 +669,7 @@ static void emit_args(Vector *vals) {
         int regno = buf[i];
         for (int j = 0; j < v->ty->size; j++) {
             int where = emit_add_ri(2, off + stackn + BUFFER_EXTRA);
-            emit("set r1 r%i r%i", where, regno + j);
+            emit("set r1 r%i r%i%s", where, regno + j, mem_tag(v->ty, j));
             off += 1;
         }
     }
@@ -471,47 +679,154 @@ static int emit_funcptr_call(Node *node) {
     int func = emit_expr(node->fptr);
     int ref = nregs++;
     emit_args(node->args);
+    emit_store_globals();
     emit_pre_call();
-    emit("r%i <- dcall r%i r1", ref, func);
+    if (node->fname) {
+        // ipo.c names the likely target; call it directly if it is the one.
+        char *slow = make_label();
+        char *fast = make_label();
+        char *end = make_label();
+        int guess = nregs++;
+        emit("r%i <- addr func.%s", guess, node->fname);
+        emit("beq r%i r%i %s%s %s%s", func, guess, curfunc, slow, curfunc, fast);
+        emit_label(fast);
+        emit("r%i <- call func.%s r1", ref, node->fname);
+        emit_jmp(end);
+        emit_label(slow);
+        emit("r%i <- dcall r%i r1", ref, func);
+        emit_label(end);
+        // emit_post_call stores through r0, which is not kept across blocks.
+        emit("r0 <- int 1");
+    } else {
+        emit("r%i <- dcall r%i r1", ref, func);
+    }
     emit_post_call();
+    emit_load_globals();
     int ret = nregs++;
     if (node->fptr->ty->ptr->rettype->kind != KVOID) {
         for (int i = 0; i < node->fptr->ty->ptr->rettype->size; i++) {
             int where = emit_add_ri(ref, i);
-            emit("r%i <- get r1 r%i", ret + i, where);
+            emit("r%i <- get r1 r%i%s", ret + i, where, mem_tag(node->fptr->ty->ptr->rettype, i));
         }
     }
     return ret;
 }
 
+// Builtins produced by loop idiom recognition in loop.c. Each one becomes
+// a loop that does nothing per word but the access and a pointer bump.
+static int emit_fill_words(Node *node) {
+    int ptr = emit_expr(vec_get(node->args, 0));
+    int val = emit_expr(vec_get(node->args, 1));
+    int num = emit_expr(vec_get(node->args, 2));
+    int one = emit_int(1);
+    int cur = nregs++;
+    int end = nregs++;
+    char *loop = make_label();
+    char *done = make_label();
+    emit("r%i <- reg r%i", cur, ptr);
+    emit("r%i <- add r%i r%i", end, ptr, num);
+    emit("blt r%i r%i %s%s %s%s", cur, end, curfunc, done, curfunc, loop);
+    emit_label(loop);
+    emit("set r1 r%i r%i", cur, val);
+    emit("r%i <- add r%i r%i", cur, cur, one);
+    emit("blt r%i r%i %s%s %s%s", cur, end, curfunc, done, curfunc, loop);
+    emit_label(done);
+    return 0;
+}
+
+static int emit_copy_words(Node *node) {
+    int dst = emit_expr(vec_get(node->args, 0));
+    int src = emit_expr(vec_get(node->args, 1));
+    int num = emit_expr(vec_get(node->args, 2));
+    int one = emit_int(1);
+    int cur = nregs++;
+    int from = nregs++;
+    int end = nregs++;
+    int tmp = nregs++;
+    char *loop = make_label();
+    char *done = make_label();
+    emit("r%i <- reg r%i", cur, dst);
+    emit("r%i <- reg r%i", from, src);
+    emit("r%i <- add r%i r%i", end, dst, num);
+    emit("blt r%i r%i %s%s %s%s", cur, end, curfunc, done, curfunc, loop);
+    emit_label(loop);
+    emit("r%i <- get r1 r%i", tmp, from);
+    emit("set r1 r%i r%i", cur, tmp);
+    emit("r%i <- add r%i r%i", cur, cur, one);
+    emit("r%i <- add r%i r%i", from, from, one);
+    emit("blt r%i r%i %s%s %s%s", cur, end, curfunc, done, curfunc, loop);
+    emit_label(done);
+    return 0;
+}
+
+// Returns the index of the first word that differs, or the count.
+static int emit_mismatch_words(Node *node) {
+    int a = emit_expr(vec_get(node->args, 0));
+    int b = emit_expr(vec_get(node->args, 1));
+    int num = emit_expr(vec_get(node->args, 2));
+    int one = emit_int(1);
+    int idx = nregs++;
+    int pa = nregs++;
+    int pb = nregs++;
+    int x = nregs++;
+    int y = nregs++;
+    char *loop = make_label();
+    char *next = make_label();
+    char *done = make_label();
+    emit("r%i <- int 0", idx);
+    emit("blt r%i r%i %s%s %s%s", idx, num, curfunc, done, curfunc, loop);
+    emit_label(loop);
+    emit("r%i <- add r%i r%i", pa, a, idx);
+    emit("r%i <- get r1 r%i", x, pa);
+    emit("r%i <- add r%i r%i", pb, b, idx);
+    emit("r%i <- get r1 r%i", y, pb);
+    emit("beq r%i r%i %s%s %s%s", x, y, curfunc, done, curfunc, next);
+    emit_label(next);
+    emit("r%i <- add r%i r%i", idx, idx, one);
+    emit("blt r%i r%i %s%s %s%s", idx, num, curfunc, done, curfunc, loop);
+    emit_label(done);
+    return idx;
+}
+
 static int emit_func_call(Node *node) {
     if (!strcmp(node->fname, "getchar")) {
         int reg = nregs++;
         emit("r%i <- getchar", reg);
         return reg;
     } else if (!strcmp(node->fname, "__builtin_unreachable")) {
-        emit("exit");
+        emit_exit();
         return 0;
     } else if (!strcmp(node->fname, "__builtin_trap")) {
-        emit("exit");
+        emit_exit();
         return 0;
+    } else if (!strcmp(node->fname, "__builtin_fill_words")) {
+        return emit_fill_words(node);
+    } else if (!strcmp(node->fname, "__builtin_copy_words")) {
+        return emit_copy_words(node);
+    } else if (!strcmp(node->fname, "__builtin_mismatch_words")) {
+        return emit_mismatch_words(node);
     } else if (!strcmp(node->fname, "putchar")) {
         Node *v = vec_get(node->args, 0);
         int regno = emit_expr(v);
         emit("putchar r%i", regno);
         return 0;
     } else {
+        if (profile_generate)
+            emit_profile_count(format("c %s %s", curfunc, node->fname));
         int ref = nregs;
         nregs += node->ftype->rettype->size;
         emit_args(node->args);
+        emit_store_globals();
         emit_pre_call();
         emit("r%i <- call func.%s r1", ref, node->fname);
         emit_post_call();
+        if (!is_readonly_func(node->fname))
+            emit_load_globals();
         int ret = nregs++;
         if (node->ftype->rettype->kind != KVOID) {
             for (int i = 0; i < node->ftype->rettype->size; i++) {
                 int where = emit_add_ri(ref, i);
-                emit("r%i <- get r1 r%i", ret + i, where);
+                emit("r%i <- get r1 r%i%s", ret + i, where, mem_tag(node->ftype->rettype, i));
             }
         }
         return ret;
@@ -575,10 +890,12 @@ static int emit_return(Node *node) {
         for (int i = 0; i < node->retval->ty->size; i++) {
             emit("r0 <- int %i", i);
             emit("r0 <- add r0 r%i", dest);
-            emit("set r1 r0 r%i", regno + i);
+            emit("set r1 r0 r%i%s", regno + i, mem_tag(node->retval->ty, i));
         }
+        emit_store_globals();
         emit("ret r%i", dest);
     } else {
+        emit_store_globals();
         emit("r0 <- nil");
         emit("ret r0");
     }
@@ -590,7 +907,7 @@ static void emit_local_store(int where, Node *node) {
     for (int i = 0; i < node->ty->size; i++) {
         emit("r0 <- int %i", where + i);
         emit("r0 <- add r0 r2");
-        emit("set r1 r0 r%i", r + i);
+        emit("set r1 r0 r%i%s", r + i, mem_tag(node->ty, i));
     }
 }
 
@@ -606,18 +923,23 @@ static int emit_lvar(Node *node) {
     nregs += node->ty->size;
     for (int i = 0; i < node->ty->size; i++) {
         int where = emit_add_ri(2, reg + i);
-        emit("r%i <- get r1 r%i", outreg + i, where);
+        emit("r%i <- get r1 r%i%s", outreg + i, where, mem_tag(node->ty, i));
     }
     return outreg;
 }
 
 static int emit_gvar(Node *node) {
+    if (global_reg(node)) {
+        int out = nregs++;
+        emit("r%i <- reg r%i", out, global_reg(node));
+        return out;
+    }
     int outreg = nregs;
     nregs += node->ty->size;
-    int where = (int)(size_t)map_get(&globals, node->varname);
+    int where = global_addr(node->varname);
     for (int i = 0; i < node->ty->size; i++) {
         emit("r0 <- int %i", where + i);
-        emit("r%i <- get r1 r0", outreg + i);
+        emit("r%i <- get r1 r0%s", outreg + i, mem_tag(node->ty, i));
     }
     return outreg;
 }
@@ -636,22 +958,19 @@ static int emit_addr(Node *op) {
         }
     }
     if (op->kind == AST_DEREF) {
-        int ret = nregs++;
         int first = emit_expr(op->operand);
-        emit("r%i <- int %i", ret, off);
-        emit("r%i <- add r%i r%i", ret, ret, first);
-        return ret;
+        return emit_add_ri(first, off);
     }
     if (op->kind == AST_LVAR) {
-        int ret = nregs++;
         int local = (int)(size_t)map_get(&locals, op->varname);
-        emit("r%i <- int %i", ret, local + off);
-        emit("r%i <- add r%i r2", ret, ret);
+        int imm = emit_int(local + off);
+        int ret = nregs++;
+        emit("r%i <- add r%i r2", ret, imm);
         return ret;
     }
     if (op->kind == AST_GVAR) {
         int ret = nregs++;
-        int loc = (int)(size_t)map_get(&globals, op->varname);
+        int loc = global_addr(op->varname);
         emit("r%i <- int %i", ret, loc + off);
         return ret;
     }
@@ -686,11 +1005,24 @@ static int emit_deref(Node *node) {
     for (int i = 0; i < node->ty->size; i++) {
         emit("r0 <- int %i", i);
         emit("r0 <- add r0 r%i", from);
-        emit("r%i <- get r1 r0", outreg + i);
+        emit("r%i <- get r1 r0%s", outreg + i, mem_tag(node->ty, i));
     }
     return outreg;
 }
 
+static int emit_global_incdec(Node *node) {
+    int reg = global_reg(node->operand);
+    int old = nregs++;
+    emit("r%i <- reg r%i", old, reg);
+    int n = node->kind == OP_PRE_DEC || node->kind == OP_POST_DEC ? -1 : 1;
+    if (node->operand->ty->kind == KIND_PTR) {
+        n *= node->operand->ty->ptr->size;
+    }
+    int next = emit_add_ri(old, n);
+    emit("r%i <- reg r%i", reg, next);
+    return node->kind == OP_PRE_DEC || node->kind == OP_PRE_INC ? next : old;
+}
+
 static int emit_label_addr(Node *node) {
     int outreg = nregs++;
     emit("r%i <- addr %s%s", outreg, curfunc, node->label);
@@ -784,11 +1116,12 @@ static int emit_expr(Node *node) {
         }
         case '~': {
             int reg = emit_expr(node->operand);
+            int one = emit_int(1);
+            int inc = nregs++;
+            emit("r%i <- add r%i r%i", inc, one, reg);
+            int zero = emit_int(0);
             int ret = nregs++;
-            emit("r0 <- int 1");
-            emit("r%i <- add r0 r%i", ret, reg);
-            emit("r0 <- int 0");
-            emit("r%i <- sub r0 r%i", ret, ret);
+            emit("r%i <- sub r%i r%i", ret, zero, inc);
             return ret;
         }
         case ',':
@@ -815,30 +1148,32 @@ static int emit_expr(Node *node) {
             return emit_binop(node);
         case OP_PRE_DEC:
         case OP_PRE_INC: {
+            if (global_reg(node->operand))
+                return emit_global_incdec(node);
             int addr = emit_addr(node->operand);
-            int ret = nregs++;
-            emit("r%i <- get r1 r%i", ret, addr);
+            int old = nregs++;
+            emit("r%i <- get r1 r%i%s", old, addr, mem_tag(node->operand->ty, 0));
             int n = node->kind == OP_PRE_DEC ? -1 : 1;
             if (node->operand->ty->kind == KIND_PTR) {
                 n *= node->operand->ty->ptr->size;
             }
-            emit("r0 <- int %i", n);
-            emit("r%i <- add r0 r%i", ret, ret);
-            emit("set r1 r%i r%I", addr, ret);
+            int ret = emit_add_ri(old, n);
+            emit("set r1 r%i r%i%s", addr, ret, mem_tag(node->operand->ty, 0));
             return ret;
         }
         case OP_POST_DEC:
         case OP_POST_INC: {
+            if (global_reg(node->operand))
+                return emit_global_incdec(node);
             int addr = emit_addr(node->operand);
             int ret = nregs++;
-            emit("r%i <- get r1 r%i", ret, addr);
+            emit("r%i <- get r1 r%i%s", ret, addr, mem_tag(node->operand->ty, 0));
             int n = node->kind == OP_POST_DEC ? -1 : 1;
             if (node->operand->ty->kind == KIND_PTR) {
                 n *= node->operand->ty->ptr->size;
             }
-            emit("r0 <- int %i", n);
-            emit("r0 <- add r0 r%i", ret);
-            emit("set r1 r%i r0", addr);
+            int next = emit_add_ri(ret, n);
+            emit("set r1 r%i r%i%s", addr, next, mem_tag(node->operand->ty, 0));
             return ret;
         }
         default:
@@ -846,52 +1181,71 @@ static int emit_expr(Node *node) {
     }
 }
 
-static void emit_func_prologue(Node *func) {
-    if (!strcmp(func->fname, "_start")) {
-        emit_noindent("@__entry");
-        emit("jump __entry_memory");
-        emit_noindent("@__entry_init");
-        nregs = 5;
-        for (int i = 0; i < vec_len(&globalzero); i++) {
-            int *pair = vec_get(&globalzero, i);
-            emit("r0 <- int %i", pair[0]);
-            emit("r2 <- int 0");
-            emit("set r1 r0 r2");
-        }
-        for (int i = 0; i < vec_len(&globalinitval); i++) {
-            union {
-                int i;
-                Node *n;
-            } *pair = vec_get(&globalinitval, i);
-            Node *initval = pair[1].n;
-            int val = emit_expr(initval);
-            for (int o = 0; o < initval->ty->size; o++) {
-                emit("r0 <- int %i", pair[0].i + o);
-                emit("set r1 r0 r%i", val + o);
-            }
-        }
-        for (int i = 0; i < vec_len(&globalinit); i++) {
-            int *pair = vec_get(&globalinit, i);
-            emit("r0 <- int %i", pair[0]);
-            emit("r2 <- int %i", pair[1]);
-            // printf("set %i %i\n", pair[0], pair[1]);
-            emit("set r1 r0 r2");
-        }
-        emit("jump __entry_main");
-        emit_noindent("@__entry_memory");
-        emit("r1 <- int 12500000");
-        emit("r1 <- arr r1");
-        emit("r2 <- int %i", initmem + 16);
-        emit("r0 <- int 1");
+// Lowers an initializer that is not a constant into the entry code right
+// away, so that nothing is left pointing into the AST.
+static void emit_initval(int addr, Node *initval) {
+    Buffer *out = outbuf;
+    int regs = nregs;
+    outbuf = make_buffer();
+    nregs = initregs;
+    int val = emit_expr(initval);
+    for (int o = 0; o < initval->ty->size; o++) {
+        emit("r0 <- int %i", addr + o);
+        emit("set r1 r0 r%i", val + o);
+    }
+    buf_write(outbuf, '\0');
+    for (char *p = buf_body(outbuf); *p;) {
+        char *nl = strchr(p, '\n');
+        vec_push(&initcode, format("%.*s", (int)(nl - p), p));
+        p = nl + 1;
+    }
+    initregs = nregs;
+    nregs = regs;
+    outbuf = out;
+}
+
+static void emit_entry(char *fname) {
+    emit_noindent("@__entry");
+    emit("jump __entry_memory");
+    emit_noindent("@__entry_init");
+    nregs = 5;
+    if (profile_generate)
+        emit("r0 <- call func.__profile_init r1");
+    for (int i = 0; i < vec_len(&globalzero); i++) {
+        int *pair = vec_get(&globalzero, i);
+        emit("r0 <- int %i", pair[0]);
+        emit("r2 <- int 0");
         emit("set r1 r0 r2");
-        emit("jump __entry_init");
-        emit_noindent("@__entry_main");
-        // emit_pre_call();
-        emit("r0 <- call func.%s r1", func->fname);
-        // emit_post_call();
-        emit("exit");
-    }
-    emit_noindent("func func.%s", func->fname, nregs);
+    }
+    for (int i = 0; i < vec_len(&globalinit); i++) {
+        int *pair = vec_get(&globalinit, i);
+        emit("r0 <- int %i", pair[0]);
+        emit("r2 <- int %i", pair[1]);
+        // printf("set %i %i\n", pair[0], pair[1]);
+        emit("set r1 r0 r2");
+    }
+    // Initializers that call functions push their arguments at r2 as a
+    // function body does, so it must hold the top of the stack.
+    emit("r0 <- int 1");
+    emit("r2 <- get r1 r0");
+    for (int i = 0; i < vec_len(&initcode); i++)
+        emit_noindent("%s", (char *)vec_get(&initcode, i));
+    emit("jump __entry_main");
+    emit_noindent("@__entry_memory");
+    emit("r1 <- int %i", MEMORY_WORDS);
+    emit("r1 <- arr r1");
+    emit("r2 <- int %i", initmem + 16);
+    emit("r0 <- int 1");
+    emit("set r1 r0 r2");
+    emit("jump __entry_init");
+    emit_noindent("@__entry_main");
+    // emit_pre_call();
+    emit("r0 <- call func.%s r1", fname);
+    // emit_post_call();
+    emit_exit();
+}
+
+static void emit_func_prologue(Node *func) {
 #if defined(VM_DEBUG_CC_CALL)
     for (const char *c = func->fname; *c; c++) {
         emit("r0 <- int %i", (int)*c);
@@ -901,7 +1255,7 @@ static void emit_func_prologue(Node *func) {
     emit("putchar r0");
 #endif
     stackn = 0;
-    locals = EMPTY_MAP;
+    map_clear(&locals);
     nregs = 3;
     emit("r0 <- int 1");
     emit("r2 <- get r1 r0");
@@ -914,19 +1268,56 @@ static void emit_func_prologue(Node *func) {
         stackn += 64;
     }
     curfunc = func->fname;
+    map_clear(&globalregs);
+    regglobals = register_globals(func->fname);
+    if (regglobals) {
+        Vector *names = dict_keys(regglobals);
+        for (int i = 0; i < vec_len(names); i++)
+            map_put(&globalregs, vec_get(names, i), (void *)(size_t)nregs++);
+        emit_load_globals();
+    }
+    nlabels = 0;
+    if (profile_generate)
+        emit_profile_count(format("f %s", curfunc));
 }
 
 void emit_toplevel(Node *v) {
     if (v->kind == AST_FUNC) {
         stackn = 0;
+        // Objects get theirs when they are linked.
+        if (!strcmp(v->fname, "_start") && !objmode)
+            emit_entry(v->fname);
+        if (v->sourceLoc)
+            map_put(&funclocs, v->fname, format("%s:%d", v->sourceLoc->file, v->sourceLoc->line));
+        emit_noindent("func func.%s", v->fname);
+        Buffer *out = outbuf;
+        outbuf = make_buffer();
+        memtags = true;
         emit_func_prologue(v);
         emit_expr(v->body);
+        emit_store_globals();
         emit("r0 <- nil");
         emit("ret r0");
+        memtags = false;
+        regglobals = NULL;
+        map_clear(&globalregs);
+        Buffer *body = outbuf;
+        outbuf = out;
+        Deferred *d = malloc(sizeof(Deferred));
+        *d = (Deferred){v->fname, body, outbuf};
+        vec_push(&deferred, d);
+        deferredsize += buf_len(body);
+        outbuf = make_buffer();
         emit_noindent("end\n");
+        map_put(&proflabels, v->fname, (void *)(intptr_t)nlabels);
+        if (deferredsize >= DEFERRED_BYTES)
+            optimize_deferred();
     } else if (v->kind == AST_DECL) {
         int base = initmem;
         map_put(&globals, v->declvar->varname, (void *)(size_t)base);
+        vec_push(&globalnames, v->declvar->varname);
+        if (v->declvar->ty->isstatic)
+            map_put(&staticglobals, v->declvar->varname, (void *)1);
         initmem += v->declvar->ty->size;
         if (v->declinit) {
             if (vec_len(v->declinit) != 0) {
@@ -938,13 +1329,15 @@ void emit_toplevel(Node *v) {
             }
             for (int i = 0; i < vec_len(v->declinit); i++) {
                 Node *init = vec_get(v->declinit, i);
-                union {
-                    int i;
-                    Node *n;
-                } *pair = malloc(sizeof(union {int i; Node *n; }) * 2);
-                pair[0].i = init->initoff + base;
-                pair[1].n = init->initval;
-                vec_push(&globalinitval, pair);
+                Node *val = init->initval;
+                if (val->kind == AST_LITERAL && is_inttype(val->ty) && val->ival == (int)val->ival) {
+                    int *pair = malloc(sizeof(int) * 2);
+                    pair[0] = init->initoff + base;
+                    pair[1] = val->ival;
+                    vec_push(&globalinit, pair);
+                    continue;
+                }
+                emit_initval(init->initoff + base, init->initval);
             }
             // error("unimplemented: global variable : %s", node2s(v));
             // warn("global `%s`: not nil", v->declvar->varname);
@@ -953,3 +1346,269 @@ void emit_toplevel(Node *v) {
         error("internal error");
     }
 }
+
+/*
+ * Parallel optimization
+ *
+ * Optimizing a function depends on nothing but its body, so emit_toplevel
+ * generates code in order, which lays out globals and string literals as
+ * before, and leaves the body to opt_func. Once the bodies waiting add up
+ * to DEFERRED_BYTES, and at emit_end, they are optimized in parallel jobs.
+ * Each job takes a run of functions next to each other and returns them
+ * with the output between them, and the runs are put together in order,
+ * so the output is the same for any number of jobs.
+ */
+
+static char *optimize_run(void *arg) {
+    int *run = arg;
+    Buffer *b = make_buffer();
+    for (int i = run[0]; i < run[1]; i++) {
+        Deferred *d = vec_get(&deferred, i);
+        if (i > run[0])
+            buf_append(b, buf_body(d->before), buf_len(d->before));
+        opt_func(b, d->name, d->body);
+    }
+    buf_write(b, '\0');
+    return buf_body(b);
+}
+
+// Splits the functions into runs of about the same size, one per job.
+static Vector *split_runs(void) {
+    int n = job_count();
+    Vector *runs = make_vector();
+    long size = 0;
+    int from = 0;
+    for (int i = 0; i < vec_len(&deferred); i++) {
+        size += buf_len(((Deferred *)vec_get(&deferred, i))->body);
+        if (i + 1 == vec_len(&deferred) || size * n >= deferredsize * (vec_len(runs) + 1)) {
+            int *run = malloc(sizeof(int) * 2);
+            run[0] = from;
+            run[1] = from = i + 1;
+            vec_push(runs, run);
+        }
+    }
+    return runs;
+}
+
+static void optimize_deferred(void) {
+    if (vec_len(&deferred) == 0)
+        return;
+    Vector *runs = split_runs();
+    Vector *code = run_jobs(runs, optimize_run);
+    // The output before the first function goes on growing.
+    Buffer *tail = outbuf;
+    outbuf = ((Deferred *)vec_head(&deferred))->before;
+    for (int i = 0; i < vec_len(runs); i++) {
+        int from = ((int *)vec_get(runs, i))[0];
+        Deferred *d = vec_get(&deferred, from);
+        if (from > 0)
+            buf_append(outbuf, buf_body(d->before), buf_len(d->before));
+        buf_printf(outbuf, "%s", (char *)vec_get(code, i));
+        free(vec_get(code, i));
+    }
+    // Unlike buf_append, this leaves the output terminated.
+    buf_printf(outbuf, "%.*s", buf_len(tail), buf_body(tail));
+    buf_free(tail);
+    for (int i = 0; i < vec_len(&deferred); i++) {
+        Deferred *d = vec_get(&deferred, i);
+        buf_free(d->body);
+        if (i > 0)
+            buf_free(d->before);
+        free(d);
+    }
+    deferred = EMPTY_VECTOR;
+    deferredsize = 0;
+    flush_output();
+}
+
+/*
+ * Precompiled runtime
+ *
+ * cache.c keeps the runtime library compiled across runs, as the assembly
+ * of its functions and the memory it takes. The memory is described by
+ * these lines, which put the globals back where they were when the
+ * runtime was compiled:
+ *
+ *   memory <words taken>
+ *   global <name> <address>
+ *   local <name> <address>    (static)
+ *   extern <name> <address>   (only in objects, see link.c)
+ *   zero <address>
+ *   word <address> <value>
+ *   init <instruction>    (computes initializers that are not constants)
+ */
+
+void save_layout(Buffer *b) {
+    buf_printf(b, "memory %d\n", initmem);
+    for (int i = 0; i < vec_len(&globalnames); i++) {
+        char *name = vec_get(&globalnames, i);
+        char *kind = map_get(&staticglobals, name) ? "local" : "global";
+        buf_printf(b, "%s %s %d\n", kind, name, (int)(size_t)map_get(&globals, name));
+    }
+    for (int i = 0; i < vec_len(&externs); i++) {
+        char *name = vec_get(&externs, i);
+        buf_printf(b, "extern %s %ld\n", name, OBJ_EXTERN + (long)i * OBJ_EXTERN_SIZE);
+    }
+    for (int i = 0; i < vec_len(&globalzero); i++)
+        buf_printf(b, "zero %d\n", *(int *)vec_get(&globalzero, i));
+    for (int i = 0; i < vec_len(&globalinit); i++) {
+        int *pair = vec_get(&globalinit, i);
+        buf_printf(b, "word %d %d\n", pair[0], pair[1]);
+    }
+    for (int i = 0; i < vec_len(&initcode); i++)
+        buf_printf(b, "init %s\n", (char *)vec_get(&initcode, i));
+}
+
+// Forgets the globals emitted so far.
+void reset_layout(void) {
+    globals = EMPTY_MAP;
+    globalnames = EMPTY_VECTOR;
+    staticglobals = EMPTY_MAP;
+    externs = EMPTY_VECTOR;
+    objmode = false;
+    globalzero = EMPTY_VECTOR;
+    globalinit = EMPTY_VECTOR;
+    initcode = EMPTY_VECTOR;
+    initregs = 5;
+    initmem = 16;
+}
+
+// Starts a translation unit compiled on its own into an object, whose
+// globals are laid out from OBJ_DATA.
+void begin_object(void) {
+    reset_layout();
+    objmode = true;
+    initmem = OBJ_DATA;
+}
+
+// Takes `words` of memory after the globals so far for the globals of an
+// object, and returns where they start.
+int reserve_memory(int words) {
+    int r = initmem;
+    initmem += words;
+    return r;
+}
+
+// Returns the address of a global laid out so far, or 0 if there is none.
+int find_global(char *name) {
+    return (int)(size_t)map_get(&globals, name);
+}
+
+// Emits the entry code of a program linked from objects without start.c.
+void emit_start(void) {
+    emit_entry("_start");
+}
+
+// Applies one line written by save_layout. Returns false if it is not one.
+bool load_layout(char *line) {
+    char name[256];
+    int a, b;
+    if (sscanf(line, "memory %d", &a) == 1) {
+        initmem = a;
+    } else if (sscanf(line, "global %255s %d", name, &a) == 2 || sscanf(line, "local %255s %d", name, &a) == 2) {
+        map_put(&globals, strdup(name), (void *)(size_t)a);
+        vec_push(&globalnames, strdup(name));
+    } else if (sscanf(line, "zero %d", &a) == 1) {
+        int *pair = malloc(sizeof(int) * 1);
+        pair[0] = a;
+        vec_push(&globalzero, pair);
+    } else if (sscanf(line, "word %d %d", &a, &b) == 2) {
+        int *pair = malloc(sizeof(int) * 2);
+        pair[0] = a;
+        pair[1] = b;
+        vec_push(&globalinit, pair);
+    } else if (!strncmp(line, "init ", 5)) {
+        vec_push(&initcode, strdup(line + 5));
+    } else {
+        return false;
+    }
+    return true;
+}
+
+/*
+ * Profile output
+ *
+ * The VM can only print characters, so with -fprofile-generate the counters
+ * are printed in the format read by profile.c when _start returns.
+ */
+
+static void emit_putchars(char *s) {
+    for (; *s; s++) {
+        emit("r6 <- int %i", *s);
+        emit("putchar r6");
+    }
+}
+
+static void emit_profile_funcs(void) {
+    int base = MEMORY_WORDS - PROFILE_WORDS;
+    emit_noindent("func func.__profile_init");
+    emit("r2 <- int %i", base);
+    emit("r3 <- int %i", base + vec_len(&profkeys));
+    emit("r4 <- int 1");
+    emit("r0 <- int 0");
+    emit_noindent("@__profile_init.loop");
+    emit("blt r2 r3 __profile_init.done __profile_init.body");
+    emit_noindent("@__profile_init.body");
+    emit("set r1 r2 r0");
+    emit("r2 <- add r2 r4");
+    emit("jump __profile_init.loop");
+    emit_noindent("@__profile_init.done");
+    emit("ret r0");
+    emit_noindent("end\n");
+
+    // Prints the number on top of the stack in decimal.
+    emit_noindent("func func.__profile_num");
+    emit("r0 <- int 1");
+    emit("r2 <- get r1 r0");
+    emit("r3 <- get r1 r2");
+    emit("r4 <- int 1");
+    emit("r5 <- int 10");
+    emit("r7 <- int 48");
+    emit("r9 <- int 1");
+    emit("r0 <- int 0");
+    emit_noindent("@__profile_num.up");
+    emit("r6 <- mul r4 r5");
+    emit("blt r3 r6 __profile_num.grow __profile_num.digit");
+    emit_noindent("@__profile_num.grow");
+    emit("r4 <- reg r6");
+    emit("jump __profile_num.up");
+    // div is not an integer division, so divide out the remainder first.
+    emit_noindent("@__profile_num.digit");
+    emit("r8 <- mod r3 r4");
+    emit("r6 <- sub r3 r8");
+    emit("r6 <- div r6 r4");
+    emit("r6 <- add r6 r7");
+    emit("putchar r6");
+    emit("r3 <- reg r8");
+    emit("beq r4 r9 __profile_num.next __profile_num.done");
+    emit_noindent("@__profile_num.next");
+    emit("r4 <- div r4 r5");
+    emit("jump __profile_num.digit");
+    emit_noindent("@__profile_num.done");
+    emit("ret r0");
+    emit_noindent("end\n");
+
+    emit_noindent("func func.__profile_dump");
+    emit("r0 <- int 1");
+    emit("r2 <- get r1 r0");
+    emit("r5 <- int 0");
+    emit_putchars("\nminivm-profile 1\n");
+    for (int i = 0; i < vec_len(&profkeys); i++) {
+        char *key = vec_get(&profkeys, i);
+        emit("r3 <- int %i", base + i);
+        emit("r4 <- get r1 r3");
+        emit("beq r4 r5 __profile_dump.%i __profile_dump.%i.skip", i, i);
+        emit_noindent("@__profile_dump.%i", i);
+        emit_putchars(key);
+        emit_putchars(" ");
+        emit("set r1 r2 r4");
+        emit("r0 <- call func.__profile_num r1");
+        if (key[0] == 'f')
+            emit_putchars(format(" %d", (int)(intptr_t)map_get(&proflabels, key + 2)));
+        emit_putchars("\n");
+        emit_noindent("@__profile_dump.%i.skip", i);
+    }
+    emit_putchars("minivm-profile end\n");
+    emit("ret r5");
+    emit_noindent("end\n");
+}
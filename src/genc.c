@@ -0,0 +1,247 @@
+/*
+ * C output for -o <file>.c.
+ *
+ * The program is translated instruction by instruction into portable C
+ * that a native compiler can optimize. Each function becomes a C function
+ * of one double, VM registers become its locals, labels become C labels
+ * and branches become gotos. The memory array made by the entry code is a
+ * single array of doubles that every function reaches directly. Function
+ * values are indexes into a table of the functions, where index 0 belongs
+ * to the toplevel code so that 0 stays a null pointer.
+ */
+
+#include "8cc.h"
+
+static Vector *funcs;  // pairs of a name and the body, the toplevel code first
+static Map *funcindex;  // name -> index in funcs
+
+static int func_index(char *name) {
+    void *r = map_get(funcindex, name);
+    if (!r)
+        error("cannot translate to C: call of undefined function %s", name);
+    return (intptr_t)r;
+}
+
+static char *label(Map *labels, char *name) {
+    void *r = map_get(labels, name);
+    if (!r)
+        error("cannot translate to C: jump to unknown label %s", name);
+    return format("L%d", (int)(intptr_t)r);
+}
+
+static char *binop(int op) {
+    switch (op) {
+        case I_ADD:
+            return "+";
+        case I_SUB:
+            return "-";
+        case I_MUL:
+            return "*";
+        case I_DIV:
+            return "/";
+        case I_BOR:
+            return "|";
+        case I_BAND:
+            return "&";
+        case I_BXOR:
+            return "^";
+        case I_BSHL:
+            return "<<";
+        case I_BSHR:
+            return ">>";
+    }
+    return NULL;
+}
+
+static void emit_insn(FILE *out, Map *labels, Insn *in, bool top) {
+    int *a = in->args;
+    char *d = format("r%d", in->dst);
+    switch (in->op) {
+        case I_LABEL:
+            fprintf(out, "%s:;\n", label(labels, in->sym));
+            return;
+        case I_INT:
+            fprintf(out, "    %s = %ld;\n", d, in->imm);
+            return;
+        case I_NIL:
+            fprintf(out, "    %s = 0;\n", d);
+            return;
+        case I_REG:
+            fprintf(out, "    %s = r%d;\n", d, a[0]);
+            return;
+        case I_ADD:
+        case I_SUB:
+        case I_MUL:
+        case I_DIV:
+            fprintf(out, "    %s = r%d %s r%d;\n", d, a[0], binop(in->op), a[1]);
+            return;
+        case I_MOD:
+            fprintf(out, "    %s = fmod(r%d, r%d);\n", d, a[0], a[1]);
+            return;
+        case I_BOR:
+        case I_BAND:
+        case I_BXOR:
+        case I_BSHL:
+        case I_BSHR:
+            fprintf(out, "    %s = (double)((int64_t)r%d %s (int64_t)r%d);\n", d, a[0], binop(in->op), a[1]);
+            return;
+        case I_GET:
+            fprintf(out, "    %s = mem[at(r%d)];\n", d, a[1]);
+            return;
+        case I_SET:
+            fprintf(out, "    mem[at(r%d)] = r%d;\n", a[1], a[2]);
+            return;
+        case I_ADDR:
+            fprintf(out, "    %s = %d;\n", d, func_index(in->sym));
+            return;
+        case I_ARR:
+            if (!top)
+                error("cannot translate to C: array made outside the toplevel code");
+            fprintf(out, "    %s = arr(r%d);\n", d, a[0]);
+            return;
+        case I_CALL:
+            fprintf(out, "    %s = f%d(r%d);\n", d, func_index(in->sym), a[0]);
+            return;
+        case I_DCALL:
+            fprintf(out, "    %s = dcall(r%d, r%d);\n", d, a[0], a[1]);
+            return;
+        case I_GETCHAR:
+            fprintf(out, "    %s = getchar();\n", d);
+            return;
+        case I_PUTCHAR:
+            fprintf(out, "    putchar((int)(int64_t)r%d);\n", a[0]);
+            return;
+        case I_JUMP:
+            fprintf(out, "    goto %s;\n", label(labels, in->target[0]));
+            return;
+        case I_BEQ:
+        case I_BLT:
+            fprintf(out, "    if (r%d %s r%d)\n        goto %s;\n    goto %s;\n", a[0], in->op == I_BEQ ? "==" : "<", a[1],
+                    label(labels, in->target[1]), label(labels, in->target[0]));
+            return;
+        case I_RET:
+            if (top)
+                error("cannot translate to C: ret in the toplevel code");
+            fprintf(out, "    return r%d;\n", a[0]);
+            return;
+        case I_EXIT:
+            fprintf(out, "    exit(0);\n");
+            return;
+    }
+}
+
+static void use_reg(bool **used, int *nregs, int r) {
+    if (r >= *nregs) {
+        *used = realloc(*used, r + 1);
+        memset(*used + *nregs, 0, r + 1 - *nregs);
+        *nregs = r + 1;
+    }
+    (*used)[r] = true;
+}
+
+static void emit_func(FILE *out, int index) {
+    void **pair = vec_get(funcs, index);
+    Vector *insns = pair[1];
+    bool top = index == 0;
+    Map *labels = make_map();
+    Map *targets = make_map();
+    bool *used = NULL;
+    int nregs = 0;
+    for (int i = 0; i < vec_len(insns); i++) {
+        Insn *in = vec_get(insns, i);
+        if (in->op == I_LABEL)
+            map_put(labels, in->sym, (void *)(intptr_t)(map_len(labels) + 1));
+        if (in->op == I_JUMP || in->op == I_BEQ || in->op == I_BLT)
+            map_put(targets, in->target[0], (void *)1);
+        if (in->op == I_BEQ || in->op == I_BLT)
+            map_put(targets, in->target[1], (void *)1);
+        if (in->dst >= 0)
+            use_reg(&used, &nregs, in->dst);
+        for (int j = 0; j < in->nargs; j++)
+            use_reg(&used, &nregs, in->args[j]);
+    }
+    fprintf(out, "\n// %s\n", (char *)pair[0]);
+    if (top)
+        fprintf(out, "int main(void) {\n");
+    else
+        fprintf(out, "static double f%d(double r1) {\n", index);
+    for (int i = 0; i < nregs; i++)
+        if (used[i] && (top || i != 1))
+            fprintf(out, "    double r%d = 0;\n", i);
+    for (int i = 0; i < vec_len(insns); i++) {
+        Insn *in = vec_get(insns, i);
+        // Labels nothing jumps to would only draw warnings.
+        if (in->op == I_LABEL && !map_get(targets, in->sym))
+            continue;
+        emit_insn(out, labels, in, top);
+    }
+    if (top)
+        fprintf(out, "    return 0;\n");
+    else
+        fprintf(out, "    fail(\"function ended without ret\");\n    return 0;\n");
+    fprintf(out, "}\n");
+}
+
+static void emit_runtime(FILE *out) {
+    fprintf(out,
+            "#include <math.h>\n"
+            "#include <stdint.h>\n"
+            "#include <stdio.h>\n"
+            "#include <stdlib.h>\n"
+            "\n"
+            "static double *mem;\n"
+            "static uint64_t memsize;\n"
+            "\n"
+            "static void fail(const char *msg) {\n"
+            "    fflush(stdout);\n"
+            "    fprintf(stderr, \"%%s\\n\", msg);\n"
+            "    exit(1);\n"
+            "}\n"
+            "\n"
+            "static inline uint64_t at(double i) {\n"
+            "    uint64_t n = (uint64_t)(int64_t)i;\n"
+            "    if (n >= memsize)\n"
+            "        fail(\"memory access out of bounds\");\n"
+            "    return n;\n"
+            "}\n"
+            "\n"
+            "static double arr(double n) {\n"
+            "    memsize = n > 0 ? (uint64_t)n : 0;\n"
+            "    mem = calloc(memsize ? memsize : 1, sizeof(double));\n"
+            "    if (!mem)\n"
+            "        fail(\"out of memory\");\n"
+            "    return 0;\n"
+            "}\n");
+}
+
+static void emit_table(FILE *out) {
+    fprintf(out, "\nstatic double (*const table[])(double) = {\n    0,\n");
+    for (int i = 1; i < vec_len(funcs); i++)
+        fprintf(out, "    f%d,\n", i);
+    fprintf(out,
+            "};\n"
+            "\n"
+            "static inline double dcall(double f, double arg) {\n"
+            "    uint64_t n = (uint64_t)(int64_t)f;\n"
+            "    if (n == 0 || n >= sizeof(table) / sizeof(table[0]))\n"
+            "        fail(\"indirect call out of bounds\");\n"
+            "    return table[n](arg);\n"
+            "}\n");
+}
+
+void emit_c(FILE *out, char *src) {
+    funcs = parse_program(src);
+    if (!funcs)
+        error("cannot translate to C: unknown instruction");
+    funcindex = make_map();
+    for (int i = 0; i < vec_len(funcs); i++)
+        map_put(funcindex, ((void **)vec_get(funcs, i))[0], (void *)(intptr_t)i);
+    emit_runtime(out);
+    fprintf(out, "\n");
+    for (int i = 1; i < vec_len(funcs); i++)
+        fprintf(out, "static double f%d(double r1);\n", i);
+    emit_table(out);
+    for (int i = 1; i < vec_len(funcs); i++)
+        emit_func(out, i);
+    emit_func(out, 0);
+}
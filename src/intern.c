@@ -0,0 +1,89 @@
+/*
+ * Interned strings.
+ *
+ * The same identifiers are looked up over and over: in the macros and
+ * hidesets of the preprocessor, then in the scopes, tags and labels of the
+ * parser. The lexer interns every identifier it reads, so there is one copy
+ * of each distinct name, kept until the compiler exits together with its
+ * hash. It interns the text of numbers as well, which repeat as much.
+ * Two interned strings are equal only if they are the same pointer: symbol
+ * maps and sets compare their keys by address and take the hash from here
+ * instead of hashing the key again.
+ *
+ * Names the compiler looks up that do not come from the lexer, such as
+ * keywords, builtins and __func__, are interned where they are made.
+ */
+
+#include "8cc.h"
+
+#define INIT_SIZE 1024
+
+typedef struct {
+    uint32_t hash;
+    uint32_t len;
+    char body[];
+} Interned;
+
+static Interned **table;
+static int size;
+static int nelem;
+static Arena *strings;
+
+static uint32_t hash_bytes(char *p, int len) {
+    // FNV hash, as in map.c
+    uint32_t r = 2166136261;
+    for (int i = 0; i < len; i++) {
+        r ^= p[i];
+        r *= 16777619;
+    }
+    return r;
+}
+
+static void rehash(void) {
+    int newsize = size ? size * 2 : INIT_SIZE;
+    Interned **t = calloc(newsize, sizeof(Interned *));
+    for (int i = 0; i < size; i++) {
+        Interned *e = table[i];
+        if (!e)
+            continue;
+        int j = e->hash & (newsize - 1);
+        while (t[j])
+            j = (j + 1) & (newsize - 1);
+        t[j] = e;
+    }
+    free(table);
+    table = t;
+    size = newsize;
+}
+
+// Returns the interned copy of the first `len` bytes of `s`.
+char *intern_len(char *s, int len) {
+    if (nelem * 2 >= size)
+        rehash();
+    uint32_t h = hash_bytes(s, len);
+    int i = h & (size - 1);
+    for (; table[i]; i = (i + 1) & (size - 1)) {
+        Interned *e = table[i];
+        if (e->hash == h && e->len == (uint32_t)len && !memcmp(e->body, s, len))
+            return e->body;
+    }
+    if (!strings)
+        strings = make_arena("strings");
+    Interned *e = arena_alloc(strings, MEM_STRING, sizeof(Interned) + len + 1);
+    e->hash = h;
+    e->len = len;
+    memcpy(e->body, s, len);
+    e->body[len] = '\0';
+    table[i] = e;
+    nelem++;
+    return e->body;
+}
+
+char *intern(char *s) {
+    return intern_len(s, strlen(s));
+}
+
+// The hash of an interned string.
+uint32_t intern_hash(char *s) {
+    return ((Interned *)(s - offsetof(Interned, body)))->hash;
+}
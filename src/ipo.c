@@ -0,0 +1,2150 @@
+/*
+ * Whole-program passes.
+ *
+ * main.c parses every input, including the runtime, before anything is
+ * emitted, so the passes here see all toplevel definitions of the program
+ * at once.
+ */
+
+#include "8cc.h"
+
+static struct {
+    int funcs;
+    int globals;
+    int consts;
+    int params;
+    int returns;
+    int calls;
+    int specialized;
+    int pure;
+    int readonly;
+    int direct;
+    int guarded;
+    int evaluated;
+    int promoted;
+    int constglobals;
+    int registers;
+    int inlined;
+} stats;
+
+static Map readonly_funcs = EMPTY_MAP;
+
+/*
+ * AST walking
+ *
+ * The children of a node are reached through its slots, numbered from 0,
+ * so that walkers can replace them in place. A slot may hold NULL, such as
+ * the else branch of an if without one. Nothing is allocated on the way.
+ */
+
+int ast_nslots(Node *node) {
+    switch (node->kind) {
+        case AST_LITERAL:
+        case AST_GVAR:
+        case AST_FUNCDESG:
+        case AST_TYPEDEF:
+        case AST_GOTO:
+        case AST_LABEL:
+        case OP_LABEL_ADDR:
+            return 0;
+        case AST_LVAR:
+            return node->lvarinit ? vec_len(node->lvarinit) : 0;
+        case AST_FUNCPTR_CALL:
+            return 1 + vec_len(node->args);
+        case AST_FUNCALL:
+            return vec_len(node->args);
+        case AST_DECL:
+            return node->declinit ? vec_len(node->declinit) : 0;
+        case AST_IF:
+        case AST_TERNARY:
+            return 3;
+        case AST_COMPOUND_STMT:
+            return vec_len(node->stmts);
+        case AST_FUNC:
+        case AST_INIT:
+        case AST_RETURN:
+        case AST_STRUCT_REF:
+        case AST_CONV:
+        case AST_ADDR:
+        case AST_DEREF:
+        case AST_COMPUTED_GOTO:
+        case OP_CAST:
+        case OP_PRE_INC:
+        case OP_PRE_DEC:
+        case OP_POST_INC:
+        case OP_POST_DEC:
+        case '!':
+        case '~':
+            return 1;
+        default:
+            return 2;
+    }
+}
+
+// The i-th child slot of a node, for i below ast_nslots(node).
+Node **ast_slot(Node *node, int i) {
+    switch (node->kind) {
+        case AST_LVAR:
+            return (Node **)vec_body(node->lvarinit) + i;
+        case AST_FUNCPTR_CALL:
+            if (i == 0)
+                return &node->fptr;
+            return (Node **)vec_body(node->args) + i - 1;
+        case AST_FUNCALL:
+            return (Node **)vec_body(node->args) + i;
+        case AST_DECL:
+            return (Node **)vec_body(node->declinit) + i;
+        case AST_IF:
+        case AST_TERNARY:
+            return i == 0 ? &node->cond : i == 1 ? &node->then : &node->els;
+        case AST_COMPOUND_STMT:
+            return (Node **)vec_body(node->stmts) + i;
+        case AST_FUNC:
+            return &node->body;
+        case AST_INIT:
+            return &node->initval;
+        case AST_RETURN:
+            return &node->retval;
+        case AST_STRUCT_REF:
+            return &node->struc;
+        case AST_CONV:
+        case AST_ADDR:
+        case AST_DEREF:
+        case AST_COMPUTED_GOTO:
+        case OP_CAST:
+        case OP_PRE_INC:
+        case OP_PRE_DEC:
+        case OP_POST_INC:
+        case OP_POST_DEC:
+        case '!':
+        case '~':
+            return &node->operand;
+        default:
+            return i == 0 ? &node->left : &node->right;
+    }
+}
+
+// Returns the first child of `node` from slot *i on that is not NULL, and
+// moves *i past it, or returns NULL when there is none:
+//
+//   for (int i = 0; (kid = next_child(node, &i));)
+Node *next_child(Node *node, int *i) {
+    for (int n = ast_nslots(node); *i < n;) {
+        Node *kid = *ast_slot(node, (*i)++);
+        if (kid)
+            return kid;
+    }
+    return NULL;
+}
+
+/*
+ * Unreachable code and data
+ */
+
+typedef struct {
+    Map *funcs;    // name -> Vector of AST_FUNC
+    Map *globals;  // name -> Vector of AST_DECL
+    Map *live;
+    Vector *work;
+} Reach;
+
+static void add_def(Map *m, char *name, Node *node) {
+    Vector *v = map_get(m, name);
+    if (!v) {
+        v = make_vector();
+        map_put(m, name, v);
+    }
+    vec_push(v, node);
+}
+
+// Functions and global variables share one namespace in the output, so a
+// reference to a name keeps both kinds of definitions alive.
+static void mark_live(Reach *r, char *name) {
+    if (map_get(r->live, name))
+        return;
+    map_put(r->live, name, (void *)1);
+    vec_push(r->work, name);
+}
+
+static void mark_refs(Reach *r, Node *node) {
+    if (!node)
+        return;
+    if (node->kind == AST_FUNCALL || node->kind == AST_FUNCDESG || (node->kind == AST_FUNCPTR_CALL && node->fname))
+        mark_live(r, node->fname);
+    if (node->kind == AST_GVAR)
+        mark_live(r, node->varname);
+    Node *kid;
+    for (int i = 0; (kid = next_child(node, &i));)
+        mark_refs(r, kid);
+}
+
+static void mark_defs(Reach *r, Vector *defs) {
+    for (int i = 0; defs && i < vec_len(defs); i++)
+        mark_refs(r, vec_get(defs, i));
+}
+
+// Drops functions and global variables that cannot be reached from _start
+// through calls, function designators and global references.
+static Vector *remove_unreachable(Vector *toplevels) {
+    Reach r;
+    r.funcs = make_map();
+    r.globals = make_map();
+    r.live = make_map();
+    r.work = make_vector();
+    for (int i = 0; i < vec_len(toplevels); i++) {
+        Node *v = vec_get(toplevels, i);
+        if (v->kind == AST_FUNC)
+            add_def(r.funcs, v->fname, v);
+        else
+            add_def(r.globals, v->declvar->varname, v);
+    }
+    if (!map_get(r.funcs, "_start"))
+        return toplevels;
+    mark_live(&r, "_start");
+    while (vec_len(r.work)) {
+        char *name = vec_pop(r.work);
+        mark_defs(&r, map_get(r.funcs, name));
+        mark_defs(&r, map_get(r.globals, name));
+    }
+
+    Vector *out = make_vector();
+    for (int i = 0; i < vec_len(toplevels); i++) {
+        Node *v = vec_get(toplevels, i);
+        char *name = v->kind == AST_FUNC ? v->fname : v->declvar->varname;
+        if (map_get(r.live, name))
+            vec_push(out, v);
+        else if (v->kind == AST_FUNC)
+            stats.funcs++;
+        else
+            stats.globals++;
+    }
+    return out;
+}
+
+/*
+ * Interprocedural optimization
+ *
+ * Functions that are defined once, never have their address taken and are
+ * not variadic are "local": every call to them is visible, so their
+ * parameters and return values can be changed together with the call
+ * sites.
+ */
+
+#define SPECIALIZE_BUDGET 200  // AST nodes of a function worth cloning
+#define SPECIALIZE_MAX 4       // clones made of one function
+
+enum {
+    EFFECT_PURE,   // depends on nothing but its arguments
+    EFFECT_READ,   // may read memory
+    EFFECT_WRITE,  // may write memory or do I/O
+};
+
+typedef struct {
+    Node *call;
+    bool used;  // the value of the call is used
+} Site;
+
+typedef struct {
+    Node *func;
+    int ndefs;
+    bool addrtaken;
+    Vector *sites;
+    int effect;
+    bool finite;  // known to return: no loops and no recursion
+    int nclones;
+} FuncInfo;
+
+static Map *infos;
+
+static FuncInfo *func_info(char *name) {
+    FuncInfo *fi = map_get(infos, name);
+    if (!fi) {
+        fi = calloc(1, sizeof(FuncInfo));
+        fi->sites = make_vector();
+        map_put(infos, name, fi);
+    }
+    return fi;
+}
+
+static bool is_void(Type *ty) {
+    return ty->kind == KIND_VOID;
+}
+
+// Returns whether the value of the child in `slot` of `node` is used,
+// given whether the value of `node` itself is.
+static bool slot_used(Node *node, Node **slot, bool used) {
+    switch (node->kind) {
+        case AST_FUNC:
+        case AST_COMPOUND_STMT:
+            return false;
+        case AST_IF:
+            return slot == &node->cond;
+        case ',':
+            return slot == &node->left ? false : used;
+        case AST_CONV:
+        case OP_CAST:
+            return is_void(node->ty) ? false : used;
+    }
+    return true;
+}
+
+static void collect(Node *node, bool used) {
+    if (node->kind == AST_FUNCALL) {
+        Site *site = malloc(sizeof(Site));
+        site->call = node;
+        site->used = used;
+        vec_push(func_info(node->fname)->sites, site);
+    }
+    if (node->kind == AST_FUNCDESG)
+        func_info(node->fname)->addrtaken = true;
+    for (int i = 0; i < ast_nslots(node); i++) {
+        Node **slot = ast_slot(node, i);
+        if (*slot)
+            collect(*slot, slot_used(node, slot, used));
+    }
+}
+
+static Node *make_literal(Type *ty, long val) {
+    Node *r = malloc(sizeof(Node));
+    *r = (Node){AST_LITERAL, ty, .ival = val};
+    return r;
+}
+
+static Node *make_compound(Vector *stmts) {
+    Node *r = malloc(sizeof(Node));
+    *r = (Node){AST_COMPOUND_STMT, .stmts = stmts};
+    return r;
+}
+
+int tree_size(Node *node) {
+    int r = 1;
+    Node *kid;
+    for (int i = 0; (kid = next_child(node, &i));)
+        r += tree_size(kid);
+    return r;
+}
+
+static bool has_kind(Node *node, int kind) {
+    if (node->kind == kind)
+        return true;
+    Node *kid;
+    for (int i = 0; (kid = next_child(node, &i));)
+        if (has_kind(kid, kind))
+            return true;
+    return false;
+}
+
+static int count_uses(Node *node, Node *var) {
+    if (node == var)
+        return 1;
+    int r = 0;
+    Node *kid;
+    for (int i = 0; (kid = next_child(node, &i));)
+        r += count_uses(kid, var);
+    return r;
+}
+
+static bool int_literal(Node *node, long *val) {
+    while ((node->kind == AST_CONV || node->kind == OP_CAST) && is_inttype(node->ty) && is_inttype(node->operand->ty))
+        node = node->operand;
+    if (node->kind != AST_LITERAL || !is_inttype(node->ty))
+        return false;
+    *val = node->ival;
+    return true;
+}
+
+Node *lvalue_var(Node *node) {
+    for (;;) {
+        if (node->kind == AST_STRUCT_REF)
+            node = node->struc;
+        else if (node->kind == AST_CONV || node->kind == OP_CAST)
+            node = node->operand;
+        else
+            return node->kind == AST_LVAR ? node : NULL;
+    }
+}
+
+// Records the names of variables that are assigned or whose address is
+// taken.
+static void scan_vars(Node *node, Map *pinned) {
+    Node *var = NULL;
+    if (node->kind == '=')
+        var = lvalue_var(node->left);
+    else if (node->kind == OP_PRE_INC || node->kind == OP_PRE_DEC || node->kind == OP_POST_INC || node->kind == OP_POST_DEC || node->kind == AST_ADDR)
+        var = lvalue_var(node->operand);
+    if (var)
+        map_put(pinned, var->varname, var);
+    Node *kid;
+    for (int i = 0; (kid = next_child(node, &i));)
+        scan_vars(kid, pinned);
+}
+
+static bool defined_once(FuncInfo *fi) {
+    return fi && fi->func && fi->ndefs == 1;
+}
+
+static int effect_of(Node *node) {
+    int r = EFFECT_PURE;
+    switch (node->kind) {
+        case '=':
+            if (!lvalue_var(node->left))
+                return EFFECT_WRITE;
+            break;
+        case OP_PRE_INC:
+        case OP_PRE_DEC:
+        case OP_POST_INC:
+        case OP_POST_DEC:
+            if (!lvalue_var(node->operand))
+                return EFFECT_WRITE;
+            break;
+        case AST_DEREF:
+        case AST_GVAR:
+            r = EFFECT_READ;
+            break;
+        case AST_FUNCPTR_CALL:
+            return EFFECT_WRITE;
+        case AST_FUNCALL: {
+            FuncInfo *fi = map_get(infos, node->fname);
+            if (!defined_once(fi))
+                return EFFECT_WRITE;
+            r = fi->effect;
+            break;
+        }
+    }
+    Node *kid;
+    for (int i = 0; (kid = next_child(node, &i)) && r != EFFECT_WRITE;) {
+        int e = effect_of(kid);
+        if (e > r)
+            r = e;
+    }
+    return r;
+}
+
+static bool calls_finite(Node *node) {
+    if (node->kind == AST_FUNCALL) {
+        FuncInfo *fi = map_get(infos, node->fname);
+        if (!defined_once(fi) || !fi->finite)
+            return false;
+    }
+    Node *kid;
+    for (int i = 0; (kid = next_child(node, &i));)
+        if (!calls_finite(kid))
+            return false;
+    return true;
+}
+
+// Effects start at pure and only grow, so recursive functions end up with
+// the effects of their other calls. Termination starts unknown and is only
+// proven bottom-up, so recursion never proves it.
+static void infer_effects(Vector *toplevels) {
+    for (bool changed = true; changed;) {
+        changed = false;
+        for (int i = 0; i < vec_len(toplevels); i++) {
+            Node *v = vec_get(toplevels, i);
+            if (v->kind != AST_FUNC)
+                continue;
+            FuncInfo *fi = map_get(infos, v->fname);
+            int e = fi->ndefs == 1 ? effect_of(v->body) : EFFECT_WRITE;
+            if (e > fi->effect) {
+                fi->effect = e;
+                changed = true;
+            }
+            if (!fi->finite && fi->ndefs == 1 && !has_kind(v->body, AST_LABEL) && calls_finite(v->body)) {
+                fi->finite = true;
+                changed = true;
+            }
+        }
+    }
+}
+
+// True if evaluating the expression can change anything but its value.
+static bool has_effects(Node *node) {
+    switch (node->kind) {
+        case '=':
+        case OP_PRE_INC:
+        case OP_PRE_DEC:
+        case OP_POST_INC:
+        case OP_POST_DEC:
+        case AST_FUNCPTR_CALL:
+        case AST_DECL:
+        case AST_RETURN:
+        case AST_GOTO:
+        case AST_COMPUTED_GOTO:
+        case AST_LABEL:
+            return true;
+        case AST_FUNCALL: {
+            FuncInfo *fi = map_get(infos, node->fname);
+            if (!defined_once(fi) || fi->effect == EFFECT_WRITE || !fi->finite)
+                return true;
+            break;
+        }
+    }
+    Node *kid;
+    for (int i = 0; (kid = next_child(node, &i));)
+        if (has_effects(kid))
+            return true;
+    return false;
+}
+
+static bool is_local(FuncInfo *fi) {
+    if (!defined_once(fi) || fi->addrtaken)
+        return false;
+    Node *f = fi->func;
+    if (f->ty->hasva || f->ty->oldstyle || !strcmp(f->fname, "_start") || !strcmp(f->fname, "main"))
+        return false;
+    for (int i = 0; i < vec_len(fi->sites); i++) {
+        Site *site = vec_get(fi->sites, i);
+        if (vec_len(site->call->args) != vec_len(f->params))
+            return false;
+    }
+    return true;
+}
+
+static void analyze(Vector *toplevels) {
+    Map *old = infos;
+    infos = make_map();
+    for (int i = 0; i < vec_len(toplevels); i++) {
+        Node *v = vec_get(toplevels, i);
+        if (v->kind != AST_FUNC)
+            continue;
+        FuncInfo *fi = func_info(v->fname);
+        fi->func = v;
+        fi->ndefs++;
+        FuncInfo *prev = old ? map_get(old, v->fname) : NULL;
+        fi->nclones = prev ? prev->nclones : 0;
+    }
+    for (int i = 0; i < vec_len(toplevels); i++)
+        collect(vec_get(toplevels, i), true);
+    infer_effects(toplevels);
+}
+
+static void replace_var(Node **slot, Node *var, long val) {
+    if (*slot == var) {
+        *slot = make_literal(var->ty, val);
+        return;
+    }
+    for (int i = 0; i < ast_nslots(*slot); i++) {
+        Node **kid = ast_slot(*slot, i);
+        if (*kid)
+            replace_var(kid, var, val);
+    }
+}
+
+// Copies a function body, replacing the variables in `vars` with the
+// constants in `vals`.
+static Node *clone_body(Node *node, Vector *vars, Vector *vals) {
+    if (!node)
+        return NULL;
+    for (int i = 0; i < vec_len(vars); i++)
+        if (node == vec_get(vars, i))
+            return make_literal(node->ty, ((Node *)vec_get(vals, i))->ival);
+    switch (node->kind) {
+        case AST_LITERAL:
+        case AST_GVAR:
+        case AST_FUNCDESG:
+        case AST_TYPEDEF:
+        case AST_GOTO:
+        case AST_LABEL:
+        case OP_LABEL_ADDR:
+            return node;
+        case AST_LVAR:
+            if (!node->lvarinit)
+                return node;
+    }
+    Node *r = malloc(sizeof(Node));
+    *r = *node;
+    if (r->kind == AST_LVAR)
+        r->lvarinit = vec_copy(r->lvarinit);
+    if (r->kind == AST_FUNCALL || r->kind == AST_FUNCPTR_CALL)
+        r->args = vec_copy(r->args);
+    if (r->kind == AST_DECL && r->declinit)
+        r->declinit = vec_copy(r->declinit);
+    if (r->kind == AST_COMPOUND_STMT)
+        r->stmts = vec_copy(r->stmts);
+    for (int i = 0; i < ast_nslots(r); i++) {
+        Node **slot = ast_slot(r, i);
+        *slot = clone_body(*slot, vars, vals);
+    }
+    return r;
+}
+
+// Evaluates an integer operator the way the VM would, refusing anything
+// whose result could depend on the word size or on rounding.
+static bool eval_binop(int op, long a, long b, long *r) {
+    if (a < INT_MIN || a > INT_MAX || b < INT_MIN || b > INT_MAX)
+        return false;
+    switch (op) {
+        case '+': *r = a + b; break;
+        case '-': *r = a - b; break;
+        case '*': *r = a * b; break;
+        case '/':
+        case '%':
+            if (a < 0 || b <= 0)
+                return false;
+            *r = op == '/' ? a / b : a % b;
+            break;
+        case '&':
+        case '|':
+        case '^':
+            if (a < 0 || b < 0)
+                return false;
+            *r = op == '&' ? a & b : op == '|' ? a | b : a ^ b;
+            break;
+        case OP_SHL:
+        case OP_SAL:
+            if (a < 0 || b < 0 || b > 30)
+                return false;
+            *r = a << b;
+            break;
+        case OP_SHR:
+        case OP_SAR:
+            if (a < 0 || b < 0 || b > 30)
+                return false;
+            *r = a >> b;
+            break;
+        case OP_EQ: *r = a == b; break;
+        case OP_NE: *r = a != b; break;
+        case '<': *r = a < b; break;
+        case '>': *r = a > b; break;
+        case OP_LE: *r = a <= b; break;
+        case OP_GE: *r = a >= b; break;
+        case OP_LOGAND: *r = a && b; break;
+        case OP_LOGOR: *r = a || b; break;
+        default:
+            return false;
+    }
+    return INT_MIN <= *r && *r <= INT_MAX;
+}
+
+// Folds operators on integer constants and branches on constant
+// conditions. Branches that contain labels are kept since they may be
+// entered by a jump.
+static void fold(Node **slot) {
+    Node *node = *slot;
+    for (int i = 0; i < ast_nslots(node); i++) {
+        Node **kid = ast_slot(node, i);
+        if (*kid)
+            fold(kid);
+    }
+    long a, b, r;
+    switch (node->kind) {
+        case AST_CONV:
+        case OP_CAST:
+            if (is_inttype(node->ty) && int_literal(node->operand, &a))
+                *slot = make_literal(node->ty, a);
+            return;
+        case '!':
+            if (int_literal(node->operand, &a))
+                *slot = make_literal(node->ty, !a);
+            return;
+        case AST_IF:
+        case AST_TERNARY: {
+            if (!int_literal(node->cond, &a))
+                return;
+            Node *keep = a ? node->then : node->els;
+            Node *drop = a ? node->els : node->then;
+            if (drop && has_kind(drop, AST_LABEL))
+                return;
+            if (keep)
+                *slot = keep;
+            else if (node->kind == AST_IF)
+                *slot = make_compound(make_vector());
+            return;
+        }
+        case '+': case '-': case '*': case '/': case '%':
+        case '&': case '|': case '^':
+        case OP_SHL: case OP_SAL: case OP_SHR: case OP_SAR:
+        case OP_EQ: case OP_NE: case '<': case '>': case OP_LE: case OP_GE:
+        case OP_LOGAND: case OP_LOGOR:
+            if (is_inttype(node->ty) && int_literal(node->left, &a) && int_literal(node->right, &b) && eval_binop(node->kind, a, b, &r))
+                *slot = make_literal(node->ty, r);
+            return;
+    }
+}
+
+static void fold_functions(Vector *toplevels) {
+    for (int i = 0; i < vec_len(toplevels); i++) {
+        Node *v = vec_get(toplevels, i);
+        if (v->kind == AST_FUNC)
+            fold(&v->body);
+    }
+}
+
+// Parameters that get the same constant at every call site are replaced
+// by it in the body.
+static void propagate_constants(Vector *toplevels) {
+    for (int i = 0; i < vec_len(toplevels); i++) {
+        Node *f = vec_get(toplevels, i);
+        if (f->kind != AST_FUNC)
+            continue;
+        FuncInfo *fi = map_get(infos, f->fname);
+        if (!is_local(fi) || vec_len(fi->sites) == 0)
+            continue;
+        Map *pinned = make_map();
+        scan_vars(f->body, pinned);
+        for (int j = 0; j < vec_len(f->params); j++) {
+            Node *param = vec_get(f->params, j);
+            if (!is_inttype(param->ty) || map_get(pinned, param->varname))
+                continue;
+            long val = 0, other;
+            bool same = true;
+            for (int k = 0; k < vec_len(fi->sites) && same; k++) {
+                Site *site = vec_get(fi->sites, k);
+                same = int_literal(vec_get(site->call->args, j), &other) && (k == 0 || other == val);
+                val = other;
+            }
+            if (!same)
+                continue;
+            replace_var(&f->body, param, val);
+            stats.consts++;
+        }
+    }
+}
+
+// Removes parameters that the body never reads, along with the matching
+// arguments where evaluating them has no effect.
+static void remove_dead_params(Vector *toplevels) {
+    for (int i = 0; i < vec_len(toplevels); i++) {
+        Node *f = vec_get(toplevels, i);
+        if (f->kind != AST_FUNC)
+            continue;
+        FuncInfo *fi = map_get(infos, f->fname);
+        if (!is_local(fi))
+            continue;
+        Vector *params = make_vector();
+        Vector *dead = make_vector();
+        for (int j = 0; j < vec_len(f->params); j++) {
+            Node *param = vec_get(f->params, j);
+            bool unused = count_uses(f->body, param) == 0;
+            for (int k = 0; k < vec_len(fi->sites) && unused; k++) {
+                Site *site = vec_get(fi->sites, k);
+                unused = !has_effects(vec_get(site->call->args, j));
+            }
+            vec_push(dead, (void *)(intptr_t)unused);
+            if (unused)
+                stats.params++;
+            else
+                vec_push(params, param);
+        }
+        if (vec_len(params) == vec_len(f->params))
+            continue;
+        f->params = params;
+        for (int k = 0; k < vec_len(fi->sites); k++) {
+            Node *call = ((Site *)vec_get(fi->sites, k))->call;
+            Vector *args = make_vector();
+            for (int j = 0; j < vec_len(call->args); j++)
+                if (!vec_get(dead, j))
+                    vec_push(args, vec_get(call->args, j));
+            call->args = args;
+        }
+    }
+}
+
+static void drop_retvals(Node **slot) {
+    Node *node = *slot;
+    if (node->kind == AST_RETURN && node->retval) {
+        Node *ret = malloc(sizeof(Node));
+        *ret = *node;
+        ret->retval = NULL;
+        if (has_effects(node->retval)) {
+            Vector *stmts = make_vector();
+            vec_push(stmts, node->retval);
+            vec_push(stmts, ret);
+            *slot = make_compound(stmts);
+        } else {
+            *slot = ret;
+        }
+        return;
+    }
+    for (int i = 0; i < ast_nslots(node); i++) {
+        Node **kid = ast_slot(node, i);
+        if (*kid)
+            drop_retvals(kid);
+    }
+}
+
+// Functions whose result no caller looks at stop returning it.
+static void remove_unused_returns(Vector *toplevels) {
+    for (int i = 0; i < vec_len(toplevels); i++) {
+        Node *f = vec_get(toplevels, i);
+        if (f->kind != AST_FUNC)
+            continue;
+        FuncInfo *fi = map_get(infos, f->fname);
+        if (!is_local(fi) || is_void(f->ty->rettype) || vec_len(fi->sites) == 0)
+            continue;
+        bool used = false;
+        for (int k = 0; k < vec_len(fi->sites) && !used; k++)
+            used = ((Site *)vec_get(fi->sites, k))->used;
+        if (used)
+            continue;
+        Type *ty = malloc(sizeof(Type));
+        *ty = *f->ty;
+        ty->rettype = type_void;
+        f->ty = ty;
+        for (int k = 0; k < vec_len(fi->sites); k++) {
+            Node *call = ((Site *)vec_get(fi->sites, k))->call;
+            call->ftype = ty;
+            call->ty = type_void;
+        }
+        drop_retvals(&f->body);
+        stats.returns++;
+    }
+}
+
+// Calls to pure or read-only functions that are known to return are
+// dropped when their value is unused. Arguments with effects stay.
+static void remove_dead_calls(Node **slot, bool used) {
+    Node *node = *slot;
+    for (int i = 0; i < ast_nslots(node); i++) {
+        Node **kid = ast_slot(node, i);
+        if (*kid)
+            remove_dead_calls(kid, slot_used(node, kid, used));
+    }
+    if (node->kind != AST_FUNCALL || used)
+        return;
+    FuncInfo *fi = map_get(infos, node->fname);
+    if (!defined_once(fi) || fi->effect == EFFECT_WRITE || !fi->finite)
+        return;
+    Vector *stmts = make_vector();
+    for (int i = 0; i < vec_len(node->args); i++)
+        if (has_effects(vec_get(node->args, i)))
+            vec_push(stmts, vec_get(node->args, i));
+    *slot = make_compound(stmts);
+    stats.calls++;
+}
+
+// Calls that pass constants to a small function get a copy of it with the
+// constants substituted, if that lets parts of the copy fold away. Call
+// sites passing the same constants share one copy. Copies are placed
+// right after the original, since gen.c emits the data of string literals
+// together with _start.
+static Vector *specialize(Vector *toplevels) {
+    Vector *out = make_vector();
+    Map *clones = make_map();
+    for (int i = 0; i < vec_len(toplevels); i++) {
+        Node *f = vec_get(toplevels, i);
+        vec_push(out, f);
+        if (f->kind != AST_FUNC)
+            continue;
+        FuncInfo *fi = map_get(infos, f->fname);
+        if (!defined_once(fi) || f->ty->hasva || f->ty->oldstyle || !strcmp(f->fname, "_start"))
+            continue;
+        int size = tree_size(f->body);
+        if (size > SPECIALIZE_BUDGET)
+            continue;
+        Map *pinned = make_map();
+        scan_vars(f->body, pinned);
+        for (int k = 0; k < vec_len(fi->sites); k++) {
+            Node *call = ((Site *)vec_get(fi->sites, k))->call;
+            if (vec_len(call->args) != vec_len(f->params))
+                continue;
+            Vector *vars = make_vector();
+            Vector *vals = make_vector();
+            Vector *params = make_vector();
+            Vector *args = make_vector();
+            Buffer *key = make_buffer();
+            buf_printf(key, "%s", f->fname);
+            for (int j = 0; j < vec_len(f->params); j++) {
+                Node *param = vec_get(f->params, j);
+                Node *arg = vec_get(call->args, j);
+                long val;
+                if (is_inttype(param->ty) && !map_get(pinned, param->varname) && int_literal(arg, &val)) {
+                    vec_push(vars, param);
+                    vec_push(vals, make_literal(param->ty, val));
+                    buf_printf(key, " %d=%ld", j, val);
+                } else {
+                    vec_push(params, param);
+                    vec_push(args, arg);
+                }
+            }
+            if (vec_len(vars) == 0)
+                continue;
+            Node *clone = map_get(clones, buf_body(key));
+            if (!clone) {
+                if (fi->nclones == SPECIALIZE_MAX)
+                    continue;
+                Node *body = clone_body(f->body, vars, vals);
+                fold(&body);
+                if (tree_size(body) >= size) {
+                    map_put(clones, buf_body(key), f);
+                    continue;
+                }
+                clone = malloc(sizeof(Node));
+                *clone = *f;
+                clone->fname = format("%s.%d", f->fname, ++fi->nclones);
+                clone->params = params;
+                clone->body = body;
+                vec_push(out, clone);
+                map_put(clones, buf_body(key), clone);
+                stats.specialized++;
+            }
+            if (clone == f)
+                continue;
+            call->fname = clone->fname;
+            call->args = args;
+        }
+    }
+    return out;
+}
+
+/*
+ * Compile-time evaluation
+ *
+ * Calls to pure functions whose arguments are all integer constants are
+ * run by a small interpreter over the AST and replaced by their result.
+ * Pure functions touch nothing but their own scalar locals, so the
+ * interpreter only needs integer variables. Anything else it meets, or
+ * running out of steps, makes it give up and leave the call alone. The
+ * frames and argument lists it makes are freed after each evaluation.
+ */
+
+#define EVAL_STEPS 1000000    // AST nodes one evaluation may visit
+#define EVAL_TOTAL 20000000   // AST nodes all evaluations may visit
+#define EVAL_DEPTH 200
+
+enum {
+    EXEC_FAIL,
+    EXEC_NEXT,
+    EXEC_RETURN,
+    EXEC_JUMP,
+};
+
+typedef struct {
+    Vector *vars;  // AST_LVAR
+    Vector *vals;  // their values
+} Frame;
+
+static long eval_steps;
+static long eval_total = EVAL_TOTAL;
+static int eval_depth;
+static Arena *eval_arena;
+
+static bool tick(void) {
+    eval_total--;
+    return --eval_steps >= 0;
+}
+
+static long *frame_slot(Frame *fr, Node *var) {
+    for (int i = 0; i < vec_len(fr->vars); i++)
+        if (vec_get(fr->vars, i) == var)
+            return (long *)vec_body(fr->vals) + i;
+    return NULL;
+}
+
+static void frame_set(Frame *fr, Node *var, long val) {
+    long *slot = frame_slot(fr, var);
+    if (slot) {
+        *slot = val;
+        return;
+    }
+    vec_push(fr->vars, var);
+    vec_push(fr->vals, (void *)val);
+}
+
+static bool int_var(Node *node) {
+    return node->kind == AST_LVAR && !node->lvarinit && is_inttype(node->ty);
+}
+
+static bool eval_call(Node *func, Vector *args, long *val);
+
+static bool eval(Node *node, Frame *fr, long *val) {
+    if (!tick())
+        return false;
+    long a, b;
+    switch (node->kind) {
+        case AST_LITERAL:
+            if (!is_inttype(node->ty))
+                return false;
+            *val = node->ival;
+            return true;
+        case AST_LVAR: {
+            long *slot = frame_slot(fr, node);
+            if (!slot)
+                return false;
+            *val = *slot;
+            return true;
+        }
+        case AST_CONV:
+        case OP_CAST:
+            return is_inttype(node->ty) && is_inttype(node->operand->ty) && eval(node->operand, fr, val);
+        case '!':
+            if (!eval(node->operand, fr, &a))
+                return false;
+            *val = !a;
+            return true;
+        case '=':
+            if (!int_var(node->left) || !eval(node->right, fr, val))
+                return false;
+            frame_set(fr, node->left, *val);
+            return true;
+        case OP_PRE_INC:
+        case OP_PRE_DEC:
+        case OP_POST_INC:
+        case OP_POST_DEC: {
+            long *slot = int_var(node->operand) ? frame_slot(fr, node->operand) : NULL;
+            if (!slot)
+                return false;
+            long old = *slot;
+            *slot += node->kind == OP_PRE_INC || node->kind == OP_POST_INC ? 1 : -1;
+            *val = node->kind == OP_POST_INC || node->kind == OP_POST_DEC ? old : *slot;
+            return true;
+        }
+        case ',':
+            return eval(node->left, fr, &a) && eval(node->right, fr, val);
+        case OP_LOGAND:
+        case OP_LOGOR:
+            if (!eval(node->left, fr, &a))
+                return false;
+            if (node->kind == OP_LOGAND ? !a : a) {
+                *val = node->kind == OP_LOGOR;
+                return true;
+            }
+            if (!eval(node->right, fr, &b))
+                return false;
+            *val = b != 0;
+            return true;
+        case AST_TERNARY:
+            if (!eval(node->cond, fr, &a))
+                return false;
+            if (a && !node->then) {
+                *val = a;
+                return true;
+            }
+            return eval(a ? node->then : node->els, fr, val);
+        case AST_FUNCALL: {
+            FuncInfo *fi = map_get(infos, node->fname);
+            if (!defined_once(fi) || fi->effect != EFFECT_PURE)
+                return false;
+            Vector *args = make_vector();
+            for (int i = 0; i < vec_len(node->args); i++) {
+                if (!eval(vec_get(node->args, i), fr, &a))
+                    return false;
+                vec_push(args, (void *)a);
+            }
+            return eval_call(fi->func, args, val);
+        }
+        case '+': case '-': case '*': case '/': case '%':
+        case '&': case '|': case '^':
+        case OP_SHL: case OP_SAL: case OP_SHR: case OP_SAR:
+        case OP_EQ: case OP_NE: case '<': case '>': case OP_LE: case OP_GE:
+            if (!is_inttype(node->ty) || !is_inttype(node->left->ty) || !is_inttype(node->right->ty))
+                return false;
+            return eval(node->left, fr, &a) && eval(node->right, fr, &b) && eval_binop(node->kind, a, b, val);
+    }
+    return false;
+}
+
+static bool has_label(Node *node, char *label) {
+    if (!tick())
+        return false;
+    if (node->kind == AST_LABEL)
+        return node->label && !strcmp(node->label, label);
+    if (node->kind != AST_COMPOUND_STMT && node->kind != AST_IF)
+        return false;
+    Node *kid;
+    for (int i = 0; (kid = next_child(node, &i));)
+        if (has_label(kid, label))
+            return true;
+    return false;
+}
+
+// Runs a statement. While `*label` is set, execution is looking for that
+// label: compound statements and ifs descend into the child holding it,
+// and reaching it resumes normal execution.
+static int exec(Node *node, Frame *fr, long *ret, char **label) {
+    if (!tick())
+        return EXEC_FAIL;
+    switch (node->kind) {
+        case AST_COMPOUND_STMT: {
+            for (int i = 0; i < vec_len(node->stmts);) {
+                if (*label && !has_label(vec_get(node->stmts, i), *label)) {
+                    i++;
+                    continue;
+                }
+                int r = exec(vec_get(node->stmts, i), fr, ret, label);
+                if (r == EXEC_JUMP) {
+                    i = 0;
+                    continue;
+                }
+                if (r != EXEC_NEXT)
+                    return r;
+                i++;
+            }
+            return *label ? EXEC_JUMP : EXEC_NEXT;
+        }
+        case AST_IF: {
+            long cond;
+            if (*label) {
+                if (node->then && has_label(node->then, *label))
+                    return exec(node->then, fr, ret, label);
+                if (node->els && has_label(node->els, *label))
+                    return exec(node->els, fr, ret, label);
+                return EXEC_JUMP;
+            }
+            if (!eval(node->cond, fr, &cond))
+                return EXEC_FAIL;
+            Node *next = cond ? node->then : node->els;
+            return next ? exec(next, fr, ret, label) : EXEC_NEXT;
+        }
+        case AST_LABEL:
+            if (*label && node->label && !strcmp(node->label, *label))
+                *label = NULL;
+            return *label ? EXEC_JUMP : EXEC_NEXT;
+        case AST_GOTO:
+            *label = node->label;
+            return EXEC_JUMP;
+        case AST_RETURN:
+            if (!node->retval || !eval(node->retval, fr, ret))
+                return EXEC_FAIL;
+            return EXEC_RETURN;
+        case AST_DECL: {
+            if (!int_var(node->declvar))
+                return EXEC_FAIL;
+            for (int i = 0; node->declinit && i < vec_len(node->declinit); i++) {
+                Node *init = vec_get(node->declinit, i);
+                long v;
+                if (init->initoff != 0 || !eval(init->initval, fr, &v))
+                    return EXEC_FAIL;
+                frame_set(fr, node->declvar, v);
+            }
+            return EXEC_NEXT;
+        }
+    }
+    if (*label)
+        return EXEC_JUMP;
+    long v;
+    return eval(node, fr, &v) ? EXEC_NEXT : EXEC_FAIL;
+}
+
+static bool eval_call(Node *func, Vector *args, long *val) {
+    if (func->ty->hasva || !is_inttype(func->ty->rettype) || vec_len(args) != vec_len(func->params) || eval_depth == EVAL_DEPTH)
+        return false;
+    Frame fr = {make_vector(), make_vector()};
+    for (int i = 0; i < vec_len(args); i++) {
+        Node *param = vec_get(func->params, i);
+        if (!int_var(param))
+            return false;
+        frame_set(&fr, param, (long)vec_get(args, i));
+    }
+    char *label = NULL;
+    eval_depth++;
+    int r = exec(func->body, &fr, val, &label);
+    eval_depth--;
+    return r == EXEC_RETURN;
+}
+
+static void evaluate_calls(Node **slot) {
+    Node *node = *slot;
+    for (int i = 0; i < ast_nslots(node); i++) {
+        Node **kid = ast_slot(node, i);
+        if (*kid)
+            evaluate_calls(kid);
+    }
+    if (node->kind != AST_FUNCALL || !is_inttype(node->ty) || eval_total <= 0)
+        return;
+    FuncInfo *fi = map_get(infos, node->fname);
+    if (!defined_once(fi) || fi->effect != EFFECT_PURE)
+        return;
+    if (!eval_arena)
+        eval_arena = make_arena("evaluate");
+    Arena *arena = use_arena(eval_arena);
+    Vector *args = make_vector();
+    long val;
+    bool ok = true;
+    for (int i = 0; ok && i < vec_len(node->args); i++) {
+        ok = int_literal(vec_get(node->args, i), &val);
+        vec_push(args, (void *)val);
+    }
+    eval_steps = EVAL_STEPS;
+    ok = ok && eval_call(fi->func, args, &val);
+    use_arena(arena);
+    arena_reset(eval_arena);
+    if (!ok || val < INT_MIN || val > INT_MAX)
+        return;
+    *slot = make_literal(node->ty, val);
+    stats.evaluated++;
+}
+
+/*
+ * Devirtualization
+ *
+ * A call through a function pointer becomes a direct call when the
+ * pointer can only hold one function: a function designator, a local that
+ * is only ever assigned that function, or an entry of a global that is
+ * never written after initialization and never has its address taken.
+ * Calls that stay indirect but have exactly one address-taken function of
+ * a matching shape get that function as their likely target, which gen.c
+ * calls directly after comparing the pointer with it.
+ */
+
+static Map *globaldecls;   // name -> AST_DECL, or NULL if defined twice
+static Map *written;       // globals that may change after initialization
+
+// Finds the global variable that an lvalue lies in. Sets `off` to the word
+// offset into it, or to the offset within an element of an array indexed
+// by a non-constant, in which case `stride` is the element size.
+static bool global_slot(Node *node, Node **var, long *off, int *stride) {
+    switch (node->kind) {
+        case AST_GVAR:
+            *var = node;
+            *off = 0;
+            *stride = 0;
+            return true;
+        case AST_STRUCT_REF: {
+            if (!global_slot(node->struc, var, off, stride))
+                return false;
+            Type *field = dict_get(node->struc->ty->fields, node->field);
+            *off += field->offset;
+            return true;
+        }
+        case AST_DEREF: {
+            Node *ptr = node->operand;
+            Node *idx = NULL;
+            if (ptr->kind == '+') {
+                idx = is_inttype(ptr->right->ty) ? ptr->right : ptr->left;
+                ptr = idx == ptr->right ? ptr->left : ptr->right;
+            }
+            if (ptr->kind != AST_CONV || ptr->operand->kind != AST_GVAR || ptr->operand->ty->kind != KIND_ARRAY)
+                return false;
+            *var = ptr->operand;
+            int size = ptr->operand->ty->ptr->size;
+            long i = 0;
+            if (idx && (!int_literal(idx, &i) || i < 0)) {
+                *off = 0;
+                *stride = size;
+            } else {
+                *off = i * size;
+                *stride = 0;
+            }
+            return true;
+        }
+    }
+    return false;
+}
+
+static Node *store_target(Node *node) {
+    switch (node->kind) {
+        case '=':
+            return node->left;
+        case OP_PRE_INC:
+        case OP_PRE_DEC:
+        case OP_POST_INC:
+        case OP_POST_DEC:
+        case AST_ADDR:
+            return node->operand;
+    }
+    return NULL;
+}
+
+// Marks globals that are stored to or whose address escapes. Arrays may
+// only be indexed.
+static void scan_globals(Node *node) {
+    Node *var;
+    long off;
+    int stride;
+    Node *target = store_target(node);
+    if (target && global_slot(target, &var, &off, &stride))
+        map_put(written, var->varname, var);
+    if (node->kind == AST_DEREF && global_slot(node, &var, &off, &stride)) {
+        Node *ptr = node->operand;
+        if (ptr->kind == '+')
+            scan_globals(is_inttype(ptr->right->ty) ? ptr->right : ptr->left);
+        return;
+    }
+    if (node->kind == AST_CONV && node->operand->kind == AST_GVAR && node->operand->ty->kind == KIND_ARRAY)
+        map_put(written, node->operand->varname, node->operand);
+    Node *kid;
+    for (int i = 0; (kid = next_child(node, &i));)
+        scan_globals(kid);
+}
+
+// Returns the only function the pointer expression can evaluate to, if
+// it is known. `locals` maps local names to their single target, or to ""
+// when they may hold anything else.
+static char *known_target(Node *fptr, Map *locals) {
+    for (;;) {
+        if (fptr->kind == AST_CONV || fptr->kind == OP_CAST)
+            fptr = fptr->operand;
+        else if (fptr->kind == AST_ADDR && fptr->operand->kind == AST_FUNCDESG)
+            fptr = fptr->operand;
+        else if (fptr->kind == AST_DEREF && fptr->ty->kind == KIND_FUNC)
+            fptr = fptr->operand;
+        else
+            break;
+    }
+    if (fptr->kind == AST_FUNCDESG)
+        return fptr->fname;
+    if (fptr->kind == AST_LVAR) {
+        char *name = locals ? map_get(locals, fptr->varname) : NULL;
+        return name && *name ? name : NULL;
+    }
+    Node *var;
+    long off;
+    int stride;
+    if (!global_slot(fptr, &var, &off, &stride) || map_get(written, var->varname))
+        return NULL;
+    Node *decl = map_get(globaldecls, var->varname);
+    if (!decl || !decl->declinit)
+        return NULL;
+    char *r = NULL;
+    for (int i = 0; i < vec_len(decl->declinit); i++) {
+        Node *init = vec_get(decl->declinit, i);
+        if (stride ? init->initoff % stride != off : init->initoff != off)
+            continue;
+        char *t = known_target(init->initval, NULL);
+        if (!t || (r && strcmp(r, t)))
+            return NULL;
+        r = t;
+    }
+    return r;
+}
+
+static void note_target(Map *locals, char *name, char *target) {
+    char *cur = map_get(locals, name);
+    if (!cur)
+        map_put(locals, name, target ? target : "");
+    else if (*cur && (!target || strcmp(cur, target)))
+        map_put(locals, name, "");
+}
+
+static void scan_locals(Node *node, Map *locals) {
+    if (node->kind == '=' && node->left->kind == AST_LVAR) {
+        note_target(locals, node->left->varname, known_target(node->right, NULL));
+    } else if (node->kind == AST_DECL && node->declinit) {
+        for (int i = 0; i < vec_len(node->declinit); i++) {
+            Node *init = vec_get(node->declinit, i);
+            note_target(locals, node->declvar->varname, init->initoff == 0 ? known_target(init->initval, NULL) : NULL);
+        }
+    } else {
+        Node *target = store_target(node);
+        Node *var = target ? lvalue_var(target) : NULL;
+        if (var)
+            note_target(locals, var->varname, NULL);
+    }
+    Node *kid;
+    for (int i = 0; (kid = next_child(node, &i));)
+        scan_locals(kid, locals);
+}
+
+static bool can_call(Node *func, Node *call) {
+    Type *ty = func->ty;
+    if (ty->oldstyle)
+        return false;
+    if (ty->hasva ? vec_len(call->args) < vec_len(func->params) : vec_len(call->args) != vec_len(func->params))
+        return false;
+    return is_void(ty->rettype) == is_void(call->ty);
+}
+
+static void devirtualize_calls(Node **slot, Map *locals, Vector *addrfuncs) {
+    Node *node = *slot;
+    for (int i = 0; i < ast_nslots(node); i++) {
+        Node **kid = ast_slot(node, i);
+        if (*kid)
+            devirtualize_calls(kid, locals, addrfuncs);
+    }
+    if (node->kind != AST_FUNCPTR_CALL)
+        return;
+    char *name = known_target(node->fptr, locals);
+    FuncInfo *fi = name ? map_get(infos, name) : NULL;
+    if (defined_once(fi) && can_call(fi->func, node) && !has_effects(node->fptr)) {
+        Node *call = malloc(sizeof(Node));
+        *call = (Node){AST_FUNCALL, node->ty, node->sourceLoc, .fname = name, .args = node->args, .ftype = node->fptr->ty->ptr};
+        *slot = call;
+        stats.direct++;
+        return;
+    }
+    Node *guess = NULL;
+    for (int i = 0; i < vec_len(addrfuncs); i++) {
+        Node *f = vec_get(addrfuncs, i);
+        if (!can_call(f, node))
+            continue;
+        if (guess)
+            return;
+        guess = f;
+    }
+    if (guess) {
+        node->fname = guess->fname;
+        stats.guarded++;
+    }
+}
+
+static void scan_program(Vector *toplevels) {
+    globaldecls = make_map();
+    written = make_map();
+    for (int i = 0; i < vec_len(toplevels); i++) {
+        Node *v = vec_get(toplevels, i);
+        if (v->kind == AST_DECL) {
+            char *name = v->declvar->varname;
+            map_put(globaldecls, name, map_get(globaldecls, name) ? NULL : v);
+        }
+        scan_globals(v);
+    }
+}
+
+static void devirtualize(Vector *toplevels) {
+    scan_program(toplevels);
+    Vector *addrfuncs = make_vector();
+    for (int i = 0; i < vec_len(toplevels); i++) {
+        Node *v = vec_get(toplevels, i);
+        FuncInfo *fi = v->kind == AST_FUNC ? map_get(infos, v->fname) : NULL;
+        if (defined_once(fi) && fi->addrtaken)
+            vec_push(addrfuncs, v);
+    }
+    for (int i = 0; i < vec_len(toplevels); i++) {
+        Node *f = vec_get(toplevels, i);
+        if (f->kind != AST_FUNC)
+            continue;
+        Map *locals = make_map();
+        for (int j = 0; j < vec_len(f->params); j++)
+            note_target(locals, ((Node *)vec_get(f->params, j))->varname, NULL);
+        scan_locals(f->body, locals);
+        devirtualize_calls(&f->body, locals, addrfuncs);
+    }
+}
+
+/*
+ * Global variables
+ *
+ * Reads of globals that are never written after initialization, nor have
+ * their address taken, are replaced by their initial value.
+ *
+ * Scalar globals whose address is never taken can only be reached by
+ * name, so gen.c may keep them in a register for the length of a
+ * function, loading them on entry and after calls and storing them back
+ * before calls and returns. register_globals() picks the globals for which
+ * that saves more accesses than it adds.
+ */
+
+static Map register_funcs = EMPTY_MAP;  // function name -> Dict
+
+static bool global_value(Node *node, long *val) {
+    Node *var;
+    long off;
+    int stride;
+    if (!node->ty || !is_inttype(node->ty) || !global_slot(node, &var, &off, &stride) || stride || map_get(written, var->varname))
+        return false;
+    Node *decl = map_get(globaldecls, var->varname);
+    if (!decl || !decl->declinit || vec_len(decl->declinit) == 0)
+        return false;
+    *val = 0;
+    for (int i = 0; i < vec_len(decl->declinit); i++) {
+        Node *init = vec_get(decl->declinit, i);
+        if (init->initoff == off && !int_literal(init->initval, val))
+            return false;
+    }
+    return true;
+}
+
+static void fold_global_reads(Node **slot) {
+    long val;
+    if (global_value(*slot, &val)) {
+        *slot = make_literal((*slot)->ty, val);
+        stats.constglobals++;
+        return;
+    }
+    for (int i = 0; i < ast_nslots(*slot); i++) {
+        Node **kid = ast_slot(*slot, i);
+        if (*kid)
+            fold_global_reads(kid);
+    }
+}
+
+static void fold_constant_globals(Vector *toplevels) {
+    scan_program(toplevels);
+    for (int i = 0; i < vec_len(toplevels); i++)
+        fold_global_reads((Node **)vec_body(toplevels) + i);
+}
+
+static void scan_addressed(Node *node, Map *addressed) {
+    if (node->kind == AST_ADDR) {
+        Node *op = node->operand;
+        while (op->kind == AST_STRUCT_REF || op->kind == AST_CONV || op->kind == OP_CAST)
+            op = op->kind == AST_STRUCT_REF ? op->struc : op->operand;
+        if (op->kind == AST_GVAR)
+            map_put(addressed, op->varname, op);
+    }
+    Node *kid;
+    for (int i = 0; (kid = next_child(node, &i));)
+        scan_addressed(kid, addressed);
+}
+
+typedef struct {
+    Node *var;
+    int reads;
+    int writes;
+} GlobalUse;
+
+typedef struct {
+    Map *uses;  // name -> GlobalUse
+    Vector *names;
+    int calls;
+    int clobbers;  // calls that may write memory
+    int returns;
+} FuncUse;
+
+static void count_global_uses(Node *node, FuncUse *fu) {
+    Node *target = store_target(node);
+    Node *var = NULL;
+    if (node->kind == AST_GVAR)
+        var = node;
+    else if (target && target->kind == AST_GVAR)
+        var = target;
+    if (var) {
+        GlobalUse *u = map_get(fu->uses, var->varname);
+        if (!u) {
+            u = calloc(1, sizeof(GlobalUse));
+            u->var = var;
+            map_put(fu->uses, var->varname, u);
+            vec_push(fu->names, var->varname);
+        }
+        if (node->kind == '=') {
+            u->writes++;
+            count_global_uses(node->right, fu);
+            return;
+        }
+        u->reads++;
+        if (target)
+            u->writes++;
+        if (node != var)
+            return;
+    }
+    if (node->kind == AST_FUNCPTR_CALL || (node->kind == AST_FUNCALL && strncmp(node->fname, "__builtin_", 10) && strcmp(node->fname, "putchar") && strcmp(node->fname, "getchar"))) {
+        fu->calls++;
+        if (node->kind == AST_FUNCPTR_CALL || !map_get(&readonly_funcs, node->fname))
+            fu->clobbers++;
+    }
+    if (node->kind == AST_RETURN)
+        fu->returns++;
+    Node *kid;
+    for (int i = 0; (kid = next_child(node, &i));)
+        count_global_uses(kid, fu);
+}
+
+static void choose_register_globals(Vector *toplevels) {
+    Map *addressed = make_map();
+    for (int i = 0; i < vec_len(toplevels); i++)
+        scan_addressed(vec_get(toplevels, i), addressed);
+    for (int i = 0; i < vec_len(toplevels); i++) {
+        Node *f = vec_get(toplevels, i);
+        if (f->kind != AST_FUNC)
+            continue;
+        FuncUse fu = {make_map(), make_vector()};
+        count_global_uses(f->body, &fu);
+        Dict *chosen = make_dict();
+        for (int j = 0; j < vec_len(fu.names); j++) {
+            char *name = vec_get(fu.names, j);
+            GlobalUse *u = map_get(fu.uses, name);
+            Type *ty = u->var->ty;
+            if (ty->size != 1 || ty->kind == KIND_ARRAY || ty->kind == KIND_STRUCT || map_get(addressed, name) || !map_get(globaldecls, name))
+                continue;
+            int cost = 1 + fu.clobbers + (u->writes ? fu.calls + fu.returns + 1 : 0);
+            if (u->reads + u->writes <= cost)
+                continue;
+            dict_put(chosen, name, (void *)(size_t)(u->writes > 0));
+            stats.registers++;
+        }
+        if (vec_len(dict_keys(chosen)))
+            map_put(&register_funcs, f->fname, chosen);
+    }
+}
+
+/*
+ * Heap to stack promotion
+ *
+ * A pointer variable whose only values are NULL and blocks from
+ * malloc/calloc of a constant size, and which is only ever dereferenced,
+ * compared or freed, never lets its block outlive the call. Such blocks are
+ * carved out of the frame instead, and the frees become no-ops. The
+ * runtime allocator hands out zeroed memory, so the frame block is cleared
+ * at the point of the call.
+ */
+
+#define PROMOTE_MAX 256  // words of frame one allocation may take
+
+static Node *strip_ptr_conv(Node *node) {
+    while ((node->kind == AST_CONV || node->kind == OP_CAST) && node->ty->kind == KIND_PTR)
+        node = node->operand;
+    return node;
+}
+
+// Returns the number of words allocated by a malloc or calloc call of
+// constant size, or 0.
+static long alloc_words(Node *node) {
+    long a, b;
+    node = strip_ptr_conv(node);
+    if (node->kind != AST_FUNCALL)
+        return 0;
+    if (!strcmp(node->fname, "malloc") && vec_len(node->args) == 1 && int_literal(vec_get(node->args, 0), &a))
+        b = 1;
+    else if (!strcmp(node->fname, "calloc") && vec_len(node->args) == 2 && int_literal(vec_get(node->args, 0), &a) && int_literal(vec_get(node->args, 1), &b))
+        ;
+    else
+        return 0;
+    if (a <= 0 || b <= 0 || a > PROMOTE_MAX || b > PROMOTE_MAX || a * b > PROMOTE_MAX)
+        return 0;
+    return a * b;
+}
+
+static bool is_null(Node *node) {
+    long val;
+    return int_literal(strip_ptr_conv(node), &val) && val == 0;
+}
+
+static bool safe_object(Vector *path, int i);
+
+// Whether the pointer computed by path[i] from the variable at the end of
+// `path` cannot escape through the use its parent makes of it.
+static bool safe_pointer(Vector *path, int i) {
+    Node *node = vec_get(path, i);
+    Node *parent = i > 0 ? vec_get(path, i - 1) : NULL;
+    if (!parent)
+        return true;
+    switch (parent->kind) {
+        case AST_DEREF:
+            return safe_object(path, i - 1);
+        case '+':
+        case '-':
+            return parent->ty->kind == KIND_PTR && safe_pointer(path, i - 1);
+        case AST_CONV:
+        case OP_CAST:
+            if (parent->ty->kind == KIND_PTR)
+                return safe_pointer(path, i - 1);
+            return parent->ty->kind == KIND_BOOL || is_void(parent->ty);
+        case '=':
+            if (parent->left != node || node->kind != AST_LVAR)
+                return false;
+            return (alloc_words(parent->right) || is_null(parent->right)) && safe_pointer(path, i - 1);
+        case AST_FUNCALL:
+            return !strcmp(parent->fname, "free");
+        case AST_TERNARY:
+            return parent->cond == node || safe_pointer(path, i - 1);
+        case ',':
+            return parent->left == node || safe_pointer(path, i - 1);
+        case OP_EQ:
+        case OP_NE:
+        case '<':
+        case '>':
+        case OP_LE:
+        case OP_GE:
+        case '!':
+        case OP_LOGAND:
+        case OP_LOGOR:
+        case AST_IF:
+        case AST_COMPOUND_STMT:
+            return true;
+    }
+    return false;
+}
+
+// Same for the object designated by path[i], which lies inside the block.
+static bool safe_object(Vector *path, int i) {
+    Node *node = vec_get(path, i);
+    Node *parent = i > 0 ? vec_get(path, i - 1) : NULL;
+    if (!parent)
+        return true;
+    if (node->ty->kind == KIND_ARRAY)
+        return (parent->kind == AST_CONV || parent->kind == OP_CAST) && safe_pointer(path, i - 1);
+    if (parent->kind == AST_STRUCT_REF)
+        return safe_object(path, i - 1);
+    return parent->kind != AST_ADDR;
+}
+
+static bool stays_local(Node *node, Node *var, Vector *path) {
+    bool ok = true;
+    vec_push(path, node);
+    if (node == var) {
+        ok = safe_pointer(path, vec_len(path) - 1);
+    } else if (node->kind == AST_DECL && node->declvar == var && node->declinit) {
+        Node *init = vec_len(node->declinit) == 1 ? vec_head(node->declinit) : NULL;
+        ok = init && init->initoff == 0 && (alloc_words(init->initval) || is_null(init->initval));
+    }
+    Node *kid;
+    for (int i = 0; ok && (kid = next_child(node, &i));)
+        ok = stays_local(kid, var, path);
+    vec_pop(path);
+    return ok;
+}
+
+static void find_allocs(Node *node, Vector *vars) {
+    Node *var = NULL;
+    if (node->kind == '=' && node->left->kind == AST_LVAR && alloc_words(node->right))
+        var = node->left;
+    else if (node->kind == AST_DECL && node->declinit && vec_len(node->declinit) == 1 && alloc_words(((Node *)vec_head(node->declinit))->initval))
+        var = node->declvar;
+    if (var && var->ty->kind == KIND_PTR) {
+        bool seen = false;
+        for (int i = 0; i < vec_len(vars); i++)
+            seen |= vec_get(vars, i) == var;
+        if (!seen)
+            vec_push(vars, var);
+    }
+    Node *kid;
+    for (int i = 0; (kid = next_child(node, &i));)
+        find_allocs(kid, vars);
+}
+
+// Gives the allocation in `slot` a block of the frame of `func`.
+static void promote_alloc(Node **slot, Node *func) {
+    while ((*slot)->kind != AST_FUNCALL)
+        slot = &(*slot)->operand;
+    Node *call = *slot;
+    long words = alloc_words(call);
+    Type *ty = malloc(sizeof(Type));
+    *ty = (Type){KIND_ARRAY, words, 1, .ptr = type_char, .len = words};
+    Node *block = malloc(sizeof(Node));
+    *block = (Node){AST_LVAR, ty, call->sourceLoc, .varname = make_tempname()};
+    Node *decl = malloc(sizeof(Node));
+    *decl = (Node){AST_DECL, .declvar = block};
+    vec_push(func->localvars, block);
+    Vector *stmts = make_vector1(decl);
+    vec_append(stmts, func->body->stmts);
+    func->body->stmts = stmts;
+
+    Node *addr = malloc(sizeof(Node) * 2);
+    addr[0] = addr[1] = (Node){AST_CONV, call->ty, .operand = block};
+    Type *fty = malloc(sizeof(Type));
+    *fty = (Type){KIND_FUNC, .rettype = type_void, .params = make_vector()};
+    Vector *args = make_vector();
+    vec_push(args, addr);
+    vec_push(args, make_literal(type_int, 0));
+    vec_push(args, make_literal(type_int, words));
+    Node *clear = malloc(sizeof(Node));
+    *clear = (Node){AST_FUNCALL, type_void, call->sourceLoc, .fname = "__builtin_fill_words", .args = args, .ftype = fty};
+    Node *r = malloc(sizeof(Node));
+    *r = (Node){',', call->ty, call->sourceLoc, .left = clear, .right = &addr[1]};
+    *slot = r;
+    stats.promoted++;
+}
+
+static void promote_var(Node **slot, Node *var, Node *func) {
+    Node *node = *slot;
+    if (node->kind == '=' && node->left == var && alloc_words(node->right)) {
+        promote_alloc(&node->right, func);
+    } else if (node->kind == AST_DECL && node->declvar == var && node->declinit) {
+        Node *init = vec_head(node->declinit);
+        if (alloc_words(init->initval))
+            promote_alloc(&init->initval, func);
+    } else if (node->kind == AST_FUNCALL && !strcmp(node->fname, "free") && vec_len(node->args) == 1 && strip_ptr_conv(vec_head(node->args)) == var) {
+        *slot = make_compound(make_vector());
+        return;
+    }
+    for (int i = 0; i < ast_nslots(node); i++) {
+        Node **kid = ast_slot(node, i);
+        if (*kid)
+            promote_var(kid, var, func);
+    }
+}
+
+static void promote_allocations(Vector *toplevels) {
+    for (int i = 0; i < vec_len(toplevels); i++) {
+        Node *f = vec_get(toplevels, i);
+        if (f->kind != AST_FUNC || f->body->kind != AST_COMPOUND_STMT)
+            continue;
+        Vector *vars = make_vector();
+        find_allocs(f->body, vars);
+        for (int j = 0; j < vec_len(vars); j++) {
+            Node *var = vec_get(vars, j);
+            bool param = false;
+            for (int k = 0; k < vec_len(f->params); k++)
+                param |= vec_get(f->params, k) == var;
+            if (!param && stays_local(f->body, var, make_vector()))
+                promote_var(&f->body, var, f);
+        }
+    }
+}
+
+/*
+ * Profile-guided inlining and placement
+ *
+ * With -fprofile-use, calls that ran often are replaced by a copy of the
+ * callee if it is small. gen.c knows locals by name, so the variables of
+ * the copy are renamed, and its labels are replaced by fresh ones. A
+ * return in the copy becomes an assignment to the result and a jump to
+ * the end of the copy.
+ *
+ * Functions are then emitted in the order of how often they ran.
+ */
+
+#define INLINE_BUDGET 120    // AST nodes of a function worth inlining
+#define INLINE_GROWTH 2000   // AST nodes a caller may grow by
+#define INLINE_MIN_CALLS 64  // calls that make a call site hot
+
+typedef struct {
+    Dict *vars;   // callee variable name -> copy
+    Map *decls;   // callee variables that have a declaration
+    Map *labels;  // callee label -> fresh label
+    Node *result;
+    char *end;
+    int id;
+} Inline;
+
+static int ninlined;
+
+static Node *make_goto(char *label) {
+    Node *r = malloc(sizeof(Node));
+    *r = (Node){AST_GOTO, .label = label, .newlabel = label};
+    return r;
+}
+
+static Node *make_assign(Node *var, Node *val) {
+    Node *r = malloc(sizeof(Node));
+    *r = (Node){'=', var->ty, .left = var, .right = val};
+    return r;
+}
+
+static Node *make_decl(Node *var) {
+    Node *r = malloc(sizeof(Node));
+    *r = (Node){AST_DECL, .declvar = var};
+    return r;
+}
+
+static Node *inline_copy(Inline *in, Node *node);
+
+static Node *inline_var(Inline *in, Node *var) {
+    Node *r = dict_get(in->vars, var->varname);
+    if (r)
+        return r;
+    r = malloc(sizeof(Node));
+    *r = *var;
+    r->varname = format("%s.i%d", var->varname, in->id);
+    dict_put(in->vars, var->varname, r);
+    if (var->lvarinit) {
+        r->lvarinit = make_vector();
+        for (int i = 0; i < vec_len(var->lvarinit); i++)
+            vec_push(r->lvarinit, inline_copy(in, vec_get(var->lvarinit, i)));
+    }
+    return r;
+}
+
+static char *inline_label(Inline *in, char *label) {
+    if (!label)
+        return NULL;
+    char *r = map_get(in->labels, label);
+    if (!r) {
+        r = make_label();
+        map_put(in->labels, label, r);
+    }
+    return r;
+}
+
+static Node *inline_copy(Inline *in, Node *node) {
+    if (!node)
+        return NULL;
+    switch (node->kind) {
+        case AST_LITERAL:
+        case AST_GVAR:
+        case AST_FUNCDESG:
+        case AST_TYPEDEF:
+            return node;
+        case AST_LVAR:
+            return inline_var(in, node);
+        case AST_RETURN: {
+            Vector *stmts = make_vector();
+            Node *val = inline_copy(in, node->retval);
+            if (val)
+                vec_push(stmts, in->result ? make_assign(in->result, val) : val);
+            vec_push(stmts, make_goto(in->end));
+            return make_compound(stmts);
+        }
+    }
+    Node *r = malloc(sizeof(Node));
+    *r = *node;
+    if (r->kind == AST_GOTO || r->kind == AST_LABEL) {
+        r->label = inline_label(in, r->label);
+        r->newlabel = inline_label(in, r->newlabel);
+        return r;
+    }
+    if (r->kind == AST_DECL) {
+        map_put(in->decls, r->declvar->varname, r);
+        r->declvar = inline_var(in, r->declvar);
+    }
+    if (r->kind == AST_FUNCALL || r->kind == AST_FUNCPTR_CALL)
+        r->args = vec_copy(r->args);
+    if (r->kind == AST_DECL && r->declinit)
+        r->declinit = vec_copy(r->declinit);
+    if (r->kind == AST_COMPOUND_STMT)
+        r->stmts = vec_copy(r->stmts);
+    for (int i = 0; i < ast_nslots(r); i++) {
+        Node **slot = ast_slot(r, i);
+        *slot = inline_copy(in, *slot);
+    }
+    return r;
+}
+
+static bool has_call(Node *node, char *fname) {
+    if (node->kind == AST_FUNCALL && !strcmp(node->fname, fname))
+        return true;
+    Node *kid;
+    for (int i = 0; (kid = next_child(node, &i));)
+        if (has_call(kid, fname))
+            return true;
+    return false;
+}
+
+static bool can_inline(FuncInfo *fi) {
+    if (!defined_once(fi))
+        return false;
+    Node *f = fi->func;
+    if (f->ty->hasva || f->ty->oldstyle || !strcmp(f->fname, "_start") || f->ty->rettype->size > 1)
+        return false;
+    for (int i = 0; i < vec_len(f->params); i++)
+        if (((Node *)vec_get(f->params, i))->ty->size != 1)
+            return false;
+    return tree_size(f->body) <= INLINE_BUDGET && !has_kind(f->body, OP_LABEL_ADDR) && !has_kind(f->body, AST_COMPUTED_GOTO) && !has_call(f->body, f->fname);
+}
+
+static Node *inline_call(Node *call, Node *f) {
+    Inline in = {make_dict(), make_map(), make_map(), NULL, make_label(), ++ninlined};
+    Vector *stmts = make_vector();
+    for (int i = 0; i < vec_len(f->params); i++) {
+        Node *orig = vec_get(f->params, i);
+        Node *param = inline_var(&in, orig);
+        map_put(in.decls, orig->varname, orig);
+        vec_push(stmts, make_decl(param));
+        vec_push(stmts, make_assign(param, vec_get(call->args, i)));
+    }
+    if (!is_void(f->ty->rettype)) {
+        in.result = malloc(sizeof(Node));
+        *in.result = (Node){AST_LVAR, f->ty->rettype, .varname = format("%s.r%d", f->fname, in.id)};
+        vec_push(stmts, make_decl(in.result));
+    }
+    Node *body = inline_copy(&in, f->body);
+    // Locals made by the parser without a declaration, such as the
+    // temporary of a switch, still need a slot of their own.
+    Vector *names = dict_keys(in.vars);
+    for (int i = 0; i < vec_len(names); i++) {
+        char *name = vec_get(names, i);
+        if (!map_get(in.decls, name))
+            vec_push(stmts, make_decl(dict_get(in.vars, name)));
+    }
+    vec_push(stmts, body);
+    Node *end = malloc(sizeof(Node));
+    *end = (Node){AST_LABEL, .label = in.end, .newlabel = in.end};
+    vec_push(stmts, end);
+    if (in.result)
+        vec_push(stmts, in.result);
+    Node *r = make_compound(stmts);
+    r->ty = call->ty;
+    return r;
+}
+
+static void inline_calls(Node **slot, Node *caller, int *budget) {
+    for (int i = 0; i < ast_nslots(*slot); i++) {
+        Node **kid = ast_slot(*slot, i);
+        if (*kid)
+            inline_calls(kid, caller, budget);
+    }
+    Node *call = *slot;
+    if (call->kind != AST_FUNCALL)
+        return;
+    FuncInfo *fi = map_get(infos, call->fname);
+    if (!fi || !fi->func || fi->func == caller || vec_len(call->args) != vec_len(fi->func->params))
+        return;
+    long n = profile_edge_count(caller->fname, call->fname);
+    if (n < INLINE_MIN_CALLS || n * 100 < profile_max_edge() || !can_inline(fi))
+        return;
+    int size = tree_size(fi->func->body);
+    if (size > *budget)
+        return;
+    *budget -= size;
+    *slot = inline_call(call, fi->func);
+    stats.inlined++;
+}
+
+static void inline_hot_calls(Vector *toplevels) {
+    for (int i = 0; i < vec_len(toplevels); i++) {
+        Node *v = vec_get(toplevels, i);
+        int budget = INLINE_GROWTH;
+        if (v->kind == AST_FUNC)
+            inline_calls(&v->body, v, &budget);
+    }
+}
+
+// Puts the functions that ran most often first and those that never ran
+// last. Global data stays in front of all functions, and _start stays at
+// the end.
+static Vector *place_functions(Vector *toplevels) {
+    Vector *r = make_vector();
+    Vector *funcs = make_vector();
+    Node *start = NULL;
+    for (int i = 0; i < vec_len(toplevels); i++) {
+        Node *v = vec_get(toplevels, i);
+        if (v->kind != AST_FUNC)
+            vec_push(r, v);
+        else if (!strcmp(v->fname, "_start"))
+            start = v;
+        else
+            vec_push(funcs, v);
+    }
+    for (int i = 1; i < vec_len(funcs); i++) {
+        Node *f = vec_get(funcs, i);
+        long n = profile_func_count(f->fname);
+        int j = i;
+        for (; j > 0 && profile_func_count(((Node *)vec_get(funcs, j - 1))->fname) < n; j--)
+            vec_set(funcs, j, vec_get(funcs, j - 1));
+        vec_set(funcs, j, f);
+    }
+    vec_append(r, funcs);
+    if (start)
+        vec_push(r, start);
+    return r;
+}
+
+static long program_size(Vector *toplevels) {
+    if (!pass_stats)
+        return 0;
+    long r = 0;
+    for (int i = 0; i < vec_len(toplevels); i++) {
+        Node *v = vec_get(toplevels, i);
+        if (v->kind == AST_FUNC)
+            r += tree_size(v->body);
+    }
+    return r;
+}
+
+static bool begin_pass(Vector *toplevels, int pass) {
+    if (!pass_enabled(pass))
+        return false;
+    pass_start(pass, program_size(toplevels));
+    return true;
+}
+
+static void end_pass(Vector *toplevels, int pass) {
+    pass_stop(pass);
+    if (!pass_finish(pass, program_size(toplevels)))
+        return;
+    fprintf(stderr, "; after %s:\n", pass_name(pass));
+    for (int i = 0; i < vec_len(toplevels); i++) {
+        Node *v = vec_get(toplevels, i);
+        if (v->kind == AST_FUNC)
+            fprintf(stderr, "%s\n", node2s(v));
+    }
+}
+
+// Whether optimize_program has any pass to run, so that the program must
+// be read in whole before any of it is emitted.
+bool needs_whole_program(void) {
+    for (int i = PASS_UNREACHABLE; i <= PASS_PLACEMENT; i++)
+        if (pass_enabled(i))
+            return true;
+    return false;
+}
+
+// Runs the whole-program passes. Nothing is changed for programs without
+// _start, since their callers are not all known.
+Vector *optimize_program(Vector *toplevels) {
+    if (begin_pass(toplevels, PASS_UNREACHABLE)) {
+        toplevels = remove_unreachable(toplevels);
+        end_pass(toplevels, PASS_UNREACHABLE);
+    }
+    analyze(toplevels);
+    FuncInfo *start = map_get(infos, "_start");
+    if (!start || !start->func)
+        return toplevels;
+    if (begin_pass(toplevels, PASS_DEVIRTUALIZE)) {
+        devirtualize(toplevels);
+        analyze(toplevels);
+        end_pass(toplevels, PASS_DEVIRTUALIZE);
+    }
+    if (has_profile() && begin_pass(toplevels, PASS_INLINE)) {
+        inline_hot_calls(toplevels);
+        analyze(toplevels);
+        end_pass(toplevels, PASS_INLINE);
+    }
+    if (begin_pass(toplevels, PASS_CONSTGLOBALS)) {
+        fold_constant_globals(toplevels);
+        fold_functions(toplevels);
+        end_pass(toplevels, PASS_CONSTGLOBALS);
+    }
+    if (begin_pass(toplevels, PASS_IPCP)) {
+        propagate_constants(toplevels);
+        fold_functions(toplevels);
+        end_pass(toplevels, PASS_IPCP);
+    }
+    if (begin_pass(toplevels, PASS_EVALUATE)) {
+        for (int i = 0; i < vec_len(toplevels); i++)
+            evaluate_calls((Node **)vec_body(toplevels) + i);
+        fold_functions(toplevels);
+        end_pass(toplevels, PASS_EVALUATE);
+    }
+    if (begin_pass(toplevels, PASS_HEAP2STACK)) {
+        promote_allocations(toplevels);
+        analyze(toplevels);
+        end_pass(toplevels, PASS_HEAP2STACK);
+    }
+    if (begin_pass(toplevels, PASS_SPECIALIZE)) {
+        toplevels = specialize(toplevels);
+        analyze(toplevels);
+        end_pass(toplevels, PASS_SPECIALIZE);
+    }
+    if (begin_pass(toplevels, PASS_DEADPARAMS)) {
+        remove_dead_params(toplevels);
+        analyze(toplevels);
+        end_pass(toplevels, PASS_DEADPARAMS);
+    }
+    if (begin_pass(toplevels, PASS_DEADRETURNS)) {
+        remove_unused_returns(toplevels);
+        analyze(toplevels);
+        end_pass(toplevels, PASS_DEADRETURNS);
+    }
+    if (begin_pass(toplevels, PASS_DEADCALLS)) {
+        for (int i = 0; i < vec_len(toplevels); i++) {
+            Node *v = vec_get(toplevels, i);
+            if (v->kind == AST_FUNC)
+                remove_dead_calls(&v->body, false);
+        }
+        end_pass(toplevels, PASS_DEADCALLS);
+    }
+    if (begin_pass(toplevels, PASS_UNREACHABLE)) {
+        toplevels = remove_unreachable(toplevels);
+        end_pass(toplevels, PASS_UNREACHABLE);
+    }
+    analyze(toplevels);
+    scan_program(toplevels);
+    if (begin_pass(toplevels, PASS_READONLY)) {
+        for (int i = 0; i < vec_len(toplevels); i++) {
+            Node *v = vec_get(toplevels, i);
+            FuncInfo *fi = v->kind == AST_FUNC ? map_get(infos, v->fname) : NULL;
+            if (!fi || fi->effect == EFFECT_WRITE || fi->ndefs != 1)
+                continue;
+            map_put(&readonly_funcs, v->fname, fi);
+            if (fi->effect == EFFECT_PURE)
+                stats.pure++;
+            else
+                stats.readonly++;
+        }
+        end_pass(toplevels, PASS_READONLY);
+    }
+    if (begin_pass(toplevels, PASS_REGGLOBALS)) {
+        choose_register_globals(toplevels);
+        end_pass(toplevels, PASS_REGGLOBALS);
+    }
+    if (has_profile() && begin_pass(toplevels, PASS_PLACEMENT)) {
+        toplevels = place_functions(toplevels);
+        end_pass(toplevels, PASS_PLACEMENT);
+    }
+    if (opt_report) {
+        fprintf(stderr, "ipo: removed %d unreachable functions and %d unreachable globals\n", stats.funcs, stats.globals);
+        fprintf(stderr, "ipo: %d constant arguments, %d dead parameters, %d unused return values, %d specializations, %d dead calls\n",
+                stats.consts, stats.params, stats.returns, stats.specialized, stats.calls);
+        fprintf(stderr, "ipo: %d pure and %d read-only functions\n", stats.pure, stats.readonly);
+        fprintf(stderr, "ipo: %d indirect calls made direct, %d guarded\n", stats.direct, stats.guarded);
+        fprintf(stderr, "ipo: %d hot calls inlined\n", stats.inlined);
+        fprintf(stderr, "ipo: %d calls evaluated at compile time\n", stats.evaluated);
+        fprintf(stderr, "ipo: %d allocations moved to the stack\n", stats.promoted);
+        fprintf(stderr, "ipo: %d reads of constant globals folded, %d globals kept in registers\n", stats.constglobals, stats.registers);
+    }
+    return toplevels;
+}
+
+// Whether a call to the named function leaves all memory outside the
+// callee's own frame untouched.
+bool is_readonly_func(char *name) {
+    return map_get(&readonly_funcs, name) != NULL;
+}
+
+// Globals that gen.c keeps in registers in the named function, mapped to
+// whether the function writes them, or NULL.
+Dict *register_globals(char *fname) {
+    return map_get(&register_funcs, fname);
+}
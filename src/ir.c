@@ -0,0 +1,1111 @@
+/*
+ * Intermediate representation.
+ *
+ * Function bodies are represented as a control flow graph of minivm
+ * instructions over an unbounded set of virtual registers. gen.c lowers the
+ * AST by emitting the instruction text of each function, which is parsed
+ * into the graph here, and the assembly that reaches the output is printed
+ * back from it. Get and set carry the alias class of the word they access
+ * (T_INT, T_PTR or T_FLOAT), which is all the type information the VM has.
+ *
+ * Besides the graph this file provides what the passes in opt.c build on:
+ * dominator trees and dominance frontiers, def-use counts and use lists,
+ * liveness, and conversion of a function into SSA form and back.
+ */
+
+#include "8cc.h"
+
+static char *opnames[NUM_IOPS] = {
+    [I_LABEL] = "@",
+    [I_INT] = "int",
+    [I_NIL] = "nil",
+    [I_REG] = "reg",
+    [I_ADD] = "add",
+    [I_SUB] = "sub",
+    [I_MUL] = "mul",
+    [I_DIV] = "div",
+    [I_MOD] = "mod",
+    [I_BOR] = "bor",
+    [I_BAND] = "band",
+    [I_BXOR] = "bxor",
+    [I_BSHL] = "bshl",
+    [I_BSHR] = "bshr",
+    [I_GET] = "get",
+    [I_SET] = "set",
+    [I_ADDR] = "addr",
+    [I_ARR] = "arr",
+    [I_CALL] = "call",
+    [I_DCALL] = "dcall",
+    [I_GETCHAR] = "getchar",
+    [I_PUTCHAR] = "putchar",
+    [I_JUMP] = "jump",
+    [I_BEQ] = "beq",
+    [I_BLT] = "blt",
+    [I_RET] = "ret",
+    [I_EXIT] = "exit",
+};
+
+/*
+ * Parsing and printing
+ */
+
+Insn *make_insn(int op) {
+    Insn *r = arena_calloc(MEM_IR, 1, sizeof(Insn));
+    r->op = op;
+    r->dst = -1;
+    return r;
+}
+
+static int lookup_op(char *name) {
+    for (int i = 0; i < NUM_IOPS; i++)
+        if (opnames[i] && !strcmp(opnames[i], name))
+            return i;
+    return -1;
+}
+
+static bool parse_reg(char *s, int *r) {
+    if (!s || s[0] != 'r' || !isdigit(s[1]))
+        return false;
+    char *end;
+    *r = strtol(s + 1, &end, 10);
+    return *end == '\0';
+}
+
+static bool add_arg(Insn *in, char *s) {
+    if (in->nargs == 3)
+        return false;
+    return parse_reg(s, &in->args[in->nargs++]);
+}
+
+static Insn *parse_operands(char **tok, int ntok) {
+    if (tok[0][0] == '@') {
+        Insn *r = make_insn(I_LABEL);
+        r->sym = tok[0] + 1;
+        return ntok == 1 ? r : NULL;
+    }
+    if (ntok >= 3 && !strcmp(tok[1], "<-")) {
+        int op = lookup_op(tok[2]);
+        if (op < 0)
+            return NULL;
+        Insn *r = make_insn(op);
+        if (!parse_reg(tok[0], &r->dst))
+            return NULL;
+        char **a = tok + 3;
+        int n = ntok - 3;
+        switch (op) {
+            case I_INT:
+                if (n != 1)
+                    return NULL;
+                r->imm = strtol(a[0], NULL, 10);
+                return r;
+            case I_NIL:
+            case I_GETCHAR:
+                return n == 0 ? r : NULL;
+            case I_ADDR:
+                if (n != 1)
+                    return NULL;
+                r->sym = a[0];
+                return r;
+            case I_CALL:
+                if (n != 2)
+                    return NULL;
+                r->sym = a[0];
+                return add_arg(r, a[1]) ? r : NULL;
+            case I_REG:
+            case I_ARR:
+                return n == 1 && add_arg(r, a[0]) ? r : NULL;
+            case I_LABEL:
+            case I_SET:
+            case I_PUTCHAR:
+            case I_JUMP:
+            case I_BEQ:
+            case I_BLT:
+            case I_RET:
+            case I_EXIT:
+                return NULL;
+            default:
+                return n == 2 && add_arg(r, a[0]) && add_arg(r, a[1]) ? r : NULL;
+        }
+    }
+    int op = lookup_op(tok[0]);
+    if (op < 0)
+        return NULL;
+    Insn *r = make_insn(op);
+    switch (op) {
+        case I_SET:
+            return ntok == 4 && add_arg(r, tok[1]) && add_arg(r, tok[2]) && add_arg(r, tok[3]) ? r : NULL;
+        case I_PUTCHAR:
+        case I_RET:
+            return ntok == 2 && add_arg(r, tok[1]) ? r : NULL;
+        case I_JUMP:
+            if (ntok != 2)
+                return NULL;
+            r->target[0] = tok[1];
+            return r;
+        case I_BEQ:
+        case I_BLT:
+            if (ntok != 5 || !add_arg(r, tok[1]) || !add_arg(r, tok[2]))
+                return NULL;
+            r->target[0] = tok[3];
+            r->target[1] = tok[4];
+            return r;
+        case I_EXIT:
+            return ntok == 1 ? r : NULL;
+    }
+    return NULL;
+}
+
+// Parses one line of gen.c output. Returns NULL for anything unexpected,
+// which makes the caller give up and print the function unchanged.
+static Insn *parse_insn(char *line) {
+    char *tok[8];
+    int ntok = 0;
+    for (char *p = line; *p;) {
+        if (*p == ' ') {
+            *p++ = '\0';
+            continue;
+        }
+        if (ntok == 8)
+            return NULL;
+        tok[ntok++] = p;
+        while (*p && *p != ' ')
+            p++;
+    }
+    if (ntok == 0)
+        return NULL;
+    int tag = T_ANY;
+    if (ntok > 1 && tok[ntok - 1][0] == ':') {
+        char *t = tok[--ntok] + 1;
+        if (!strcmp(t, "int"))
+            tag = T_INT;
+        else if (!strcmp(t, "ptr"))
+            tag = T_PTR;
+        else if (!strcmp(t, "float"))
+            tag = T_FLOAT;
+        else
+            return NULL;
+    }
+    Insn *r = parse_operands(tok, ntok);
+    if (r && tag != T_ANY) {
+        if (r->op != I_GET && r->op != I_SET)
+            return NULL;
+        r->tag = tag;
+    }
+    return r;
+}
+
+Vector *parse_body(char *body) {
+    Vector *r = make_vector();
+    char *p = body;
+    while (*p) {
+        char *nl = strchr(p, '\n');
+        if (nl)
+            *nl = '\0';
+        char *q = p;
+        while (*q == ' ')
+            q++;
+        if (*q) {
+            Insn *in = parse_insn(q);
+            if (!in)
+                return NULL;
+            vec_push(r, in);
+        }
+        if (!nl)
+            break;
+        p = nl + 1;
+    }
+    return r;
+}
+
+// Splits a whole program into the toplevel code, named "<top>", and its
+// functions. Returns pairs of a name and the parsed body, the toplevel
+// code first, or NULL if any line is not an instruction.
+Vector *parse_program(char *src) {
+    Buffer *top = make_buffer();
+    Buffer *body = NULL;
+    char *name = NULL;
+    Vector *bodies = make_vector();
+    for (char *p = strdup(src); *p;) {
+        char *nl = strchr(p, '\n');
+        if (nl)
+            *nl = '\0';
+        while (*p == ' ')
+            p++;
+        if (!strncmp(p, "func ", 5)) {
+            name = p + 5;
+            body = make_buffer();
+        } else if (!strcmp(p, "end")) {
+            if (!body)
+                return NULL;
+            vec_push(bodies, make_pair(name, body));
+            body = NULL;
+        } else if (*p) {
+            buf_printf(body ? body : top, "%s\n", p);
+        }
+        if (!nl)
+            break;
+        p = nl + 1;
+    }
+    if (body)
+        return NULL;
+    Vector *r = make_vector();
+    for (int i = -1; i < vec_len(bodies); i++) {
+        void **pair = i < 0 ? make_pair("<top>", top) : vec_get(bodies, i);
+        buf_write(pair[1], '\0');
+        Vector *insns = parse_body(buf_body(pair[1]));
+        if (!insns)
+            return NULL;
+        vec_push(r, make_pair(pair[0], insns));
+    }
+    return r;
+}
+
+void print_insn(Buffer *b, Insn *in) {
+    switch (in->op) {
+        case I_LABEL:
+            buf_printf(b, "@%s\n", in->sym);
+            return;
+        case I_SET:
+            buf_printf(b, "    set r%d r%d r%d\n", in->args[0], in->args[1], in->args[2]);
+            return;
+        case I_PUTCHAR:
+        case I_RET:
+            buf_printf(b, "    %s r%d\n", opnames[in->op], in->args[0]);
+            return;
+        case I_JUMP:
+            buf_printf(b, "    jump %s\n", in->target[0]);
+            return;
+        case I_BEQ:
+        case I_BLT:
+            buf_printf(b, "    %s r%d r%d %s %s\n", opnames[in->op], in->args[0], in->args[1], in->target[0], in->target[1]);
+            return;
+        case I_EXIT:
+            buf_printf(b, "    exit\n");
+            return;
+    }
+    buf_printf(b, "    r%d <- %s", in->dst, opnames[in->op]);
+    if (in->op == I_INT)
+        buf_printf(b, " %ld", in->imm);
+    if (in->sym)
+        buf_printf(b, " %s", in->sym);
+    for (int i = 0; i < in->nargs; i++)
+        buf_printf(b, " r%d", in->args[i]);
+    buf_printf(b, "\n");
+}
+
+/*
+ * Instruction properties
+ */
+
+bool is_terminator(Insn *in) {
+    return in->op == I_JUMP || in->op == I_BEQ || in->op == I_BLT || in->op == I_RET || in->op == I_EXIT;
+}
+
+// Instructions without side effects that can be removed when their result
+// is unused.
+bool is_pure(Insn *in) {
+    switch (in->op) {
+        case I_INT:
+        case I_NIL:
+        case I_REG:
+        case I_ADD:
+        case I_SUB:
+        case I_MUL:
+        case I_DIV:
+        case I_MOD:
+        case I_BOR:
+        case I_BAND:
+        case I_BXOR:
+        case I_BSHL:
+        case I_BSHR:
+        case I_ADDR:
+        case I_GET:
+            return true;
+    }
+    return false;
+}
+
+// Instructions whose result depends only on their operands, so that two of
+// them with equal operands compute equal values.
+bool is_valuenum(Insn *in) {
+    return is_pure(in) && in->op != I_GET && in->op != I_REG;
+}
+
+bool is_commutative(int op) {
+    return op == I_ADD || op == I_MUL || op == I_BOR || op == I_BAND || op == I_BXOR;
+}
+
+Insn *insn_at(Func *f, int i) {
+    return vec_get(f->insns, i);
+}
+
+/*
+ * Control flow graph
+ */
+
+static Block *make_block(Func *f, int beg) {
+    Block *b = arena_calloc(MEM_IR, 1, sizeof(Block));
+    b->id = vec_len(f->blocks);
+    b->beg = beg;
+    b->succs = make_vector();
+    b->preds = make_vector();
+    b->kids = make_vector();
+    b->rpo = -1;
+    vec_push(f->blocks, b);
+    return b;
+}
+
+static void add_edge(Block *from, Block *to) {
+    for (int i = 0; i < vec_len(from->succs); i++)
+        if (vec_get(from->succs, i) == to)
+            return;
+    vec_push(from->succs, to);
+    vec_push(to->preds, from);
+}
+
+Block *label_block(Func *f, char *label) {
+    Block *b = map_get(f->labels, label);
+    if (!b)
+        error("internal error: unknown label %s in %s", label, f->name);
+    return b;
+}
+
+void build_cfg(Func *f) {
+    f->blocks = make_vector();
+    f->labels = make_map();
+    int n = vec_len(f->insns);
+    Block *cur = NULL;
+    for (int i = 0; i < n; i++) {
+        Insn *in = insn_at(f, i);
+        if (!cur || in->op == I_LABEL) {
+            if (cur)
+                cur->end = i;
+            cur = make_block(f, i);
+        }
+        if (in->op == I_LABEL)
+            map_put(f->labels, in->sym, cur);
+        if (is_terminator(in)) {
+            cur->end = i + 1;
+            cur = NULL;
+        }
+    }
+    if (cur)
+        cur->end = n;
+    for (int i = 0; i < vec_len(f->blocks); i++) {
+        Block *b = vec_get(f->blocks, i);
+        Insn *last = b->end > b->beg ? insn_at(f, b->end - 1) : NULL;
+        if (last && last->op == I_JUMP) {
+            add_edge(b, label_block(f, last->target[0]));
+        } else if (last && (last->op == I_BEQ || last->op == I_BLT)) {
+            add_edge(b, label_block(f, last->target[0]));
+            add_edge(b, label_block(f, last->target[1]));
+        } else if (last && (last->op == I_RET || last->op == I_EXIT)) {
+            // no successors
+        } else if (i + 1 < vec_len(f->blocks)) {
+            add_edge(b, vec_get(f->blocks, i + 1));
+        }
+    }
+}
+
+static void number_rpo(Block *b, Vector *post) {
+    b->rpo = 0;
+    for (int i = 0; i < vec_len(b->succs); i++) {
+        Block *s = vec_get(b->succs, i);
+        if (s->rpo < 0)
+            number_rpo(s, post);
+    }
+    vec_push(post, b);
+}
+
+static Block *intersect(Block *a, Block *b) {
+    while (a != b) {
+        while (a->rpo > b->rpo)
+            a = a->idom;
+        while (b->rpo > a->rpo)
+            b = b->idom;
+    }
+    return a;
+}
+
+// Cooper, Harvey and Kennedy, "A Simple, Fast Dominance Algorithm".
+// Returns the reachable blocks in reverse postorder.
+Vector *compute_dominators(Func *f) {
+    Vector *post = make_vector();
+    number_rpo(vec_get(f->blocks, 0), post);
+    Vector *rpo = vec_reverse(post);
+    for (int i = 0; i < vec_len(rpo); i++)
+        ((Block *)vec_get(rpo, i))->rpo = i;
+    Block *entry = vec_get(rpo, 0);
+    entry->idom = entry;
+    for (bool changed = true; changed;) {
+        changed = false;
+        for (int i = 1; i < vec_len(rpo); i++) {
+            Block *b = vec_get(rpo, i);
+            Block *idom = NULL;
+            for (int j = 0; j < vec_len(b->preds); j++) {
+                Block *p = vec_get(b->preds, j);
+                if (!p->idom)
+                    continue;
+                idom = idom ? intersect(p, idom) : p;
+            }
+            if (idom != b->idom) {
+                b->idom = idom;
+                changed = true;
+            }
+        }
+    }
+    for (int i = 1; i < vec_len(rpo); i++) {
+        Block *b = vec_get(rpo, i);
+        vec_push(b->idom->kids, b);
+    }
+    return rpo;
+}
+
+bool dominates(Block *a, Block *b) {
+    if (!a->idom || !b->idom)
+        return false;
+    for (;;) {
+        if (a == b)
+            return true;
+        if (b->idom == b)
+            return false;
+        b = b->idom;
+    }
+}
+
+// Cooper, Harvey and Kennedy again. Blocks that are not reachable from the
+// entry get an empty frontier.
+void compute_frontiers(Func *f, Vector *rpo) {
+    for (int i = 0; i < vec_len(f->blocks); i++)
+        ((Block *)vec_get(f->blocks, i))->frontier = make_vector();
+    for (int i = 0; i < vec_len(rpo); i++) {
+        Block *b = vec_get(rpo, i);
+        if (vec_len(b->preds) < 2)
+            continue;
+        for (int j = 0; j < vec_len(b->preds); j++) {
+            Block *runner = vec_get(b->preds, j);
+            if (!runner->idom)
+                continue;
+            while (runner != b->idom) {
+                if (!vec_len(runner->frontier) || vec_tail(runner->frontier) != b)
+                    vec_push(runner->frontier, b);
+                runner = runner->idom;
+            }
+        }
+    }
+}
+
+/*
+ * Def-use counts
+ */
+
+void count_defs_uses(Func *f) {
+    int n = f->nregs;
+    f->ndefs = arena_calloc(MEM_IR, n, sizeof(int));
+    f->nuses = arena_calloc(MEM_IR, n, sizeof(int));
+    f->defat = arena_calloc(MEM_IR, n, sizeof(int));
+    f->blockof = arena_calloc(MEM_IR, vec_len(f->insns), sizeof(int));
+    for (int i = 0; i < vec_len(f->blocks); i++) {
+        Block *b = vec_get(f->blocks, i);
+        for (int j = b->beg; j < b->end; j++)
+            f->blockof[j] = i;
+    }
+    for (int i = 0; i < vec_len(f->insns); i++) {
+        Insn *in = insn_at(f, i);
+        if (in->dead)
+            continue;
+        if (in->dst >= 0) {
+            f->ndefs[in->dst]++;
+            f->defat[in->dst] = i;
+        }
+        for (int j = 0; j < in->nargs; j++)
+            f->nuses[in->args[j]]++;
+    }
+}
+
+bool is_ssa(Func *f, int reg) {
+    return reg != 0 && f->ndefs[reg] == 1;
+}
+
+// True if the value of single-definition register `reg` is available at
+// instruction `at`.
+bool def_reaches(Func *f, int reg, int at) {
+    if (f->ndefs[reg] == 0)
+        return reg == 1;
+    int def = f->defat[reg];
+    Block *db = vec_get(f->blocks, f->blockof[def]);
+    Block *ub = vec_get(f->blocks, f->blockof[at]);
+    if (db == ub)
+        return def < at;
+    return dominates(db, ub);
+}
+
+// Returns, for every register, the indices of the instructions that use
+// it, or NULL if there are none.
+Vector **use_lists(Func *f) {
+    Vector **r = arena_calloc(MEM_IR, f->nregs, sizeof(Vector *));
+    for (int i = 0; i < vec_len(f->insns); i++) {
+        Insn *in = insn_at(f, i);
+        if (in->dead)
+            continue;
+        for (int j = 0; j < in->nargs; j++) {
+            if (!r[in->args[j]])
+                r[in->args[j]] = make_vector();
+            vec_push(r[in->args[j]], (void *)(intptr_t)i);
+        }
+    }
+    return r;
+}
+
+/*
+ * Liveness
+ */
+
+void compute_liveness(Func *f, Vector *rpo) {
+    int words = BITS_WORDS(f->nregs);
+    for (int i = 0; i < vec_len(f->blocks); i++) {
+        Block *b = vec_get(f->blocks, i);
+        b->livein = arena_calloc(MEM_IR, words, sizeof(uint64_t));
+        b->liveout = arena_calloc(MEM_IR, words, sizeof(uint64_t));
+    }
+    uint64_t *live = arena_calloc(MEM_IR, words, sizeof(uint64_t));
+    for (bool changed = true; changed;) {
+        changed = false;
+        for (int i = vec_len(rpo) - 1; i >= 0; i--) {
+            Block *b = vec_get(rpo, i);
+            for (int j = 0; j < vec_len(b->succs); j++) {
+                Block *s = vec_get(b->succs, j);
+                for (int w = 0; w < words; w++)
+                    b->liveout[w] |= s->livein[w];
+            }
+            memcpy(live, b->liveout, words * sizeof(uint64_t));
+            for (int j = b->end - 1; j >= b->beg; j--) {
+                Insn *in = insn_at(f, j);
+                if (in->dead)
+                    continue;
+                if (in->dst >= 0)
+                    BIT_CLR(live, in->dst);
+                for (int k = 0; k < in->nargs; k++)
+                    BIT_SET(live, in->args[k]);
+            }
+            if (memcmp(live, b->livein, words * sizeof(uint64_t))) {
+                memcpy(b->livein, live, words * sizeof(uint64_t));
+                changed = true;
+            }
+        }
+    }
+}
+
+/*
+ * SSA form
+ *
+ * build_ssa puts a function into SSA form and takes it out again right
+ * away, which leaves every register except the copies it inserts with a
+ * single definition. The variables being renamed are the registers that
+ * gen.c assigns more than once, and the frame slots whose address never
+ * leaves the function, which are promoted to registers on the way.
+ */
+
+enum {
+    V_NONE,
+    V_CONST,
+    V_FRAME,  // frame address at a known offset
+    V_SOME,   // frame address at an offset that is not known
+};
+
+typedef struct {
+    int kind;
+    long off;
+} Val;
+
+typedef struct {
+    int var;
+    int dst;    // -1 once removed
+    int *args;  // value from each predecessor, -1 if undefined
+} Phi;
+
+typedef struct {
+    Func *f;
+    int nvars;
+    int *regvar;      // register -> variable + 1, 0 if not renamed
+    int *slot;        // instruction -> variable + 1 of the slot it accesses
+    Vector *varreg;   // variable -> original register, -1 for slots
+    Vector *varoff;   // variable -> frame offset, -1 for registers
+    Vector **phis;    // block id -> Phi
+    Vector **stack;   // variable -> current values
+    int *repl;
+} SSA;
+
+static bool is_frame(Val v) {
+    return v.kind == V_FRAME || v.kind == V_SOME;
+}
+
+// A pointer into a frame may be moved backwards as well as forwards, so one
+// that escapes or is offset by an unknown amount reaches every slot.
+static void expose(long *exposed, Val v) {
+    if (is_frame(v))
+        *exposed = LONG_MIN;
+}
+
+// Records in acc the frame offset that each get and set accesses, if known.
+// Returns the lowest offset that may be reached in any other way: LONG_MIN
+// once a frame address is stored to memory, returned, passed or accessed
+// at an offset that is not known, or else the lowest frame handed to a
+// callee in mem[1], which the callee reaches only upwards.
+static long find_slots(Func *f, Vector *rpo, long *acc) {
+    Val *val = arena_calloc(MEM_IR, f->nregs, sizeof(Val));
+    Vector *multi = make_vector();
+    for (int r = 0; r < f->nregs; r++)
+        if (!is_ssa(f, r))
+            vec_push(multi, (void *)(intptr_t)r);
+    long exposed = LONG_MAX;
+    for (int i = 0; i < vec_len(rpo); i++) {
+        Block *b = vec_get(rpo, i);
+        for (int j = 0; j < vec_len(multi); j++)
+            val[(intptr_t)vec_get(multi, j)] = (Val){V_NONE};
+        for (int j = b->beg; j < b->end; j++) {
+            Insn *in = insn_at(f, j);
+            Val v = {V_NONE};
+            Val a = in->nargs > 0 ? val[in->args[0]] : (Val){V_NONE};
+            Val c = in->nargs > 1 ? val[in->args[1]] : (Val){V_NONE};
+            switch (in->op) {
+                case I_GET:
+                case I_SET:
+                    if (c.kind == V_FRAME)
+                        acc[j] = c.off;
+                    else
+                        expose(&exposed, c);
+                    if (in->op == I_GET && in->dst == 2)
+                        v = (Val){V_FRAME, 0};
+                    if (in->op != I_SET)
+                        break;
+                    // A callee reaches the frame handed to it in mem[1]
+                    // only upwards, and restoring mem[1] after a call hands
+                    // out nothing new.
+                    if (c.kind != V_CONST || c.off != 1) {
+                        expose(&exposed, val[in->args[2]]);
+                    } else if (in->args[2] != 2) {
+                        Val frame = val[in->args[2]];
+                        if (frame.kind == V_FRAME && frame.off < exposed)
+                            exposed = frame.off;
+                        else
+                            expose(&exposed, frame);
+                    }
+                    break;
+                case I_INT:
+                    v = (Val){V_CONST, in->imm};
+                    break;
+                case I_REG:
+                    v = a;
+                    break;
+                case I_ADD:
+                    if (a.kind == V_CONST && c.kind == V_CONST)
+                        v = (Val){V_CONST, a.off + c.off};
+                    else if (is_frame(a) && c.kind == V_CONST && c.off >= 0)
+                        v = (Val){a.kind, a.off + c.off};
+                    else if (is_frame(c) && a.kind == V_CONST && a.off >= 0)
+                        v = (Val){c.kind, c.off + a.off};
+                    else if (is_frame(a) && c.kind == V_NONE)
+                        v = (Val){V_SOME, a.off};
+                    else if (is_frame(c) && a.kind == V_NONE)
+                        v = (Val){V_SOME, c.off};
+                    else {
+                        expose(&exposed, a);
+                        expose(&exposed, c);
+                    }
+                    break;
+                case I_SUB:
+                    if (a.kind == V_CONST && c.kind == V_CONST)
+                        v = (Val){V_CONST, a.off - c.off};
+                    else if (is_frame(a) && is_frame(c))
+                        v = (Val){V_NONE};
+                    else if (is_frame(a))
+                        expose(&exposed, a);
+                    else
+                        expose(&exposed, c);
+                    break;
+                default:
+                    for (int k = 0; k < in->nargs; k++)
+                        expose(&exposed, val[in->args[k]]);
+            }
+            if (in->dst < 0)
+                continue;
+            val[in->dst] = v;
+            // Values of other multi-def registers are not followed across
+            // blocks.
+            if (in->dst != 0 && !is_ssa(f, in->dst))
+                expose(&exposed, v);
+        }
+    }
+    return exposed;
+}
+
+static int var_top(SSA *s, int var) {
+    Vector *st = s->stack[var];
+    return vec_len(st) ? (int)(intptr_t)vec_tail(st) : -1;
+}
+
+static void var_push(SSA *s, int var, int reg, Vector *pushed) {
+    vec_push(s->stack[var], (void *)(intptr_t)reg);
+    vec_push(pushed, (void *)(intptr_t)var);
+}
+
+static void rename_block(SSA *s, Block *b) {
+    Func *f = s->f;
+    Vector *pushed = make_vector();
+    Vector *phis = s->phis[b->id];
+    for (int i = 0; i < vec_len(phis); i++) {
+        Phi *phi = vec_get(phis, i);
+        phi->dst = f->nregs++;
+        var_push(s, phi->var, phi->dst, pushed);
+    }
+    for (int j = b->beg; j < b->end; j++) {
+        Insn *in = insn_at(f, j);
+        for (int k = 0; k < in->nargs; k++)
+            if (s->regvar[in->args[k]])
+                in->args[k] = var_top(s, s->regvar[in->args[k]] - 1);
+        if (s->slot[j]) {
+            int var = s->slot[j] - 1;
+            if (in->op == I_SET) {
+                var_push(s, var, in->args[2], pushed);
+                in->dead = true;
+                continue;
+            }
+            int cur = var_top(s, var);
+            in->tag = T_ANY;
+            if (cur < 0) {
+                in->op = I_INT;
+                in->imm = 0;
+                in->nargs = 0;
+            } else {
+                in->op = I_REG;
+                in->nargs = 1;
+                in->args[0] = cur;
+            }
+        }
+        if (in->dst >= 0 && s->regvar[in->dst]) {
+            int var = s->regvar[in->dst] - 1;
+            in->dst = f->nregs++;
+            var_push(s, var, in->dst, pushed);
+        }
+    }
+    for (int i = 0; i < vec_len(b->succs); i++) {
+        Block *succ = vec_get(b->succs, i);
+        int k = 0;
+        while (vec_get(succ->preds, k) != b)
+            k++;
+        Vector *sp = s->phis[succ->id];
+        for (int j = 0; j < vec_len(sp); j++) {
+            Phi *phi = vec_get(sp, j);
+            phi->args[k] = var_top(s, phi->var);
+        }
+    }
+    for (int i = 0; i < vec_len(b->kids); i++)
+        rename_block(s, vec_get(b->kids, i));
+    for (int i = vec_len(pushed) - 1; i >= 0; i--)
+        vec_pop(s->stack[(int)(intptr_t)vec_get(pushed, i)]);
+}
+
+static int find_repl(SSA *s, int reg) {
+    while (reg >= 0 && s->repl[reg] != reg)
+        reg = s->repl[reg];
+    return reg;
+}
+
+// A phi whose arguments are all the same value or the phi itself is that
+// value.
+static void remove_trivial_phis(SSA *s) {
+    Func *f = s->f;
+    s->repl = arena_malloc(MEM_IR, f->nregs * sizeof(int));
+    for (int r = 0; r < f->nregs; r++)
+        s->repl[r] = r;
+    for (bool changed = true; changed;) {
+        changed = false;
+        for (int i = 0; i < vec_len(f->blocks); i++) {
+            Block *b = vec_get(f->blocks, i);
+            Vector *phis = s->phis[b->id];
+            for (int j = 0; j < vec_len(phis); j++) {
+                Phi *phi = vec_get(phis, j);
+                if (phi->dst < 0)
+                    continue;
+                int same = -1;
+                bool trivial = true;
+                for (int k = 0; k < vec_len(b->preds) && trivial; k++) {
+                    int a = find_repl(s, phi->args[k]);
+                    if (a < 0 || a == phi->dst)
+                        continue;
+                    if (same >= 0 && same != a)
+                        trivial = false;
+                    same = a;
+                }
+                if (!trivial || same < 0)
+                    continue;
+                s->repl[phi->dst] = same;
+                phi->dst = -1;
+                changed = true;
+            }
+        }
+    }
+    for (int i = 0; i < vec_len(f->insns); i++) {
+        Insn *in = insn_at(f, i);
+        for (int k = 0; k < in->nargs; k++)
+            in->args[k] = find_repl(s, in->args[k]);
+    }
+}
+
+static Insn *make_copy(int dst, int src) {
+    Insn *r = make_insn(I_REG);
+    r->dst = dst;
+    r->nargs = 1;
+    r->args[0] = src;
+    return r;
+}
+
+// Replaces the phis by copies in their predecessors. The copies on one edge
+// happen in parallel, so they go through fresh temporaries. Edges leaving a
+// conditional branch get a block of their own.
+static void destruct_ssa(SSA *s, int fp, Vector *entry) {
+    Func *f = s->f;
+    int nblocks = vec_len(f->blocks);
+    Vector **tail = arena_calloc(MEM_IR, nblocks, sizeof(Vector *));
+    Vector *extra = make_vector();
+    int nsplit = 0;
+    for (int i = 0; i < nblocks; i++) {
+        Block *b = vec_get(f->blocks, i);
+        Vector *phis = s->phis[i];
+        for (int k = 0; k < vec_len(b->preds); k++) {
+            Block *p = vec_get(b->preds, k);
+            if (!p->idom)
+                continue;
+            Vector *code = make_vector();
+            Vector *moves = make_vector();
+            for (int j = 0; j < vec_len(phis); j++) {
+                Phi *phi = vec_get(phis, j);
+                int src = find_repl(s, phi->args[k]);
+                if (phi->dst < 0 || src < 0 || src == phi->dst)
+                    continue;
+                int t = f->nregs++;
+                vec_push(code, make_copy(t, src));
+                vec_push(moves, make_copy(phi->dst, t));
+            }
+            if (!vec_len(code))
+                continue;
+            vec_append(code, moves);
+            Insn *last = insn_at(f, p->end - 1);
+            if (last->op != I_BEQ && last->op != I_BLT) {
+                if (!tail[p->id])
+                    tail[p->id] = make_vector();
+                vec_append(tail[p->id], code);
+                continue;
+            }
+            char *target = insn_at(f, b->beg)->sym;
+            Insn *label = make_insn(I_LABEL);
+            label->sym = arena_format("%s.E%d", f->name, nsplit++);
+            vec_push(extra, label);
+            vec_append(extra, code);
+            Insn *jump = make_insn(I_JUMP);
+            jump->target[0] = target;
+            vec_push(extra, jump);
+            for (int t = 0; t < 2; t++)
+                if (!strcmp(last->target[t], target))
+                    last->target[t] = label->sym;
+        }
+    }
+    Vector *insns = make_vector();
+    for (int i = 0; i < nblocks; i++) {
+        Block *b = vec_get(f->blocks, i);
+        for (int j = b->beg; j < b->end; j++) {
+            Insn *in = insn_at(f, j);
+            if (j == b->end - 1 && is_terminator(in) && tail[i])
+                vec_append(insns, tail[i]);
+            if (!in->dead)
+                vec_push(insns, in);
+            if (j == fp)
+                vec_append(insns, entry);
+        }
+        if (tail[i] && !is_terminator(insn_at(f, b->end - 1)))
+            vec_append(insns, tail[i]);
+    }
+    vec_append(insns, extra);
+    f->insns = insns;
+}
+
+// Returns the number of frame slots promoted to registers, or -1 if the
+// function was left alone.
+int build_ssa(Func *f, Vector *rpo) {
+    for (int i = 0; i < vec_len(f->insns); i++) {
+        Insn *in = insn_at(f, i);
+        // A label whose address is taken may be entered from anywhere.
+        if (in->op == I_ADDR && map_get(f->labels, in->sym))
+            return -1;
+    }
+    SSA ss = {0};
+    SSA *s = &ss;
+    s->f = f;
+    s->varreg = make_vector();
+    s->varoff = make_vector();
+    s->regvar = arena_calloc(MEM_IR, f->nregs, sizeof(int));
+    for (int r = 0; r < f->nregs; r++) {
+        if (r == 1 || r == 2 || f->ndefs[r] < 2)
+            continue;
+        vec_push(s->varreg, (void *)(intptr_t)r);
+        vec_push(s->varoff, (void *)(intptr_t)-1);
+        s->regvar[r] = ++s->nvars;
+    }
+
+    int n = vec_len(f->insns);
+    s->slot = arena_calloc(MEM_IR, n, sizeof(int));
+    int fp = -1;
+    if (f->ndefs[2] == 1 && f->blockof[f->defat[2]] == 0)
+        fp = f->defat[2];
+    int nslots = 0;
+    if (fp >= 0) {
+        long *acc = arena_malloc(MEM_IR, n * sizeof(long));
+        for (int i = 0; i < n; i++)
+            acc[i] = -1;
+        long exposed = find_slots(f, rpo, acc);
+        Map *slots = make_map();
+        for (int i = 0; i < n; i++) {
+            if (acc[i] < 0 || acc[i] >= exposed)
+                continue;
+            char *key = arena_format("%ld", acc[i]);
+            int var = (intptr_t)map_get(slots, key);
+            if (!var) {
+                vec_push(s->varreg, (void *)(intptr_t)-1);
+                vec_push(s->varoff, (void *)(intptr_t)acc[i]);
+                var = ++s->nvars;
+                map_put(slots, key, (void *)(intptr_t)var);
+                nslots++;
+            }
+            s->slot[i] = var;
+        }
+    }
+    if (s->nvars == 0)
+        return -1;
+
+    // Liveness of the variables, to place pruned phis.
+    int nblocks = vec_len(f->blocks);
+    int words = BITS_WORDS(s->nvars);
+    uint64_t **use = arena_calloc(MEM_IR, nblocks, sizeof(uint64_t *));
+    uint64_t **def = arena_calloc(MEM_IR, nblocks, sizeof(uint64_t *));
+    uint64_t **live = arena_calloc(MEM_IR, nblocks, sizeof(uint64_t *));
+    for (int i = 0; i < nblocks; i++) {
+        Block *b = vec_get(f->blocks, i);
+        use[i] = arena_calloc(MEM_IR, words, sizeof(uint64_t));
+        def[i] = arena_calloc(MEM_IR, words, sizeof(uint64_t));
+        live[i] = arena_calloc(MEM_IR, words, sizeof(uint64_t));
+        for (int j = b->beg; j < b->end; j++) {
+            Insn *in = insn_at(f, j);
+            for (int k = 0; k < in->nargs; k++) {
+                int var = s->regvar[in->args[k]] - 1;
+                if (var >= 0 && !BIT_GET(def[i], var))
+                    BIT_SET(use[i], var);
+            }
+            int var = s->slot[j] - 1;
+            if (var >= 0 && in->op == I_GET && !BIT_GET(def[i], var))
+                BIT_SET(use[i], var);
+            if (var >= 0 && in->op == I_SET)
+                BIT_SET(def[i], var);
+            if (in->dst >= 0 && s->regvar[in->dst])
+                BIT_SET(def[i], s->regvar[in->dst] - 1);
+        }
+    }
+    uint64_t *out = arena_calloc(MEM_IR, words, sizeof(uint64_t));
+    for (bool changed = true; changed;) {
+        changed = false;
+        for (int i = vec_len(rpo) - 1; i >= 0; i--) {
+            Block *b = vec_get(rpo, i);
+            memset(out, 0, words * sizeof(uint64_t));
+            for (int j = 0; j < vec_len(b->succs); j++) {
+                Block *succ = vec_get(b->succs, j);
+                for (int w = 0; w < words; w++)
+                    out[w] |= live[succ->id][w];
+            }
+            for (int w = 0; w < words; w++) {
+                uint64_t in = use[b->id][w] | (out[w] & ~def[b->id][w]);
+                if (in != live[b->id][w]) {
+                    live[b->id][w] = in;
+                    changed = true;
+                }
+            }
+        }
+    }
+
+    compute_frontiers(f, rpo);
+    s->phis = arena_calloc(MEM_IR, nblocks, sizeof(Vector *));
+    for (int i = 0; i < nblocks; i++)
+        s->phis[i] = make_vector();
+    bool *has = arena_malloc(MEM_IR, nblocks);
+    bool *queued = arena_malloc(MEM_IR, nblocks);
+    for (int var = 0; var < s->nvars; var++) {
+        memset(has, 0, nblocks);
+        memset(queued, 0, nblocks);
+        Vector *work = make_vector();
+        for (int i = 0; i < vec_len(rpo); i++) {
+            Block *b = vec_get(rpo, i);
+            if (BIT_GET(def[b->id], var)) {
+                vec_push(work, b);
+                queued[b->id] = true;
+            }
+        }
+        while (vec_len(work)) {
+            Block *b = vec_pop(work);
+            for (int i = 0; i < vec_len(b->frontier); i++) {
+                Block *y = vec_get(b->frontier, i);
+                if (has[y->id] || !BIT_GET(live[y->id], var))
+                    continue;
+                has[y->id] = true;
+                Phi *phi = arena_calloc(MEM_IR, 1, sizeof(Phi));
+                phi->var = var;
+                phi->args = arena_malloc(MEM_IR, vec_len(y->preds) * sizeof(int));
+                for (int k = 0; k < vec_len(y->preds); k++)
+                    phi->args[k] = -1;
+                vec_push(s->phis[y->id], phi);
+                if (!queued[y->id]) {
+                    queued[y->id] = true;
+                    vec_push(work, y);
+                }
+            }
+        }
+    }
+
+    // Registers start out with whatever they hold; slots that are read
+    // before being written are loaded right after the frame pointer is set.
+    Block *entry = vec_get(rpo, 0);
+    Vector *entrycode = make_vector();
+    s->stack = arena_calloc(MEM_IR, s->nvars, sizeof(Vector *));
+    for (int var = 0; var < s->nvars; var++) {
+        s->stack[var] = make_vector();
+        int reg = (intptr_t)vec_get(s->varreg, var);
+        long off = (intptr_t)vec_get(s->varoff, var);
+        if (reg >= 0) {
+            vec_push(s->stack[var], (void *)(intptr_t)reg);
+            continue;
+        }
+        if (!BIT_GET(live[entry->id], var))
+            continue;
+        Insn *k = make_insn(I_INT);
+        k->dst = f->nregs++;
+        k->imm = off;
+        Insn *a = make_insn(I_ADD);
+        a->dst = f->nregs++;
+        a->nargs = 2;
+        a->args[0] = 2;
+        a->args[1] = k->dst;
+        Insn *g = make_insn(I_GET);
+        g->dst = f->nregs++;
+        g->nargs = 2;
+        g->args[0] = 1;
+        g->args[1] = a->dst;
+        vec_push(entrycode, k);
+        vec_push(entrycode, a);
+        vec_push(entrycode, g);
+        vec_push(s->stack[var], (void *)(intptr_t)g->dst);
+    }
+
+    rename_block(s, entry);
+    remove_trivial_phis(s);
+    destruct_ssa(s, fp, entrycode);
+    build_cfg(f);
+    return nslots;
+}
@@ -0,0 +1,522 @@
+/*
+ * Native code for -jon.
+ *
+ * The program text that goes to vm_asm is translated into x86-64 code by
+ * pasting a fixed template for each instruction. Registers live in the
+ * native stack frame as doubles, the VM's number type, and the memory
+ * array made by the entry code is a plain array of doubles whose base is
+ * kept in r12. Function values are their index in the function table,
+ * where index 0 belongs to the toplevel code, so 0 stays a null pointer.
+ *
+ * A function is translated the first time it is called, through a stub
+ * in its slot of the function table, and is called directly through that
+ * slot from then on. Programs that use anything the templates do not
+ * cover, such as label addresses or a second array, are left to the
+ * interpreter.
+ *
+ * The code is never writable and executable at once. It is mapped
+ * writable, and each translation is made executable once it is done. The
+ * page it ends in is made writable again while the next one is written,
+ * which happens only in jit_compile, when no translated code is running.
+ */
+
+#include <math.h>
+#include <sys/mman.h>
+
+#include "8cc.h"
+
+#if defined(__x86_64__)
+
+#define CODE_SIZE ((size_t)1 << 28)
+#define STACK_SIZE ((size_t)1 << 30)
+#define PAGE_SIZE 4096
+
+typedef struct {
+    char *name;
+    Vector *insns;
+    int nregs;
+    void *entry;
+} JitFunc;
+
+typedef struct {
+    size_t pos;  // offset of a rel32 operand
+    char *label;
+} Fixup;
+
+typedef struct {
+    Map *labels;     // label -> code offset + 1
+    Vector *fixups;  // Fixup, with a NULL label for the bounds trap
+} Compile;
+
+static Vector *funcs;   // JitFunc, the toplevel code first
+static Map *funcindex;  // name -> index in funcs
+static void **table;    // entry of each function
+static uint8_t *code;
+static size_t codelen;
+static size_t sealed;  // code below this is executable
+static double *memory;
+static long memsize;
+static void *saved_rsp;
+static void *exit_stub;
+static void *lazy_stub;
+
+/*
+ * Loading
+ */
+
+static bool load_program(char *src) {
+    Vector *prog = parse_program(src);
+    if (!prog)
+        return false;
+    funcs = make_vector();
+    funcindex = make_map();
+    for (int i = 0; i < vec_len(prog); i++) {
+        void **pair = vec_get(prog, i);
+        JitFunc *f = calloc(1, sizeof(JitFunc));
+        f->name = pair[0];
+        f->insns = pair[1];
+        map_put(funcindex, f->name, (void *)(intptr_t)i);
+        vec_push(funcs, f);
+    }
+    return true;
+}
+
+static int func_index(char *name) {
+    void *r = map_get(funcindex, name);
+    return r ? (intptr_t)r : -1;
+}
+
+static bool supported(void) {
+    int narr = 0;
+    for (int i = 0; i < vec_len(funcs); i++) {
+        JitFunc *f = vec_get(funcs, i);
+        Map *labels = make_map();
+        for (int j = 0; j < vec_len(f->insns); j++) {
+            Insn *in = vec_get(f->insns, j);
+            if (in->op == I_LABEL)
+                map_put(labels, in->sym, (void *)1);
+        }
+        f->nregs = 3;
+        for (int j = 0; j < vec_len(f->insns); j++) {
+            Insn *in = vec_get(f->insns, j);
+            if (in->dst >= f->nregs)
+                f->nregs = in->dst + 1;
+            for (int k = 0; k < in->nargs; k++)
+                if (in->args[k] >= f->nregs)
+                    f->nregs = in->args[k] + 1;
+            switch (in->op) {
+                case I_ADDR:
+                case I_CALL:
+                    if (func_index(in->sym) <= 0)
+                        return false;
+                    break;
+                case I_ARR:
+                    if (i != 0 || narr++)
+                        return false;
+                    break;
+                case I_BEQ:
+                case I_BLT:
+                    if (!map_get(labels, in->target[1]))
+                        return false;
+                    // fall through
+                case I_JUMP:
+                    if (!map_get(labels, in->target[0]))
+                        return false;
+                    break;
+            }
+        }
+    }
+    return narr == 1;
+}
+
+/*
+ * Code emission
+ */
+
+// Makes the page the code ends in writable again, if it was sealed.
+static void unseal(void) {
+    size_t page = codelen & ~(size_t)(PAGE_SIZE - 1);
+    if (page == sealed)
+        return;
+    if (mprotect(code + page, sealed - page, PROT_READ | PROT_WRITE))
+        error("cannot make native code writable: %s", strerror(errno));
+    sealed = page;
+}
+
+// Makes the code written since the last call executable.
+static void seal(void) {
+    size_t end = (codelen + PAGE_SIZE - 1) & ~(size_t)(PAGE_SIZE - 1);
+    if (mprotect(code + sealed, end - sealed, PROT_READ | PROT_EXEC))
+        error("cannot make native code executable: %s", strerror(errno));
+    sealed = end;
+}
+
+static void out(const char *bytes, int n) {
+    if (codelen + n > CODE_SIZE)
+        error("out of space for native code");
+    memcpy(code + codelen, bytes, n);
+    codelen += n;
+}
+
+static void out4(int32_t v) {
+    out((char *)&v, 4);
+}
+
+static void out8(uint64_t v) {
+    out((char *)&v, 8);
+}
+
+// An instruction whose last operand is the frame slot of a VM register.
+static void out_slot(const char *op, int n, int reg) {
+    out(op, n);
+    out4(-8 * (reg + 1));
+}
+
+static void mov_rax_imm(uint64_t v) {
+    out("\x48\xB8", 2);
+    out8(v);
+}
+
+static void mov_rax_double(double d) {
+    uint64_t bits;
+    memcpy(&bits, &d, 8);
+    mov_rax_imm(bits);
+}
+
+static void call_abs(void *fn) {
+    mov_rax_imm((uintptr_t)fn);
+    out("\xFF\xD0", 2);
+}
+
+static void jump_abs(void *fn) {
+    mov_rax_imm((uintptr_t)fn);
+    out("\xFF\xE0", 2);
+}
+
+static void load_xmm0(int reg) {
+    out_slot("\xF2\x0F\x10\x85", 4, reg);
+}
+
+static void load_xmm1(int reg) {
+    out_slot("\xF2\x0F\x10\x8D", 4, reg);
+}
+
+static void store_xmm0(int reg) {
+    out_slot("\xF2\x0F\x11\x85", 4, reg);
+}
+
+static void store_rax(int reg) {
+    out_slot("\x48\x89\x85", 3, reg);
+}
+
+// Truncates a register to an integer in rax or rcx.
+static void trunc_rax(int reg) {
+    out_slot("\xF2\x48\x0F\x2C\x85", 5, reg);
+}
+
+static void trunc_rcx(int reg) {
+    out_slot("\xF2\x48\x0F\x2C\x8D", 5, reg);
+}
+
+static void rel32(Compile *c, char *label) {
+    Fixup *fx = malloc(sizeof(Fixup));
+    fx->pos = codelen;
+    fx->label = label;
+    vec_push(c->fixups, fx);
+    out4(0);
+}
+
+// Puts the memory index in `reg` into rax, going to the bounds trap
+// unless it is inside the memory array.
+static void mem_index(Compile *c, int reg) {
+    trunc_rax(reg);
+    out("\x48\xB9", 2);  // mov rcx, &memsize
+    out8((uintptr_t)&memsize);
+    out("\x48\x3B\x01", 3);  // cmp rax, [rcx]
+    out("\x0F\x83", 2);      // jae
+    rel32(c, NULL);
+}
+
+static void int_to_xmm0(void) {
+    out("\xF2\x48\x0F\x2A\xC0", 5);  // cvtsi2sd xmm0, rax
+}
+
+/*
+ * Runtime helpers called from native code
+ */
+
+static int jit_putchar(int c) {
+    return putchar(c);
+}
+
+static int jit_getchar(void) {
+    return getchar();
+}
+
+static double *jit_arr(double n) {
+    memsize = (long)n;
+    memory = calloc(memsize > 0 ? memsize : 1, sizeof(double));
+    if (!memory)
+        error("cannot allocate %ld words of VM memory", memsize);
+    return memory;
+}
+
+static void jit_bounds(void) {
+    fflush(stdout);
+    error("memory access or indirect call out of bounds");
+}
+
+static void jit_fell_off(void) {
+    fflush(stdout);
+    error("function ended without ret");
+}
+
+/*
+ * Templates
+ */
+
+static void emit_insn(Compile *c, Insn *in) {
+    int *a = in->args;
+    switch (in->op) {
+        case I_LABEL:
+            map_put(c->labels, in->sym, (void *)(codelen + 1));
+            return;
+        case I_INT:
+            mov_rax_double(in->imm);
+            store_rax(in->dst);
+            return;
+        case I_NIL:
+            mov_rax_double(0);
+            store_rax(in->dst);
+            return;
+        case I_REG:
+            out_slot("\x48\x8B\x85", 3, a[0]);  // mov rax, [slot]
+            store_rax(in->dst);
+            return;
+        case I_ADD:
+        case I_SUB:
+        case I_MUL:
+        case I_DIV: {
+            char op = in->op == I_ADD ? 0x58 : in->op == I_SUB ? 0x5C : in->op == I_MUL ? 0x59 : 0x5E;
+            load_xmm0(a[0]);
+            out_slot((char[]){0xF2, 0x0F, op, 0x85}, 4, a[1]);
+            store_xmm0(in->dst);
+            return;
+        }
+        case I_MOD:
+            load_xmm0(a[0]);
+            load_xmm1(a[1]);
+            call_abs(fmod);
+            store_xmm0(in->dst);
+            return;
+        case I_BOR:
+        case I_BAND:
+        case I_BXOR:
+        case I_BSHL:
+        case I_BSHR:
+            trunc_rax(a[0]);
+            trunc_rcx(a[1]);
+            switch (in->op) {
+                case I_BOR:
+                    out("\x48\x09\xC8", 3);  // or rax, rcx
+                    break;
+                case I_BAND:
+                    out("\x48\x21\xC8", 3);  // and rax, rcx
+                    break;
+                case I_BXOR:
+                    out("\x48\x31\xC8", 3);  // xor rax, rcx
+                    break;
+                case I_BSHL:
+                    out("\x48\xD3\xE0", 3);  // shl rax, cl
+                    break;
+                case I_BSHR:
+                    out("\x48\xD3\xF8", 3);  // sar rax, cl
+                    break;
+            }
+            int_to_xmm0();
+            store_xmm0(in->dst);
+            return;
+        case I_GET:
+            mem_index(c, a[1]);
+            out("\xF2\x41\x0F\x10\x04\xC4", 6);  // movsd xmm0, [r12 + rax * 8]
+            store_xmm0(in->dst);
+            return;
+        case I_SET:
+            mem_index(c, a[1]);
+            out_slot("\x48\x8B\x8D", 3, a[2]);  // mov rcx, [slot]
+            out("\x49\x89\x0C\xC4", 4);        // mov [r12 + rax * 8], rcx
+            return;
+        case I_ADDR:
+            mov_rax_double(func_index(in->sym));
+            store_rax(in->dst);
+            return;
+        case I_ARR:
+            load_xmm0(a[0]);
+            call_abs(jit_arr);
+            out("\x49\x89\xC4", 3);  // mov r12, rax
+            mov_rax_double(0);
+            store_rax(in->dst);
+            return;
+        case I_CALL:
+            load_xmm0(a[0]);
+            mov_rax_imm((uintptr_t)&table[func_index(in->sym)]);
+            out("\xFF\x10", 2);  // call [rax]
+            store_xmm0(in->dst);
+            return;
+        case I_DCALL:
+            trunc_rax(a[0]);
+            out("\x48\x3D", 2);  // cmp rax, nfuncs
+            out4(vec_len(funcs));
+            out("\x0F\x83", 2);  // jae
+            rel32(c, NULL);
+            out("\x48\xB9", 2);  // mov rcx, table
+            out8((uintptr_t)table);
+            load_xmm0(a[1]);
+            out("\xFF\x14\xC1", 3);  // call [rcx + rax * 8]
+            store_xmm0(in->dst);
+            return;
+        case I_GETCHAR:
+            call_abs(jit_getchar);
+            out("\x48\x63\xC0", 3);  // movsxd rax, eax
+            int_to_xmm0();
+            store_xmm0(in->dst);
+            return;
+        case I_PUTCHAR:
+            trunc_rax(a[0]);
+            out("\x89\xC7", 2);  // mov edi, eax
+            call_abs(jit_putchar);
+            return;
+        case I_JUMP:
+            out("\xE9", 1);
+            rel32(c, in->target[0]);
+            return;
+        case I_BEQ:
+            load_xmm0(a[0]);
+            out_slot("\x66\x0F\x2E\x85", 4, a[1]);  // ucomisd xmm0, [slot]
+            out("\x0F\x8A", 2);                      // jp, unordered is not equal
+            rel32(c, in->target[0]);
+            out("\x0F\x85", 2);  // jne
+            rel32(c, in->target[0]);
+            out("\xE9", 1);
+            rel32(c, in->target[1]);
+            return;
+        case I_BLT:
+            load_xmm0(a[1]);
+            out_slot("\x66\x0F\x2E\x85", 4, a[0]);
+            out("\x0F\x87", 2);  // ja, the second operand is above the first
+            rel32(c, in->target[1]);
+            out("\xE9", 1);
+            rel32(c, in->target[0]);
+            return;
+        case I_RET:
+            load_xmm0(a[0]);
+            out("\xC9\xC3", 2);  // leave; ret
+            return;
+        case I_EXIT:
+            jump_abs(exit_stub);
+            return;
+    }
+}
+
+static void *compile(JitFunc *f) {
+    while (codelen % 16)
+        out("\xCC", 1);
+    void *entry = code + codelen;
+    Compile c = {make_map(), make_vector()};
+    out("\x55\x48\x89\xE5\x48\x81\xEC", 7);  // push rbp; mov rbp, rsp; sub rsp, frame
+    out4((8 * f->nregs + 15) & ~15);
+    store_xmm0(1);
+    for (int i = 0; i < vec_len(f->insns); i++)
+        emit_insn(&c, vec_get(f->insns, i));
+    if (f == vec_head(funcs))
+        jump_abs(exit_stub);
+    else
+        call_abs(jit_fell_off);
+    size_t bounds = codelen;
+    call_abs(jit_bounds);
+    for (int i = 0; i < vec_len(c.fixups); i++) {
+        Fixup *fx = vec_get(c.fixups, i);
+        size_t target = fx->label ? (size_t)map_get(c.labels, fx->label) - 1 : bounds;
+        int32_t rel = target - (fx->pos + 4);
+        memcpy(code + fx->pos, &rel, 4);
+    }
+    return entry;
+}
+
+// Called by the stub in the table slot of a function that has not been
+// translated yet.
+static void *jit_compile(int index) {
+    JitFunc *f = vec_get(funcs, index);
+    if (!f->entry) {
+        unseal();
+        f->entry = compile(f);
+        seal();
+    }
+    table[index] = f->entry;
+    return f->entry;
+}
+
+/*
+ * Entry
+ */
+
+// Emits the code that switches to the VM stack and calls the toplevel
+// code, and the exit path that switches back.
+static void *emit_trampoline(void) {
+    void *r = code + codelen;
+    out("\x53\x55\x41\x54\x41\x55\x41\x56\x41\x57", 10);  // push rbx, rbp, r12-r15
+    out("\x48\x83\xEC\x08", 4);                                 // sub rsp, 8
+    mov_rax_imm((uintptr_t)&saved_rsp);
+    out("\x48\x89\x20", 3);  // mov [rax], rsp
+    out("\x48\x89\xFC", 3);  // mov rsp, rdi
+    out("\xFF\xD6", 2);      // call rsi
+    exit_stub = code + codelen;
+    mov_rax_imm((uintptr_t)&saved_rsp);
+    out("\x48\x8B\x20", 3);      // mov rsp, [rax]
+    out("\x48\x83\xC4\x08", 4);  // add rsp, 8
+    out("\x41\x5F\x41\x5E\x41\x5D\x41\x5C\x5D\x5B\xC3", 11);
+    return r;
+}
+
+static void emit_stubs(void) {
+    lazy_stub = code + codelen;
+    out("\x55\x48\x89\xE5\x48\x83\xEC\x10", 8);  // push rbp; mov rbp, rsp; sub rsp, 16
+    out("\xF2\x0F\x11\x04\x24", 5);                 // movsd [rsp], xmm0
+    call_abs(jit_compile);
+    out("\xF2\x0F\x10\x04\x24", 5);  // movsd xmm0, [rsp]
+    out("\xC9\xFF\xE0", 3);            // leave; jmp rax
+    table[0] = jit_bounds;
+    for (int i = 1; i < vec_len(funcs); i++) {
+        table[i] = code + codelen;
+        out("\xBF", 1);  // mov edi, index
+        out4(i);
+        jump_abs(lazy_stub);
+    }
+}
+
+// Runs the program natively. Returns false without running anything if
+// the program cannot be translated.
+bool jit_run(char *src) {
+    if (!load_program(src) || !supported())
+        return false;
+    code = mmap(NULL, CODE_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    char *stack = mmap(NULL, STACK_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (code == MAP_FAILED || stack == MAP_FAILED)
+        return false;
+    table = calloc(vec_len(funcs), sizeof(void *));
+    void (*run)(void *stack, void *entry) = emit_trampoline();
+    emit_stubs();
+    void *entry = compile(vec_head(funcs));
+    seal();
+    run(stack + STACK_SIZE, entry);
+    fflush(stdout);
+    return true;
+}
+
+#else
+
+bool jit_run(char *src) {
+    return false;
+}
+
+#endif
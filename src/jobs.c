@@ -0,0 +1,91 @@
+/*
+ * Parallel jobs.
+ *
+ * The front end and the code generator keep their state in globals, so
+ * independent compilations run in child processes instead of threads:
+ * each one starts from a copy of the compiler as it was when the jobs
+ * began, and whatever it changes goes away with it. A job returns a
+ * string, which the child writes to a temporary file for the parent to
+ * collect. The results are returned in the order of the jobs, whatever
+ * order they finish in.
+ */
+
+#include <sys/sysinfo.h>
+#include <sys/wait.h>
+
+#include "8cc.h"
+
+int fork(void);
+void _exit(int status);
+
+int jobs = 0;
+static bool in_job;
+
+// The number of jobs to run at once: -fjobs, or one for each core. A job
+// runs the jobs it starts itself one after another.
+int job_count(void) {
+    if (in_job)
+        return 1;
+    return jobs > 0 ? jobs : get_nprocs();
+}
+
+static char *read_result(FILE *file) {
+    Buffer *b = make_buffer();
+    char chunk[4096];
+    size_t size;
+    rewind(file);
+    while ((size = fread(chunk, 1, sizeof(chunk), file)) > 0)
+        buf_append(b, chunk, size);
+    fclose(file);
+    buf_write(b, '\0');
+    return buf_body(b);
+}
+
+// Calls `fn` on each of `args`, in parallel if there is more than one, and
+// returns the results. If any of the calls fails, its error has been
+// printed and the compiler exits.
+Vector *run_jobs(Vector *args, char *(*fn)(void *arg)) {
+    int n = vec_len(args);
+    int max = job_count();
+    Vector *r = make_vector();
+    if (n <= 1 || max <= 1) {
+        for (int i = 0; i < n; i++)
+            vec_push(r, fn(vec_get(args, i)));
+        return r;
+    }
+    FILE **out = calloc(n, sizeof(FILE *));
+    int next = 0, running = 0;
+    bool failed = false;
+    while (running > 0 || (!failed && next < n)) {
+        while (!failed && next < n && running < max) {
+            out[next] = tmpfile();
+            if (!out[next])
+                error("cannot create a temporary file: %s", strerror(errno));
+            fflush(stdout);
+            fflush(stderr);
+            int pid = fork();
+            if (pid < 0)
+                error("cannot start a job: %s", strerror(errno));
+            if (pid == 0) {
+                in_job = true;
+                partial_output = NULL;
+                char *s = fn(vec_get(args, next));
+                fputs(s, out[next]);
+                _exit(fflush(out[next]) || ferror(out[next]));
+            }
+            next++;
+            running++;
+        }
+        int status;
+        if (wait(&status) < 0)
+            error("cannot wait for a job: %s", strerror(errno));
+        running--;
+        if (!WIFEXITED(status) || WEXITSTATUS(status))
+            failed = true;
+    }
+    if (failed)
+        exit(1);
+    for (int i = 0; i < n; i++)
+        vec_push(r, read_result(out[i]));
+    return r;
+}
@@ -57,6 +57,19 @@ void lex_init(char *filename) {
     stream_push(make_file(fp, filename));
 }
 
+// Copies the tokens read ahead out of the arena in use, which is about to
+// be freed.
+void lex_keep_tokens(void) {
+    for (int i = 0; i < vec_len(buffers); i++) {
+        Vector *buf = vec_get(buffers, i);
+        for (int j = 0; j < vec_len(buf); j++) {
+            Token *tok = malloc(sizeof(Token));
+            *tok = *(Token *)vec_get(buf, j);
+            vec_set(buf, j, tok);
+        }
+    }
+}
+
 static Pos get_pos(int delta) {
     File *f = current_file();
     return (Pos){f->line, f->column + delta};
@@ -67,7 +80,7 @@ static void mark() {
 }
 
 static Token *make_token(Token *tmpl) {
-    Token *r = malloc(sizeof(Token));
+    Token *r = arena_malloc(MEM_TOKEN, sizeof(Token));
     *r = *tmpl;
     r->hideset = NULL;
     File *f = current_file();
@@ -79,7 +92,7 @@ static Token *make_token(Token *tmpl) {
 }
 
 static Token *make_ident(char *p) {
-    return make_token(&(Token){TIDENT, .sval = p});
+    return make_token(&(Token){TIDENT, .sval = intern(p)});
 }
 
 static Token *make_strtok(char *s, int len, int enc) {
@@ -230,8 +243,10 @@ static Token *read_number(char c) {
         bool flonum = strchr("eEpP", last) && strchr("+-", c);
         if (!isdigit(c) && !isalpha(c) && c != '.' && !flonum) {
             unreadc(c);
-            buf_write(b, '\0');
-            return make_number(buf_body(b));
+            // Most programs use a few numbers over and over.
+            char *s = intern_len(buf_body(b), buf_len(b));
+            buf_free(b);
+            return make_number(s);
         }
         buf_write(b, c);
         last = c;
@@ -414,7 +429,9 @@ static Token *read_ident(char c) {
         }
         unreadc(c);
         buf_write(b, '\0');
-        return make_ident(buf_body(b));
+        Token *r = make_ident(buf_body(b));
+        buf_free(b);
+        return r;
     }
 }
 
@@ -0,0 +1,208 @@
+/*
+ * Objects and linking.
+ *
+ * -c compiles each translation unit on its own into an object: the layout
+ * of its globals in the format of save_layout in gen.c, then its
+ * functions:
+ *
+ *   minivm-object 1
+ *   <layout>
+ *   code
+ *   <functions>
+ *
+ * Addresses in an object are not final. Its own globals are laid out from
+ * OBJ_DATA, and each global that it uses without defining it gets a window
+ * of OBJ_EXTERN_SIZE words from OBJ_EXTERN on, given by an "extern" line.
+ * Addresses only reach the code as "int" immediates, and the optimizer only
+ * adds offsets to them, so the linker finds every one by its range: the
+ * globals of each object are moved after those of the objects before it,
+ * and each window is replaced by the address of the global it stands for.
+ * Functions are already referred to by name, and func.X is resolved by the
+ * VM assembler once the code of all objects is put together.
+ */
+
+#include "8cc.h"
+
+#define OBJECT_MARK "minivm-object 1"
+
+struct Object {
+    char *name;
+    int size;         // words taken by its globals
+    int base;         // where they are in the linked program
+    Map *defs;        // global -> address in the object
+    Vector *exports;  // globals that other objects see
+    Vector *externs;  // global of each window
+    Vector *layout;   // zero, word and init lines
+    Vector *funcs;    // names of its functions
+    char *code;
+};
+
+static Map *symbols;  // exported global -> Object
+static Map *funcs;    // function -> Object
+
+char *write_object(Buffer *code) {
+    Buffer *b = make_buffer();
+    buf_printf(b, OBJECT_MARK "\n");
+    save_layout(b);
+    buf_printf(b, "code\n%.*s", buf_len(code), buf_body(code));
+    return buf_body(b);
+}
+
+// Writes an object like write_object, for code that went to the file
+// `code` as it was generated, followed by `rest`.
+void write_object_file(FILE *out, FILE *code, Buffer *rest) {
+    Buffer *b = make_buffer();
+    buf_printf(b, OBJECT_MARK "\n");
+    save_layout(b);
+    buf_printf(b, "code\n");
+    fwrite(buf_body(b), 1, buf_len(b), out);
+    buf_free(b);
+    rewind(code);
+    char chunk[4096];
+    size_t size;
+    while ((size = fread(chunk, 1, sizeof(chunk), code)) > 0)
+        fwrite(chunk, 1, size, out);
+    fwrite(buf_body(rest), 1, buf_len(rest), out);
+}
+
+Object *read_object(char *name, char *text) {
+    char *nl = strchr(text, '\n');
+    if (!nl || strncmp(text, OBJECT_MARK "\n", nl - text + 1))
+        error("%s: not an object file", name);
+    Object *obj = calloc(1, sizeof(Object));
+    obj->name = name;
+    obj->defs = make_map();
+    obj->exports = make_vector();
+    obj->externs = make_vector();
+    obj->layout = make_vector();
+    obj->funcs = make_vector();
+    char *p;
+    for (p = nl + 1; (nl = strchr(p, '\n')); p = nl + 1) {
+        *nl = '\0';
+        char sym[256];
+        int a;
+        long w;
+        if (!strcmp(p, "code")) {
+            obj->code = nl + 1;
+            break;
+        }
+        if (sscanf(p, "memory %d", &a) == 1) {
+            obj->size = a - OBJ_DATA;
+        } else if (sscanf(p, "global %255s %d", sym, &a) == 2) {
+            map_put(obj->defs, strdup(sym), (void *)(intptr_t)a);
+            vec_push(obj->exports, strdup(sym));
+        } else if (sscanf(p, "local %255s %d", sym, &a) == 2) {
+            map_put(obj->defs, strdup(sym), (void *)(intptr_t)a);
+        } else if (sscanf(p, "extern %255s %ld", sym, &w) == 2) {
+            if (w != OBJ_EXTERN + (long)vec_len(obj->externs) * OBJ_EXTERN_SIZE)
+                error("%s: bad extern %s", name, sym);
+            vec_push(obj->externs, strdup(sym));
+        } else {
+            vec_push(obj->layout, p);
+        }
+    }
+    if (!obj->code || obj->size < 0)
+        error("%s: truncated object file", name);
+    for (p = obj->code; (p = strstr(p, "func func.")); p += 10)
+        if (p == obj->code || p[-1] == '\n')
+            vec_push(obj->funcs, format("%.*s", (int)strcspn(p + 10, " \n"), p + 10));
+    return obj;
+}
+
+bool defines_function(Vector *objs, char *fname) {
+    for (int i = 0; i < vec_len(objs); i++) {
+        Object *obj = vec_get(objs, i);
+        for (int j = 0; j < vec_len(obj->funcs); j++)
+            if (!strcmp(vec_get(obj->funcs, j), fname))
+                return true;
+    }
+    return false;
+}
+
+static void define(Map *m, Object *obj, char *name, char *what) {
+    Object *other = map_get(m, name);
+    if (other && other != obj)
+        error("multiple definition of %s %s in %s and %s", what, name, other->name, obj->name);
+    map_put(m, name, obj);
+}
+
+// A global an object uses is its own, another object's or the runtime's.
+static long resolve(Object *obj, char *name) {
+    void *own = map_get(obj->defs, name);
+    if (own)
+        return obj->base + (intptr_t)own - OBJ_DATA;
+    Object *other = map_get(symbols, name);
+    if (other)
+        return other->base + (intptr_t)map_get(other->defs, name) - OBJ_DATA;
+    int addr = find_global(name);
+    if (!addr)
+        error("%s: undefined variable %s", obj->name, name);
+    return addr;
+}
+
+static long relocate(Object *obj, long v) {
+    if (v >= OBJ_DATA && v < OBJ_EXTERN)
+        return obj->base + v - OBJ_DATA;
+    long i = (v - OBJ_EXTERN) / OBJ_EXTERN_SIZE;
+    if (v >= OBJ_EXTERN && i < vec_len(obj->externs))
+        return resolve(obj, vec_get(obj->externs, i)) + (v - OBJ_EXTERN) % OBJ_EXTERN_SIZE;
+    return v;
+}
+
+static char *relocate_insn(Object *obj, char *line) {
+    char *p = strstr(line, "<- int ");
+    if (!p)
+        return line;
+    p += 7;
+    char *end;
+    long v = strtol(p, &end, 10);
+    long r = relocate(obj, v);
+    if (r == v)
+        return line;
+    return format("%.*s%ld%s", (int)(p - line), line, r, end);
+}
+
+static void load_object(Object *obj) {
+    for (int i = 0; i < vec_len(obj->exports); i++) {
+        char *name = vec_get(obj->exports, i);
+        load_layout(format("global %s %ld", name, resolve(obj, name)));
+    }
+    for (int i = 0; i < vec_len(obj->layout); i++) {
+        char *line = vec_get(obj->layout, i);
+        int a, b;
+        if (sscanf(line, "zero %d", &a) == 1)
+            line = format("zero %ld", relocate(obj, a));
+        else if (sscanf(line, "word %d %d", &a, &b) == 2)
+            line = format("word %ld %d", relocate(obj, a), b);
+        else if (!strncmp(line, "init ", 5))
+            line = format("init %s", relocate_insn(obj, line + 5));
+        if (!load_layout(line))
+            error("%s: bad layout line: %s", obj->name, line);
+    }
+}
+
+// Lays out the globals of the objects after those in gen.c so far, and
+// returns their code with every address resolved.
+Buffer *link_objects(Vector *objs) {
+    symbols = make_map();
+    funcs = make_map();
+    for (int i = 0; i < vec_len(objs); i++) {
+        Object *obj = vec_get(objs, i);
+        obj->base = reserve_memory(obj->size);
+        for (int j = 0; j < vec_len(obj->exports); j++)
+            define(symbols, obj, vec_get(obj->exports, j), "variable");
+        for (int j = 0; j < vec_len(obj->funcs); j++)
+            define(funcs, obj, vec_get(obj->funcs, j), "function");
+    }
+    Buffer *out = make_buffer();
+    for (int i = 0; i < vec_len(objs); i++) {
+        Object *obj = vec_get(objs, i);
+        load_object(obj);
+        for (char *p = obj->code; *p;) {
+            size_t len = strcspn(p, "\n");
+            buf_printf(out, "%s\n", relocate_insn(obj, format("%.*s", (int)len, p)));
+            p += len + (p[len] == '\n');
+        }
+    }
+    return out;
+}
@@ -0,0 +1,347 @@
+/*
+ * Loop optimizations.
+ *
+ * The parser records the counted for loops of a function and hands them
+ * here once it has read the whole body, because only then is it known
+ * whether the address of an induction variable or of a bound is ever
+ * taken. The loops are still in the shape read_for_stmt gave them: a
+ * compound statement of the init, a jump to the test, the body, the step
+ * and the test at the bottom. Each loop is first matched against the
+ * idioms, then unrolled if it is not one.
+ */
+
+#include "8cc.h"
+
+typedef struct {
+    int size;
+    bool unsupported;
+    Map *modified;   // names of assigned variables
+    Map *addrtaken;  // names of variables whose address is taken
+} LoopScan;
+
+static Node *strip_conv(Node *node) {
+    while (node->kind == AST_CONV && is_inttype(node->ty) && is_inttype(node->operand->ty))
+        node = node->operand;
+    return node;
+}
+
+// Whether a node can be duplicated. Copies of labels and jumps would
+// clash, and a compound literal has its initializer in its variable.
+static bool clonable(Node *node) {
+    switch (node->kind) {
+        case AST_LVAR:
+            return !node->lvarinit;
+        case AST_TYPEDEF:
+        case AST_FUNC:
+        case AST_GOTO:
+        case AST_COMPUTED_GOTO:
+        case AST_LABEL:
+        case OP_LABEL_ADDR:
+            return false;
+    }
+    return true;
+}
+
+static void scan_loop(Node *node, LoopScan *s) {
+    if (!node)
+        return;
+    s->size++;
+    Node *var = NULL;
+    if (node->kind == '=')
+        var = lvalue_var(node->left);
+    else if (node->kind == OP_PRE_INC || node->kind == OP_PRE_DEC || node->kind == OP_POST_INC || node->kind == OP_POST_DEC)
+        var = lvalue_var(node->operand);
+    else if (node->kind == AST_DECL)
+        var = node->declvar;
+    if (var)
+        map_put(s->modified, var->varname, var);
+    if (node->kind == AST_ADDR && (var = lvalue_var(node->operand)))
+        map_put(s->addrtaken, var->varname, var);
+    if (!clonable(node))
+        s->unsupported = true;
+    Node *kid;
+    for (int i = 0; (kid = next_child(node, &i));)
+        scan_loop(kid, s);
+}
+
+static LoopScan *make_loop_scan(void) {
+    LoopScan *r = arena_calloc(MEM_NODE, 1, sizeof(LoopScan));
+    r->modified = make_symbol_map();
+    r->addrtaken = make_symbol_map();
+    return r;
+}
+
+/*
+ * Loop unrolling
+ *
+ * Loops with a small constant trip count are unrolled completely; other
+ * loops run UNROLL_FACTOR copies of the body per test and finish the
+ * remaining iterations in the original loop. Bodies with labels or jumps
+ * are left alone.
+ */
+
+#define UNROLL_FACTOR 4
+#define UNROLL_BUDGET 256    // AST nodes the copies of a body may add up to
+#define UNROLL_MAX_TRIP 16   // longest loop to unroll completely
+#define UNROLL_FORCE_TRIP 256
+
+// Copies a statement, replacing `var` with the constant `val` if given.
+static Node *clone_node(Node *node, Node *var, long val) {
+    if (!node)
+        return NULL;
+    if (var && node == var)
+        return ast_inttype(var->ty, val);
+    if (node->kind == AST_LITERAL || node->kind == AST_LVAR || node->kind == AST_GVAR || node->kind == AST_FUNCDESG)
+        return node;
+    Node *r = make_ast(node);
+    r->sourceLoc = node->sourceLoc;
+    if (r->kind == AST_FUNCALL || r->kind == AST_FUNCPTR_CALL)
+        r->args = vec_copy(r->args);
+    if (r->kind == AST_DECL && r->declinit)
+        r->declinit = vec_copy(r->declinit);
+    if (r->kind == AST_COMPOUND_STMT)
+        r->stmts = vec_copy(r->stmts);
+    for (int i = 0; i < ast_nslots(r); i++) {
+        Node **slot = ast_slot(r, i);
+        *slot = clone_node(*slot, var, val);
+    }
+    return r;
+}
+
+// Returns the variable incremented by one in a for loop step.
+static Node *induction_var(Node *step) {
+    Node *var = NULL;
+    if (step->kind == OP_POST_INC || step->kind == OP_PRE_INC) {
+        var = step->operand;
+    } else if (step->kind == '=') {
+        Node *right = strip_conv(step->right);
+        if (right->kind != '+')
+            return NULL;
+        Node *x = strip_conv(right->left);
+        Node *y = strip_conv(right->right);
+        if (y->kind != AST_LVAR) {
+            Node *t = x;
+            x = y;
+            y = t;
+        }
+        if (step->left != y || x->kind != AST_LITERAL || x->ival != 1)
+            return NULL;
+        var = y;
+    }
+    if (!var || var->kind != AST_LVAR || !is_inttype(var->ty))
+        return NULL;
+    return var;
+}
+
+// Returns true if `init` ends by setting `var` to a constant.
+static bool initial_value(Node *init, Node *var, long *val) {
+    if (!init || vec_len(init->stmts) == 0)
+        return false;
+    Node *last = vec_tail(init->stmts);
+    Node *value = NULL;
+    if (last->kind == AST_DECL && last->declvar == var && last->declinit && vec_len(last->declinit) == 1) {
+        Node *in = vec_head(last->declinit);
+        if (in->initoff == 0)
+            value = in->initval;
+    } else if (last->kind == '=' && last->left == var) {
+        value = last->right;
+    }
+    if (!value || strip_conv(value)->kind != AST_LITERAL || !is_inttype(strip_conv(value)->ty))
+        return false;
+    *val = strip_conv(value)->ival;
+    return true;
+}
+
+static bool invariant(Node *node, LoopScan *body, LoopScan *func) {
+    node = strip_conv(node);
+    if (node->kind == AST_LITERAL)
+        return is_inttype(node->ty);
+    if (node->kind != AST_LVAR || !is_inttype(node->ty))
+        return false;
+    return !map_get(body->modified, node->varname) && !map_get(func->addrtaken, node->varname);
+}
+
+static void unroll_loop(Loop *l, LoopScan *func) {
+    Node *var = induction_var(l->step);
+    Node *cond = l->cond;
+    if (!var || (cond->kind != '<' && cond->kind != OP_LE) || strip_conv(cond->left) != var)
+        return;
+    LoopScan *body = make_loop_scan();
+    scan_loop(l->body, body);
+    if (body->unsupported || map_get(body->modified, var->varname) || map_get(func->addrtaken, var->varname))
+        return;
+    if (!invariant(cond->right, body, func))
+        return;
+    int size = body->size + 2;
+    bool force = l->unroll == UNROLL_FORCE;
+
+    Vector *v = make_vector();
+    if (l->init)
+        vec_push(v, l->init);
+    long start;
+    Node *bound = strip_conv(cond->right);
+    if (bound->kind == AST_LITERAL && initial_value(l->init, var, &start)) {
+        long trip = bound->ival - start + (cond->kind == OP_LE);
+        if (trip < 0)
+            trip = 0;
+        if (force ? trip <= UNROLL_FORCE_TRIP : trip <= UNROLL_MAX_TRIP && trip * size <= UNROLL_BUDGET) {
+            for (long i = 0; i < trip; i++)
+                vec_push(v, clone_node(l->body, var, start + i));
+            vec_push(v, ast_binop(var->ty, '=', var, ast_inttype(var->ty, start + trip)));
+            l->loop->stmts = v;
+            return;
+        }
+    }
+    if (!force && size * UNROLL_FACTOR > UNROLL_BUDGET)
+        return;
+    char *beg = make_label();
+    char *test = make_label();
+    vec_push(v, ast_jump(test));
+    vec_push(v, ast_dest(beg));
+    for (int i = 0; i < UNROLL_FACTOR; i++) {
+        vec_push(v, clone_node(l->body, NULL, 0));
+        vec_push(v, clone_node(l->step, NULL, 0));
+    }
+    vec_push(v, ast_dest(test));
+    Node *last = ast_binop(var->ty, '+', var, ast_inttype(var->ty, UNROLL_FACTOR - 1));
+    vec_push(v, ast_if(ast_binop(type_int, cond->kind, last, cond->right), ast_jump(beg), NULL));
+    Vector *stmts = l->loop->stmts;
+    for (int i = l->init ? 1 : 0; i < vec_len(stmts); i++)
+        vec_push(v, vec_get(stmts, i));
+    l->loop->stmts = v;
+}
+
+/*
+ * Loop idioms
+ *
+ * Counted loops that do nothing but fill, copy or compare words are
+ * replaced with builtins that gen.c expands into minimal loops. The
+ * builtins visit the elements in the same order as the loop did, so
+ * overlapping arrays behave the same. Loops whose pointers, stored value or
+ * bound could be changed by the loop's own stores are left alone.
+ */
+
+static Node *single_stmt(Node *node) {
+    while (node && node->kind == AST_COMPOUND_STMT && vec_len(node->stmts) == 1)
+        node = vec_head(node->stmts);
+    return node;
+}
+
+// Returns P if `node` is the word *(P + var) and P does not change in the
+// loop.
+static Node *indexed_base(Node *node, Node *var, LoopScan *body, LoopScan *func) {
+    node = strip_conv(node);
+    if (node->kind != AST_DEREF || node->ty->size != 1 || node->ty->kind == KIND_STRUCT || node->ty->kind == KIND_ARRAY)
+        return NULL;
+    Node *sum = node->operand;
+    if (sum->kind != '+' || sum->left->ty->kind != KIND_PTR || strip_conv(sum->right) != var)
+        return NULL;
+    Node *base = sum->left;
+    if (base->kind == AST_CONV && base->operand->ty->kind == KIND_ARRAY && (base->operand->kind == AST_LVAR || base->operand->kind == AST_GVAR))
+        return base;
+    if (base->kind == AST_LVAR && !map_get(body->modified, base->varname) && !map_get(func->addrtaken, base->varname))
+        return base;
+    return NULL;
+}
+
+static Node *builtin_call(char *name, Node *a, Node *b, Node *c) {
+    Vector *args = make_vector();
+    vec_push(args, a);
+    vec_push(args, b);
+    vec_push(args, c);
+    return ast_funcall(builtin_type(name), name, args);
+}
+
+static bool replace_idiom(Loop *l, LoopScan *func) {
+    Node *var = induction_var(l->step);
+    Node *cond = l->cond;
+    if (!var || (cond->kind != '<' && cond->kind != OP_LE) || strip_conv(cond->left) != var)
+        return false;
+    LoopScan *body = make_loop_scan();
+    scan_loop(l->body, body);
+    if (map_get(body->modified, var->varname) || map_get(func->addrtaken, var->varname))
+        return false;
+    if (!invariant(cond->right, body, func) || strip_conv(cond->right) == var)
+        return false;
+
+    Node *stmt = single_stmt(l->body);
+    Node *count = ast_binop(var->ty, '-', cond->right, var);
+    if (cond->kind == OP_LE)
+        count = ast_binop(var->ty, '+', count, ast_inttype(var->ty, 1));
+    Node *call = NULL;
+    if (stmt->kind == '=' && !body->unsupported) {
+        Node *dst = indexed_base(stmt->left, var, body, func);
+        Node *src = indexed_base(stmt->right, var, body, func);
+        Node *val = strip_conv(stmt->right);
+        if (dst && src) {
+            call = builtin_call("__builtin_copy_words", ast_binop(dst->ty, '+', dst, var), ast_binop(src->ty, '+', src, var), count);
+        } else if (dst && val != var && invariant(val, body, func)) {
+            call = builtin_call("__builtin_fill_words", ast_binop(dst->ty, '+', dst, var), stmt->right, count);
+        }
+        if (!call)
+            return false;
+        Node *last = cond->kind == OP_LE ? ast_binop(var->ty, '+', cond->right, ast_inttype(var->ty, 1)) : cond->right;
+        Vector *v = make_vector();
+        if (l->init)
+            vec_push(v, l->init);
+        vec_push(v, call);
+        vec_push(v, ast_if(cond, ast_binop(var->ty, '=', var, last), NULL));
+        l->loop->stmts = v;
+        return true;
+    }
+    if (stmt->kind == AST_IF && !stmt->els && strip_conv(stmt->cond)->kind == OP_NE) {
+        Node *then = single_stmt(stmt->then);
+        Node *ne = strip_conv(stmt->cond);
+        if (!then || then->kind != AST_GOTO || strcmp(then->label, l->end))
+            return false;
+        Node *a = indexed_base(ne->left, var, body, func);
+        Node *b = indexed_base(ne->right, var, body, func);
+        if (!a || !b)
+            return false;
+        call = builtin_call("__builtin_mismatch_words", ast_binop(a->ty, '+', a, var), ast_binop(b->ty, '+', b, var), count);
+        Vector *v = make_vector();
+        if (l->init)
+            vec_push(v, l->init);
+        vec_push(v, ast_binop(var->ty, '=', var, ast_binop(var->ty, '+', var, call)));
+        l->loop->stmts = v;
+        return true;
+    }
+    return false;
+}
+
+/*
+ * Driver
+ */
+
+static long loop_size(Loop *l) {
+    return pass_stats ? tree_size(l->loop) : 0;
+}
+
+static void end_loop_pass(Loop *l, int pass) {
+    pass_stop(pass);
+    if (pass_finish(pass, loop_size(l)))
+        fprintf(stderr, "; after %s:\n%s\n", pass_name(pass), node2s(l->loop));
+}
+
+// Runs the loop passes over `loops`, the counted loops of `func`.
+void optimize_loops(Node *func, Vector *loops) {
+    if (vec_len(loops) == 0)
+        return;
+    LoopScan *scan = make_loop_scan();
+    scan_loop(func, scan);
+    for (int i = 0; i < vec_len(loops); i++) {
+        Loop *l = vec_get(loops, i);
+        if (pass_enabled(PASS_IDIOMS)) {
+            pass_start(PASS_IDIOMS, loop_size(l));
+            bool replaced = replace_idiom(l, scan);
+            end_loop_pass(l, PASS_IDIOMS);
+            if (replaced)
+                continue;
+        }
+        if (l->unroll != UNROLL_NEVER && pass_enabled(PASS_UNROLL)) {
+            pass_start(PASS_UNROLL, loop_size(l));
+            unroll_loop(l, scan);
+            end_loop_pass(l, PASS_UNROLL);
+        }
+    }
+}
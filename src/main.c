@@ -4,31 +4,69 @@
 #include "../vm/vm/ir/be/int3.h"
 #include "../vm/vm/ir/toir.h"
 #include "8cc.h"
+#include <sys/stat.h>
 
 void vm_ir_be_js(FILE *of, size_t nargs, vm_ir_block_t *blocks);
+int dup(int fd);
+int dup2(int fd, int fd2);
+int close(int fd);
 
 enum {
     OUTPUT_BC,
     OUTPUT_JIT,
     OUTPUT_ASM,
     OUTPUT_JS,
+    OUTPUT_C,
+    OUTPUT_OBJ,
 };
 
 static Vector *infiles = &EMPTY_VECTOR;
 static char *outfile;
 static int outtype = OUTPUT_JIT;
+static bool native = false;
 static char *rtsrc = "rt";
 static Buffer *cppdefs;
+static bool diagnose = false;  // prints something while compiling
 
 static void usage(int exitcode) {
-    fprintf(exitcode ? stderr : stdout,
+    FILE *out = exitcode ? stderr : stdout;
+    fprintf(out,
             "Usage: minivm-cc <file>\n"
+            "       minivm-cc <file>.bc\n"
+            "       minivm-cc -c <file>...\n"
             "\n"
             "  -v filename       turn jit on or off\n"
+            "  -jon -joff        run native code instead of the interpreter\n"
             "  -n                dont include runtime\n"
+            "  -c                compile each file into an object to link later\n"
+            "  -g                put a source map into .bc output\n"
             "  -r                runtime directory\n"
+            "  -O0 -O1 -O2 -Os   optimization level (default -O2)\n"
+            "  -f<pass>          run a pass regardless of the level\n"
+            "  -fno-<pass>       do not run a pass\n"
+            "  -fdump-after=<pass>  print the code after each run of a pass\n"
+            "  -fpass-stats      print code size and time per pass\n"
+            "  -fopt-report      print optimization counts per function\n"
+            "  -fmem-report      print the bytes allocated in each arena\n"
+            "  -fprofile-generate[=file]  count executions and print a profile\n"
+            "                    when the program ends, into the file if given\n"
+            "  -fprofile-use=file  optimize for a profile\n"
+            "  -fno-strict-aliasing  let accesses of different types alias\n"
+            "  -fno-runtime-cache  compile the runtime with the program instead\n"
+            "                    of using the one kept in $MINIVM_CACHE\n"
+            "  -fcache           reuse the output of compiling the same program\n"
+            "  -fcache-dir=dir   keep outputs in dir instead of $MINIVM_CACHE\n"
+            "  -fcache-size=mb   keep at most mb megabytes of outputs (default 256)\n"
+            "  -fcache-stats     print the hits and misses of the cache\n"
+            "  -fjobs=n          compile up to n files at once (default: one per core)\n"
             "  -h                print this help\n"
-            "\n");
+            "\n"
+            "Passes:\n");
+    print_pass_list(out);
+    fprintf(out, "\n"
+                 "The passes from unreachable to placement read the whole program before\n"
+                 "emitting any of it. Without them, and with -c, each function is freed once\n"
+                 "it is emitted, and memory grows only with the declarations.\n\n");
     exit(exitcode);
 }
 
@@ -51,6 +89,14 @@ static int parseopt(int argc, char **argv) {
                     rtsrc = NULL;
                     break;
                 }
+                case 'g': {
+                    bc_srcmap = true;
+                    break;
+                }
+                case 'c': {
+                    outtype = OUTPUT_OBJ;
+                    break;
+                }
                 case 'r': {
                     rtsrc = argv[i++];
                     break;
@@ -68,12 +114,78 @@ static int parseopt(int argc, char **argv) {
                     arg += 2;
                     if (!strcmp(arg, "on")) {
                         outtype = OUTPUT_JIT;
+                        native = true;
+                    } else if (!strcmp(arg, "off")) {
+                        outtype = OUTPUT_JIT;
+                        native = false;
                     } else {
                         fprintf(stderr, "unknown jit option: -j%s\n", arg);
                         usage(1);
                     }
                     break;
                 }
+                case 'f': {
+                    arg += 2;
+                    if (!strcmp(arg, "opt-report")) {
+                        opt_report = true;
+                        diagnose = true;
+                    } else if (!strcmp(arg, "no-runtime-cache")) {
+                        runtime_cache = false;
+                    } else if (!strcmp(arg, "cache")) {
+                        compile_cache = true;
+                    } else if (!strncmp(arg, "cache-dir=", 10)) {
+                        set_cache_dir(arg + 10);
+                    } else if (!strncmp(arg, "cache-size=", 11)) {
+                        if (!set_cache_size(arg + 11)) {
+                            fprintf(stderr, "bad cache size: %s\n", arg + 11);
+                            usage(1);
+                        }
+                    } else if (!strncmp(arg, "jobs=", 5)) {
+                        jobs = atoi(arg + 5);
+                        if (jobs <= 0) {
+                            fprintf(stderr, "bad number of jobs: %s\n", arg + 5);
+                            usage(1);
+                        }
+                    } else if (!strcmp(arg, "cache-stats")) {
+                        compile_cache = true;
+                        cache_stats = true;
+                    } else if (!strcmp(arg, "no-strict-aliasing")) {
+                        opt_strict_aliasing = false;
+                    } else if (!strcmp(arg, "profile-generate")) {
+                        profile_generate = true;
+                    } else if (!strncmp(arg, "profile-generate=", 17)) {
+                        profile_generate = true;
+                        profile_out = arg + 17;
+                    } else if (!strncmp(arg, "profile-use=", 12)) {
+                        read_profile(arg + 12);
+                    } else if (!strcmp(arg, "mem-report")) {
+                        mem_report = true;
+                        diagnose = true;
+                    } else if (!strcmp(arg, "pass-stats")) {
+                        pass_stats = true;
+                        diagnose = true;
+                    } else if (!strncmp(arg, "dump-after=", 11)) {
+                        diagnose = true;
+                        if (!set_dump_after(arg + 11)) {
+                            fprintf(stderr, "unknown pass: %s\n", arg + 11);
+                            usage(1);
+                        }
+                    } else {
+                        bool on = strncmp(arg, "no-", 3) != 0;
+                        if (!set_pass(on ? arg : arg + 3, on)) {
+                            fprintf(stderr, "unknown option: -f%s\n", arg);
+                            usage(1);
+                        }
+                    }
+                    break;
+                }
+                case 'O': {
+                    if (!set_opt_level(arg + 2)) {
+                        fprintf(stderr, "unknown optimization level: %s\n", arg);
+                        usage(1);
+                    }
+                    break;
+                }
                 case 'o': {
                     outfile = argv[i++];
                     char *ext = filetype(outfile);
@@ -83,6 +195,10 @@ static int parseopt(int argc, char **argv) {
                         outtype = OUTPUT_BC;
                     } else if (!strcmp(ext, ".js") || !strcmp(ext, ".ts")) {
                         outtype = OUTPUT_JS;
+                    } else if (!strcmp(ext, ".c")) {
+                        outtype = OUTPUT_C;
+                    } else if (!strcmp(ext, ".o")) {
+                        outtype = OUTPUT_OBJ;
                     } else {
                         fprintf(stderr, "unknown file extension: %s\n", ext);
                         usage(1);
@@ -104,77 +220,498 @@ static int parseopt(int argc, char **argv) {
     return 0;
 }
 
+// Runs the program natively with -jon, or in the interpreter if it has
+// something jit.c cannot translate.
+static void run(char *src, vm_bc_buf_t buf) {
+    if (!native || !src || !jit_run(src))
+        vm_run_arch_int(buf.nops, buf.ops, NULL);
+}
+
+// Runs the program with its output going to a temporary file, so that the
+// profile at the end of it can be split off.
+static void run_profiled(char *src, vm_bc_buf_t buf) {
+    fflush(stdout);
+    FILE *tmp = tmpfile();
+    if (!tmp)
+        error("cannot create a temporary file: %s", strerror(errno));
+    int saved = dup(1);
+    dup2(fileno(tmp), 1);
+    run(src, buf);
+    fflush(stdout);
+    dup2(saved, 1);
+    close(saved);
+    Buffer *out = make_buffer();
+    rewind(tmp);
+    char chunk[2048];
+    size_t size;
+    while ((size = fread(chunk, 1, sizeof(chunk), tmp)) > 0)
+        for (size_t i = 0; i < size; i++)
+            buf_write(out, chunk[i]);
+    fclose(tmp);
+    write_profile_output(buf_body(out), buf_len(out));
+}
+
+// Runs a file written with -o <file>.bc.
+static int run_bytecode(Bytecode *bc) {
+    vm_bc_buf_t buf = {.ops = bc->code, .nops = bc->codesize / sizeof(vm_opcode_t)};
+    if (profile_out)
+        run_profiled(bc->asmtext, buf);
+    else
+        run(bc->asmtext, buf);
+    return 0;
+}
+
 char *infile;
 char *get_base_file(void) {
     return infile;
 }
 
-int main(int argc, char **argv) {
-    emit_end();
-    parseopt(argc, argv);
+static void open_file(char *path) {
+    lex_init(path);
+    cpp_init();
+    parse_init();
+    if (buf_len(cppdefs) > 0)
+        read_from_string(buf_body(cppdefs));
+}
+
+// Makes the tokens read outside function bodies, which are not needed once
+// their toplevel has been read, go to an arena of their own.
+static Arena *start_tokens(void) {
+    static Arena *arena;
+    if (!arena)
+        arena = make_arena("tokens");
+    use_token_arena(arena);
+    return arena;
+}
+
+// Frees the tokens of the toplevels read so far but those read ahead.
+static void drop_tokens(Arena *arena) {
+    lex_keep_tokens();
+    arena_reset(arena);
+}
+
+static Vector *read_file(char *path) {
+    open_file(path);
+    Arena *tokens = start_tokens();
+    Vector *r = make_vector();
+    for (Vector *v; (v = read_toplevel());) {
+        vec_append(r, v);
+        drop_tokens(tokens);
+    }
+    use_token_arena(NULL);
+    return r;
+}
+
+// Emits each toplevel of a file as soon as it is read, and frees the body
+// of each function once it is emitted, so that memory does not grow with
+// the size of the file.
+static void stream_file(char *path) {
+    static Arena *arena;
+    if (!arena)
+        arena = make_arena("toplevel");
+    open_file(path);
+    Arena *tokens = start_tokens();
+    body_arena = arena;
+    for (Vector *v; (v = read_toplevel());) {
+        for (int i = 0; i < vec_len(v); i++)
+            emit_toplevel(vec_get(v, i));
+        arena_reset(arena);
+        drop_tokens(tokens);
+    }
+    body_arena = NULL;
+    use_token_arena(NULL);
+}
+
+static char *read_contents(char *path) {
+    FILE *file = fopen(path, "r");
+    if (file == NULL)
+        error("no such file: %s", path);
+    Buffer *b = make_buffer();
+    while (!feof(file)) {
+        char buf[2048];
+        int size = fread(buf, sizeof(char), 2048, file);
+        buf_printf(b, "%.*s", size, buf);
+    }
+    fclose(file);
+    return buf_body(b);
+}
+
+// The runtime library but start.c, which must come after the program.
+static Vector *runtime_files(void) {
+    Vector *libs = make_vector();
+    vec_push(libs, format("%s/src/stdio.c", rtsrc));
+    vec_push(libs, format("%s/src/ctype.c", rtsrc));
+    vec_push(libs, format("%s/src/string.c", rtsrc));
+    vec_push(libs, format("%s/src/ta.c", rtsrc));
+    return libs;
+}
+
+// Everything on the command line that the key of the compilation cache
+// does not already cover.
+static char *cache_config(void) {
+    return format("out %d srcmap %d runtime-cache %d profile %d %s defs %s", outtype, bc_srcmap, runtime_cache,
+                  profile_generate, profile_out ? profile_out : "", buf_len(cppdefs) ? buf_body(cppdefs) : "");
+}
+
+// Compiles one translation unit on its own. Nothing but the globals it
+// uses tells it about the others, so the whole-program optimizations of
+// ipo.c are left out. Returns the code that is not handed to `out`.
+static Buffer *compile_unit(char *path, void (*out)(char *s, int len)) {
+    if (profile_generate)
+        error("-fprofile-generate needs the whole program, not objects");
+    infile = path;
+    begin_object();
+    emit_stream(out);
+    stream_file(path);
+    Buffer *r = emit_end();
+    emit_stream(NULL);
+    return r;
+}
+
+static char *compile_object(char *path) {
+    char *r = write_object(compile_unit(path, NULL));
+    cpp_reset();
+    parse_reset();
+    return r;
+}
+
+static FILE *objcode;
+
+static void write_objcode(char *s, int len) {
+    fwrite(s, 1, len, objcode);
+}
+
+// Compiles a source file into the object file `name`. The layout of the
+// globals comes before the code but is only known at the end, so the code
+// is kept in a temporary file until then.
+static void compile_object_file(char *path, char *name) {
+    FILE *out = fopen(name, "wb");
+    if (!out)
+        error("cannot write %s: %s", name, strerror(errno));
+    partial_output = name;
+    objcode = tmpfile();
+    if (!objcode)
+        error("cannot create a temporary file: %s", strerror(errno));
+    Buffer *rest = compile_unit(path, write_objcode);
+    write_object_file(out, objcode, rest);
+    fclose(objcode);
+    fclose(out);
+    partial_output = NULL;
+    cpp_reset();
+    parse_reset();
+}
+
+// foo/bar.c -> bar.o
+static char *object_name(char *path) {
+    char *name = basename(strdup(path));
+    char *ext = strrchr(name, '.');
+    return format("%.*s.o", ext ? (int)(ext - name) : (int)strlen(name), name);
+}
+
+// The key of the object for a source file in the compilation cache. Nothing
+// on the command line but the defines changes objects.
+static char *object_key(char *path) {
+    if (!compile_cache || diagnose)
+        return NULL;
+    return cache_key(make_vector1(path), NULL, format("object defs %s", buf_len(cppdefs) ? buf_body(cppdefs) : ""));
+}
+
+// Returns the object for a source file, from the compilation cache if it
+// is there.
+static char *object_job(void *path) {
+    char *key = object_key(path);
+    size_t len;
+    char *obj = key ? cache_get(key, &len) : NULL;
+    if (obj)
+        return obj;
+    obj = compile_object(path);
+    if (key)
+        cache_put(key, obj, strlen(obj), NULL);
+    return obj;
+}
+
+// Writes the object file for a source file, as object_job.
+static char *object_file_job(void *path) {
+    char *name = outfile ? outfile : object_name(path);
+    char *key = object_key(path);
+    size_t len;
+    char *obj = key ? cache_get(key, &len) : NULL;
+    if (obj) {
+        FILE *out = fopen(name, "wb");
+        if (!out)
+            error("cannot write %s: %s", name, strerror(errno));
+        fwrite(obj, 1, len, out);
+        fclose(out);
+        return "";
+    }
+    compile_object_file(path, name);
+    if (key)
+        cache_put(key, NULL, 0, name);
+    return "";
+}
+
+// Compiles source files into objects, in parallel.
+static Vector *compile_objects(Vector *paths) {
+    Vector *texts = run_jobs(paths, object_job);
+    Vector *r = make_vector();
+    for (int i = 0; i < vec_len(paths); i++)
+        vec_push(r, read_object(vec_get(paths, i), vec_get(texts, i)));
+    return r;
+}
+
+// -c writes an object for each source file.
+static int write_objects(void) {
+    if (outfile && vec_len(infiles) != 1)
+        error("-o with -c needs a single input file");
+    run_jobs(infiles, object_file_job);
+    print_pass_stats();
+    print_mem_report();
+    print_cache_stats();
+    return 0;
+}
+
+// Returns the assembly of the runtime library in `libs`, compiling it only
+// if it is not in the cache, and lays out its globals in gen.c. Returns
+// NULL if the runtime is to be compiled with the program.
+static char *precompiled_runtime(Vector *libs) {
+    char *path = runtime_cache_file(rtsrc, libs);
+    if (!path)
+        return NULL;
+    char *code = read_runtime(path);
+    if (code)
+        return code;
+    Vector *objs = compile_objects(libs);
+    reset_layout();
+    Buffer *linked = link_objects(objs);
+    Buffer *layout = make_buffer();
+    save_layout(layout);
+    return write_runtime(path, layout, linked);
+}
+
+static bool has_objects(void) {
+    for (int i = 0; i < vec_len(infiles); i++)
+        if (!strcmp(filetype(vec_get(infiles, i)), ".o"))
+            return true;
+    return false;
+}
+
+// Links objects, compiling the source files among the inputs into objects
+// first, with the runtime and start.c.
+static Buffer *link_program(void) {
+    Vector *libs = rtsrc ? runtime_files() : make_vector();
+    bool withlibs = rtsrc && !runtime_cache_file(rtsrc, libs);
+    Vector *sources = make_vector();
+    for (int i = 0; i < vec_len(infiles); i++) {
+        char *ext = filetype(vec_get(infiles, i));
+        if (strcmp(ext, ".o") && strcmp(ext, ".vasm"))
+            vec_push(sources, vec_get(infiles, i));
+    }
+    if (withlibs)
+        vec_append(sources, libs);
+    Vector *compiled = compile_objects(sources);
+
+    Vector *objs = make_vector();
+    Vector *asmtexts = make_vector();
+    int n = 0;
+    for (int i = 0; i < vec_len(infiles); i++) {
+        char *path = vec_get(infiles, i);
+        char *ext = filetype(path);
+        if (!strcmp(ext, ".o"))
+            vec_push(objs, read_object(path, read_contents(path)));
+        else if (!strcmp(ext, ".vasm"))
+            vec_push(asmtexts, read_contents(path));
+        else
+            vec_push(objs, vec_get(compiled, n++));
+    }
+    while (n < vec_len(compiled))
+        vec_push(objs, vec_get(compiled, n++));
+    reset_layout();
+    char *rtcode = NULL;
+    Vector *start = make_vector();
+    if (rtsrc != NULL) {
+        if (!withlibs)
+            rtcode = precompiled_runtime(libs);
+        infile = format("%s/src/start.c", rtsrc);
+        start = optimize_program(read_file(infile));
+    }
+    Buffer *code = link_objects(objs);
+    for (int i = 0; i < vec_len(start); i++)
+        emit_toplevel(vec_get(start, i));
+    if (rtsrc == NULL && defines_function(objs, "_start"))
+        emit_start();
+    Buffer *src = emit_end();
+    print_pass_stats();
+    print_mem_report();
+    buf_append(src, buf_body(code), buf_len(code));
+    for (int i = 0; i < vec_len(asmtexts); i++)
+        buf_printf(src, "\n%s\n", vec_get(asmtexts, i));
+    if (rtcode)
+        link_runtime(src, rtcode);
+    return src;
+}
+
+static FILE *asmout;
+static char *asmruntime;
+
+static void write_asm(char *s, int len) {
+    fwrite(s, 1, len, asmout);
+    if (asmruntime)
+        note_runtime_refs(s, asmruntime);
+}
+
+// Compiles the input files and the runtime into assembly. If `out` is not
+// NULL, the assembly of the program is written to it as it is generated,
+// and only the rest is returned.
+static Buffer *compile(FILE *out) {
     Vector *asmbufs = &EMPTY_VECTOR;
+    Vector *toplevels = make_vector();
+    // The passes of ipo.c keep the whole program in memory. Without them,
+    // each function is freed once it is emitted.
+    bool whole = needs_whole_program();
+    // Hand-written assembly may call anything.
+    for (int i = 0; i < vec_len(infiles); i++)
+        if (!strcmp(filetype(vec_get(infiles, i)), ".vasm"))
+            whole = false;
+    char *rtcode = NULL;
     if (rtsrc != NULL) {
-        vec_push(infiles, format("%s/src/stdio.c", rtsrc));
-        vec_push(infiles, format("%s/src/ctype.c", rtsrc));
-        vec_push(infiles, format("%s/src/string.c", rtsrc));
-        vec_push(infiles, format("%s/src/ta.c", rtsrc));
+        Vector *libs = runtime_files();
+        rtcode = precompiled_runtime(libs);
+        if (!rtcode)
+            vec_append(infiles, libs);
         // start.c must be last
         vec_push(infiles, format("%s/src/start.c", rtsrc));
-        add_include_path(format("%s/include", rtsrc));
+    }
+    if (out) {
+        asmout = out;
+        asmruntime = rtcode;
+        emit_stream(write_asm);
     }
     for (int i = 0; i < vec_len(infiles); i++) {
         infile = vec_get(infiles, i);
         char *ext = filetype(infile);
         if (!strcmp(ext, ".vasm")) {
-            Buffer *asmbuf = make_buffer();
-            FILE *file = fopen(infile, "r");
-            if (file == NULL) {
-                error("no such file: %s\n", infile);
-                return 1;
-            }
-            while (!feof(file)) {
-                char buf[2048];
-                int size = fread(buf, sizeof(char), 2048, file);
-                buf_printf(asmbuf, "%.*s", size, buf);
-            }
-            fclose(file);
-            vec_push(asmbufs, asmbuf->body);
+            vec_push(asmbufs, read_contents(infile));
             // } else if (!strcmp(ext, ".c") || !strcmp(ext, ".h") || !strcmp(ext, ".i")) {
         } else if (!strcmp(ext, ".c") || !strcmp(ext, ".h") || !strcmp(ext, ".i") || !strcmp(infile, "/dev/stdin")) {
-            lex_init(infile);
-            cpp_init();
-            parse_init();
-            if (buf_len(cppdefs) > 0)
-                read_from_string(buf_body(cppdefs));
-
-            Vector *toplevels = read_toplevels();
-            for (int i = 0; i < vec_len(toplevels); i++) {
-                Node *v = vec_get(toplevels, i);
-                emit_toplevel(v);
-            }
+            if (whole)
+                vec_append(toplevels, read_file(infile));
+            else
+                stream_file(infile);
         } else {
             error("unknown file: %s", infile);
         }
     }
+    if (whole)
+        toplevels = optimize_program(toplevels);
+    for (int i = 0; i < vec_len(toplevels); i++)
+        emit_toplevel(vec_get(toplevels, i));
     Buffer *src = emit_end();
+    emit_stream(NULL);
+    print_pass_stats();
+    print_mem_report();
     for (int i = 0; i < vec_len(asmbufs); i++) {
         buf_printf(src, "\n%s\n", vec_get(asmbufs, i));
     }
+    if (rtcode)
+        link_runtime(src, rtcode);
+    return src;
+}
+
+// Whether the assembly can be written out as gen.c finishes it rather than
+// kept until the end. Only a regular file can be read back into the
+// compilation cache.
+static bool stream_output(void) {
+    struct stat st;
+    return outtype == OUTPUT_ASM && !has_objects() && (stat(outfile, &st) || S_ISREG(st.st_mode));
+}
+
+// Compiles into the output file, which is removed if compiling fails.
+static void compile_to_file(char *key) {
+    FILE *out = fopen(outfile, "w");
+    if (!out)
+        error("cannot write %s: %s", outfile, strerror(errno));
+    partial_output = outfile;
+    Buffer *rest = compile(out);
+    fwrite(buf_body(rest), 1, buf_len(rest), out);
+    fclose(out);
+    partial_output = NULL;
+    if (key)
+        cache_put(key, NULL, 0, outfile);
+}
+
+int main(int argc, char **argv) {
+    emit_end();
+    parseopt(argc, argv);
+    // Output printed while compiling must not be interleaved.
+    if (diagnose)
+        jobs = 1;
+    if (vec_len(infiles) == 1 && !strcmp(filetype(vec_head(infiles)), ".bc"))
+        return run_bytecode(read_bytecode(vec_head(infiles)));
+    if (rtsrc != NULL)
+        add_include_path(format("%s/include", rtsrc));
+    if (outtype == OUTPUT_OBJ)
+        return write_objects();
+    // Files are kept as they were written, and for running, the assembly.
+    char *key = compile_cache && !diagnose ? cache_key(infiles, rtsrc, cache_config()) : NULL;
+    char *cached = NULL;
+    size_t cachedlen = 0;
+    if (key)
+        cached = cache_get(key, &cachedlen);
+    if (cached && outtype != OUTPUT_JIT) {
+        FILE *out = fopen(outfile, "wb");
+        if (!out)
+            error("cannot write %s: %s", outfile, strerror(errno));
+        fwrite(cached, 1, cachedlen, out);
+        fclose(out);
+        print_cache_stats();
+        return 0;
+    }
+    if (!cached && stream_output()) {
+        compile_to_file(key);
+        print_cache_stats();
+        return 0;
+    }
+    char *src;
+    if (cached) {
+        src = cached;
+    } else {
+        Buffer *b = has_objects() ? link_program() : compile(NULL);
+        src = buf_body(b);
+        if (key && outtype == OUTPUT_JIT)
+            cache_put(key, src, buf_len(b), NULL);
+    }
     if (outtype == OUTPUT_ASM) {
         FILE *out = fopen(outfile, "w");
-        fwrite(src->body, sizeof(char), src->len, out);
+        fwrite(src, sizeof(char), strlen(src), out);
         fclose(out);
+        if (key)
+            cache_put(key, src, strlen(src), NULL);
+        print_cache_stats();
         return 0;
     }
-    // printf("%s\n", src->body);
-    vm_bc_buf_t buf = vm_asm(src->body);
+    if (outtype == OUTPUT_C) {
+        FILE *out = fopen(outfile, "w");
+        if (!out)
+            error("cannot write %s: %s", outfile, strerror(errno));
+        partial_output = outfile;
+        emit_c(out, src);
+        fclose(out);
+        partial_output = NULL;
+        if (key)
+            cache_put(key, NULL, 0, outfile);
+        print_cache_stats();
+        return 0;
+    }
+    // printf("%s\n", src);
+    vm_bc_buf_t buf = vm_asm(src);
     if (buf.nops == 0) {
         return 1;
     }
     if (outtype == OUTPUT_BC) {
-        FILE *out = fopen(outfile, "wb");
-        fwrite(buf.ops, sizeof(vm_opcode_t), buf.nops, out);
-        fclose(out);
+        write_bytecode(outfile, buf.ops, buf.nops * sizeof(vm_opcode_t), src);
+        if (key)
+            cache_put(key, NULL, 0, outfile);
+        print_cache_stats();
         return 0;
     }
     vm_ir_block_t *blocks = vm_ir_parse(buf.nops, buf.ops);
@@ -182,8 +719,15 @@ int main(int argc, char **argv) {
         FILE *out = fopen(outfile, "wb");
         vm_ir_be_js(out, buf.nops, blocks);
         fclose(out);
+        if (key)
+            cache_put(key, NULL, 0, outfile);
+        print_cache_stats();
+    } else if (profile_out) {
+        print_cache_stats();
+        run_profiled(src, buf);
     } else {
-        vm_run_arch_int(buf.nops, buf.ops, NULL);
+        print_cache_stats();
+        run(src, buf);
     }
     return 0;
 }
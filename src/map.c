@@ -17,34 +17,53 @@ static uint32_t hash(char *p) {
     return r;
 }
 
-static Map *do_make_map(Map *parent, int size) {
-    Map *r = malloc(sizeof(Map));
+static void *alloc0(Arena *a, size_t size) {
+    void *r = container_alloc(a, size);
+    memset(r, 0, size);
+    return r;
+}
+
+// A symbol map is keyed by interned strings, which are equal only if they
+// are the same pointer.
+static uint32_t key_hash(Map *m, char *key) {
+    return m->symbols ? intern_hash(key) : hash(key);
+}
+
+static bool same_key(Map *m, char *k, char *key) {
+    return k == key || (!m->symbols && !strcmp(k, key));
+}
+
+static Map *do_make_map(Map *parent, int size, bool symbols) {
+    Arena *a = current_arena();
+    Map *r = container_alloc(a, sizeof(Map));
     r->parent = parent;
-    r->key = calloc(size, sizeof(char *));
-    r->val = calloc(size, sizeof(void *));
+    r->key = alloc0(a, size * sizeof(char *));
+    r->val = alloc0(a, size * sizeof(void *));
     r->size = size;
     r->nelem = 0;
     r->nused = 0;
+    r->arena = a;
+    r->symbols = symbols;
     return r;
 }
 
 static void maybe_rehash(Map *m) {
     if (!m->key) {
-        m->key = calloc(INIT_SIZE, sizeof(char *));
-        m->val = calloc(INIT_SIZE, sizeof(void *));
+        m->key = alloc0(m->arena, INIT_SIZE * sizeof(char *));
+        m->val = alloc0(m->arena, INIT_SIZE * sizeof(void *));
         m->size = INIT_SIZE;
         return;
     }
     if (m->nused < m->size * 0.7)
         return;
     int newsize = (m->nelem < m->size * 0.35) ? m->size : m->size * 2;
-    char **k = calloc(newsize, sizeof(char *));
-    void **v = calloc(newsize, sizeof(void *));
+    char **k = alloc0(m->arena, newsize * sizeof(char *));
+    void **v = alloc0(m->arena, newsize * sizeof(void *));
     int mask = newsize - 1;
     for (int i = 0; i < m->size; i++) {
         if (m->key[i] == NULL || m->key[i] == TOMBSTONE)
             continue;
-        int j = hash(m->key[i]) & mask;
+        int j = key_hash(m, m->key[i]) & mask;
         for (;; j = (j + 1) & mask) {
             if (k[j] != NULL)
                 continue;
@@ -53,6 +72,8 @@ static void maybe_rehash(Map *m) {
             break;
         }
     }
+    container_free(m->arena, m->key, m->size * sizeof(char *));
+    container_free(m->arena, m->val, m->size * sizeof(void *));
     m->key = k;
     m->val = v;
     m->size = newsize;
@@ -60,20 +81,28 @@ static void maybe_rehash(Map *m) {
 }
 
 Map *make_map() {
-    return do_make_map(NULL, INIT_SIZE);
+    return do_make_map(NULL, INIT_SIZE, false);
 }
 
 Map *make_map_parent(Map *parent) {
-    return do_make_map(parent, INIT_SIZE);
+    return do_make_map(parent, INIT_SIZE, false);
+}
+
+Map *make_symbol_map() {
+    return do_make_map(NULL, INIT_SIZE, true);
+}
+
+Map *make_symbol_map_parent(Map *parent) {
+    return do_make_map(parent, INIT_SIZE, true);
 }
 
 static void *map_get_nostack(Map *m, char *key) {
     if (!m->key)
         return NULL;
     int mask = m->size - 1;
-    int i = hash(key) & mask;
+    int i = key_hash(m, key) & mask;
     for (; m->key[i] != NULL; i = (i + 1) & mask)
-        if (m->key[i] != TOMBSTONE && !strcmp(m->key[i], key))
+        if (m->key[i] != TOMBSTONE && same_key(m, m->key[i], key))
             return m->val[i];
     return NULL;
 }
@@ -92,7 +121,7 @@ void *map_get(Map *m, char *key) {
 void map_put(Map *m, char *key, void *val) {
     maybe_rehash(m);
     int mask = m->size - 1;
-    int i = hash(key) & mask;
+    int i = key_hash(m, key) & mask;
     for (;; i = (i + 1) & mask) {
         char *k = m->key[i];
         if (k == NULL || k == TOMBSTONE) {
@@ -103,7 +132,7 @@ void map_put(Map *m, char *key, void *val) {
                 m->nused++;
             return;
         }
-        if (!strcmp(k, key)) {
+        if (same_key(m, k, key)) {
             m->val[i] = val;
             return;
         }
@@ -114,9 +143,9 @@ void map_remove(Map *m, char *key) {
     if (!m->key)
         return;
     int mask = m->size - 1;
-    int i = hash(key) & mask;
+    int i = key_hash(m, key) & mask;
     for (; m->key[i] != NULL; i = (i + 1) & mask) {
-        if (m->key[i] == TOMBSTONE || strcmp(m->key[i], key))
+        if (m->key[i] == TOMBSTONE || !same_key(m, m->key[i], key))
             continue;
         m->key[i] = TOMBSTONE;
         m->val[i] = NULL;
@@ -125,6 +154,15 @@ void map_remove(Map *m, char *key) {
     }
 }
 
+// Empties the map and frees its storage.
+void map_clear(Map *m) {
+    container_free(m->arena, m->key, m->size * sizeof(char *));
+    container_free(m->arena, m->val, m->size * sizeof(void *));
+    m->key = NULL;
+    m->val = NULL;
+    m->size = m->nelem = m->nused = 0;
+}
+
 size_t map_len(Map *m) {
     return m->nelem;
 }
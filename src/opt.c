@@ -0,0 +1,1128 @@
+/*
+ * Optimizer for the lowered instruction stream.
+ *
+ * gen.c emits each function body as minivm assembly text. Before the text
+ * reaches the output buffer it is parsed into the control flow graph of
+ * ir.c and cleaned up by the passes below:
+ *
+ *  - conversion to SSA form and back, which promotes frame slots whose
+ *    address does not escape to registers and gives every register that is
+ *    not a phi copy a single definition,
+ *  - global value numbering over the dominator tree, which removes repeated
+ *    constants, address computations and arithmetic,
+ *  - copy propagation, which forwards the `reg` moves created by GVN and by
+ *    emit_ternary to their uses,
+ *  - redundant load and dead store elimination, using the alias class tags
+ *    that gen.c appends to get and set and an escape analysis of the frame,
+ *  - dead code elimination driven by register liveness,
+ *  - jump threading and block layout, which also drops unreachable blocks.
+ *
+ * A register that is defined exactly once is treated like an SSA value.
+ * Registers defined more than once, which after SSA destruction are only
+ * the targets of phi copies, are tracked inside a single basic block.
+ */
+
+#include "8cc.h"
+
+bool opt_report = false;
+bool opt_strict_aliasing = true;
+
+/*
+ * Global value numbering
+ */
+
+typedef struct {
+    int vn;
+    int reg;
+    Block *block;
+} Avail;
+
+typedef struct {
+    Func *f;
+    int nvn;
+    int *regvn;
+    int *curvn;
+    Block **curblock;
+    int eliminated;
+} GVN;
+
+static int vn_of(GVN *g, Block *b, int reg) {
+    if (is_ssa(g->f, reg) || g->f->ndefs[reg] == 0) {
+        if (!g->regvn[reg])
+            g->regvn[reg] = ++g->nvn;
+        return g->regvn[reg];
+    }
+    if (g->curblock[reg] != b) {
+        g->curblock[reg] = b;
+        g->curvn[reg] = ++g->nvn;
+    }
+    return g->curvn[reg];
+}
+
+static void set_vn(GVN *g, Block *b, int reg, int vn) {
+    if (is_ssa(g->f, reg)) {
+        g->regvn[reg] = vn;
+    } else {
+        g->curblock[reg] = b;
+        g->curvn[reg] = vn;
+    }
+}
+
+static bool avail_valid(GVN *g, Avail *av, Block *b) {
+    if (is_ssa(g->f, av->reg))
+        return true;
+    return av->block == b && g->curblock[av->reg] == b && g->curvn[av->reg] == av->vn;
+}
+
+static char *vn_key(GVN *g, Block *b, Insn *in) {
+    if (in->op == I_INT)
+        return arena_format("int %ld", in->imm);
+    if (in->op == I_NIL)
+        return "nil";
+    if (in->op == I_ADDR)
+        return arena_format("addr %s", in->sym);
+    int x = vn_of(g, b, in->args[0]);
+    int y = vn_of(g, b, in->args[1]);
+    if (is_commutative(in->op) && y < x) {
+        int t = x;
+        x = y;
+        y = t;
+    }
+    return arena_format("%d %d %d", in->op, x, y);
+}
+
+static Avail *make_avail(int vn, int reg, Block *b) {
+    Avail *r = arena_malloc(MEM_IR, sizeof(Avail));
+    r->vn = vn;
+    r->reg = reg;
+    r->block = b;
+    return r;
+}
+
+static void gvn_block(GVN *g, Block *b, Map *parent) {
+    Func *f = g->f;
+    Map *scope = make_map_parent(parent);
+    for (int i = b->beg; i < b->end; i++) {
+        Insn *in = insn_at(f, i);
+        if (in->dst < 0)
+            continue;
+        if (in->op == I_REG) {
+            set_vn(g, b, in->dst, vn_of(g, b, in->args[0]));
+            continue;
+        }
+        if (!is_valuenum(in)) {
+            set_vn(g, b, in->dst, ++g->nvn);
+            continue;
+        }
+        char *key = vn_key(g, b, in);
+        Avail *av = map_get(scope, key);
+        if (av && avail_valid(g, av, b)) {
+            g->eliminated++;
+            if (av->reg == in->dst) {
+                in->dead = true;
+            } else {
+                in->op = I_REG;
+                in->nargs = 1;
+                in->args[0] = av->reg;
+                in->sym = NULL;
+                in->imm = 0;
+            }
+            set_vn(g, b, in->dst, av->vn);
+            if (is_ssa(f, in->dst) && !is_ssa(f, av->reg))
+                map_put(scope, key, make_avail(av->vn, in->dst, b));
+        } else {
+            int vn = ++g->nvn;
+            set_vn(g, b, in->dst, vn);
+            map_put(scope, key, make_avail(vn, in->dst, b));
+        }
+    }
+    for (int i = 0; i < vec_len(b->kids); i++)
+        gvn_block(g, vec_get(b->kids, i), scope);
+}
+
+static int run_gvn(Func *f) {
+    GVN g = {0};
+    g.f = f;
+    g.regvn = arena_calloc(MEM_IR, f->nregs, sizeof(int));
+    g.curvn = arena_calloc(MEM_IR, f->nregs, sizeof(int));
+    g.curblock = arena_calloc(MEM_IR, f->nregs, sizeof(Block *));
+    gvn_block(&g, vec_get(f->blocks, 0), NULL);
+    return g.eliminated;
+}
+
+/*
+ * Copy propagation
+ */
+
+static void replace_uses(Func *f, Vector **uses, int from, int to) {
+    if (!uses[from])
+        return;
+    for (int i = 0; i < vec_len(uses[from]); i++) {
+        Insn *in = insn_at(f, (intptr_t)vec_get(uses[from], i));
+        for (int j = 0; j < in->nargs; j++)
+            if (in->args[j] == from)
+                in->args[j] = to;
+    }
+    if (!uses[to])
+        uses[to] = make_vector();
+    vec_append(uses[to], uses[from]);
+    uses[from] = NULL;
+}
+
+// Forwards `d <- reg s` to the uses of d inside the same block, as long as
+// neither d nor s is redefined in between. Each register counts its
+// definitions, and a copy remembers the count of its source when it was
+// made, so a redefinition kills every copy of a register at once.
+static int copyprop_local(Func *f) {
+    int n = 0;
+    int *copy = arena_malloc(MEM_IR, f->nregs * sizeof(int));
+    int *block = arena_malloc(MEM_IR, f->nregs * sizeof(int));  // where the copy was made
+    int *seen = arena_malloc(MEM_IR, f->nregs * sizeof(int));   // version of its source then
+    int *version = arena_calloc(MEM_IR, f->nregs, sizeof(int));
+    for (int r = 0; r < f->nregs; r++)
+        copy[r] = -1;
+    for (int i = 0; i < vec_len(f->blocks); i++) {
+        Block *b = vec_get(f->blocks, i);
+        for (int j = b->beg; j < b->end; j++) {
+            Insn *in = insn_at(f, j);
+            if (in->dead)
+                continue;
+            for (int k = 0; k < in->nargs; k++) {
+                int r = in->args[k];
+                int s = copy[r];
+                if (s >= 0 && block[r] == i && seen[r] == version[s]) {
+                    in->args[k] = s;
+                    n++;
+                }
+            }
+            if (in->dst < 0)
+                continue;
+            version[in->dst]++;
+            copy[in->dst] = -1;
+            if (in->op == I_REG && in->args[0] != in->dst) {
+                int s = in->args[0];
+                copy[in->dst] = s;
+                block[in->dst] = i;
+                seen[in->dst] = version[s];
+            }
+        }
+    }
+    return n;
+}
+
+// Replaces every use of a single-definition register that is a copy of
+// another single-definition register whose value is available at the copy.
+static int copyprop_global(Func *f) {
+    int n = 0;
+    Vector **uses = use_lists(f);
+    for (int i = 0; i < vec_len(f->insns); i++) {
+        Insn *in = insn_at(f, i);
+        if (in->dead || in->op != I_REG)
+            continue;
+        int d = in->dst;
+        int s = in->args[0];
+        if (!is_ssa(f, d) || d == s)
+            continue;
+        if (!(is_ssa(f, s) || (f->ndefs[s] == 0 && s == 1)))
+            continue;
+        if (!def_reaches(f, s, i))
+            continue;
+        replace_uses(f, uses, d, s);
+        f->nuses[s] += f->nuses[d];
+        f->nuses[d] = 0;
+        in->dead = true;
+        f->ndefs[d] = 0;
+        n++;
+    }
+    return n;
+}
+
+// emit_ternary computes each arm into a fresh register and then copies it
+// into the shared result register. When the fresh register is only used by
+// that copy, compute the arm directly into the result instead.
+static int coalesce_moves(Func *f) {
+    int n = 0;
+    for (int i = 0; i < vec_len(f->insns); i++) {
+        Insn *in = insn_at(f, i);
+        if (in->dead || in->op != I_REG)
+            continue;
+        int d = in->dst;
+        int s = in->args[0];
+        if (s == d || !is_ssa(f, s) || f->nuses[s] != 1)
+            continue;
+        int def = f->defat[s];
+        if (def > i || f->blockof[def] != f->blockof[i])
+            continue;
+        bool ok = true;
+        for (int j = def + 1; j < i && ok; j++) {
+            Insn *m = insn_at(f, j);
+            if (m->dead)
+                continue;
+            if (m->dst == d)
+                ok = false;
+            for (int k = 0; k < m->nargs; k++)
+                if (m->args[k] == d)
+                    ok = false;
+        }
+        if (!ok)
+            continue;
+        insn_at(f, def)->dst = d;
+        in->dead = true;
+        f->defat[d] = def;
+        f->ndefs[s] = 0;
+        f->nuses[s] = 0;
+        n++;
+    }
+    return n;
+}
+
+/*
+ * Memory
+ *
+ * Every address operand is described as an offset from the frame pointer
+ * r2, from zero (globals live at fixed addresses) or from some other value.
+ * Frame slots whose address never leaves the function cannot be reached
+ * through other pointers or by callees, except for the area at the top of
+ * the frame where arguments and return values are passed. C lets a pointer
+ * into an array step backwards as well as forwards, so once any frame
+ * address escapes, every slot of the frame may be reached through it.
+ */
+
+enum {
+    A_CONST,
+    A_FRAME,
+    A_VALUE,
+};
+
+typedef struct {
+    int kind;
+    int base;    // value id for A_VALUE
+    long off;
+    bool exact;  // if false, any offset from the same base
+} Addr;
+
+typedef struct {
+    Addr *addr;
+    int tag;
+    int reg;  // register holding the stored or loaded value
+} MemVal;
+
+typedef struct {
+    Func *f;
+    int nvals;
+    Addr **val;        // description of the value in each register
+    Block **valblock;  // block where a multi-def register got its value
+    Addr **memaddr;    // address operand of each get and set
+    bool exposed;      // a frame address escapes
+    long callfloor;    // lowest frame offset passed to callees as their frame
+    int loads;
+    int stores;
+} Mem;
+
+#define NO_OFFSET LONG_MAX
+
+static Addr *make_addr(int kind, int base, long off, bool exact) {
+    Addr *r = arena_malloc(MEM_IR, sizeof(Addr));
+    r->kind = kind;
+    r->base = base;
+    r->off = off;
+    r->exact = exact;
+    return r;
+}
+
+static Addr *fresh_value(Mem *m) {
+    return make_addr(A_VALUE, ++m->nvals, 0, true);
+}
+
+static Addr *reg_addr(Mem *m, Block *b, int reg) {
+    Func *f = m->f;
+    if (is_ssa(f, reg) || f->ndefs[reg] == 0) {
+        if (!m->val[reg])
+            m->val[reg] = fresh_value(m);
+        return m->val[reg];
+    }
+    if (m->valblock[reg] != b) {
+        m->valblock[reg] = b;
+        m->val[reg] = fresh_value(m);
+    }
+    return m->val[reg];
+}
+
+static void set_reg_addr(Mem *m, Block *b, int reg, Addr *a) {
+    m->val[reg] = a;
+    m->valblock[reg] = b;
+}
+
+static void escape(Mem *m, Addr *a) {
+    if (a->kind == A_FRAME)
+        m->exposed = true;
+}
+
+static Addr *add_offset(Addr *a, long k) {
+    return make_addr(a->kind, a->base, a->off + k, a->exact);
+}
+
+static Addr *addr_of_add(Mem *m, Addr *a, Addr *b) {
+    if (b->kind == A_CONST && b->exact)
+        return add_offset(a, b->off);
+    if (a->kind == A_CONST && a->exact)
+        return add_offset(b, a->off);
+    if (a->kind == A_FRAME && b->kind != A_FRAME)
+        return make_addr(A_FRAME, 0, a->off, false);
+    if (b->kind == A_FRAME && a->kind != A_FRAME)
+        return make_addr(A_FRAME, 0, b->off, false);
+    escape(m, a);
+    escape(m, b);
+    return fresh_value(m);
+}
+
+static Addr *addr_of_sub(Mem *m, Addr *a, Addr *b) {
+    if (b->kind == A_CONST && b->exact)
+        return add_offset(a, -b->off);
+    if (a->kind == A_FRAME && b->kind == A_FRAME)
+        return fresh_value(m);
+    if (a->kind == A_FRAME)
+        return make_addr(A_FRAME, 0, 0, false);
+    escape(m, b);
+    return fresh_value(m);
+}
+
+// Describes the value defined by every instruction and records the address
+// operands of memory accesses. Frame addresses used as anything other than
+// an address are recorded as escaping.
+static void describe_block(Mem *m, Block *b) {
+    Func *f = m->f;
+    Insn *prev = NULL;
+    for (int i = b->beg; i < b->end; i++) {
+        Insn *in = insn_at(f, i);
+        if (in->dead)
+            continue;
+        Addr *a = NULL;
+        switch (in->op) {
+            case I_GET:
+                m->memaddr[i] = reg_addr(m, b, in->args[1]);
+                a = in->dst == 2 ? make_addr(A_FRAME, 0, 0, true) : fresh_value(m);
+                break;
+            case I_SET: {
+                Addr *where = reg_addr(m, b, in->args[1]);
+                Addr *v = reg_addr(m, b, in->args[2]);
+                m->memaddr[i] = where;
+                // mem[1] holds the frame of the next callee. Restoring it
+                // after a call hands nothing new to anybody.
+                if (where->kind == A_CONST && where->exact && where->off == 1 && v->kind == A_FRAME) {
+                    bool restore = prev && (prev->op == I_CALL || prev->op == I_DCALL);
+                    if (!restore && (!v->exact || v->off < m->callfloor))
+                        m->callfloor = v->exact ? v->off : 0;
+                } else {
+                    escape(m, v);
+                }
+                break;
+            }
+            case I_REG:
+                a = reg_addr(m, b, in->args[0]);
+                break;
+            case I_INT:
+                a = make_addr(A_CONST, 0, in->imm, true);
+                break;
+            case I_ADD:
+                a = addr_of_add(m, reg_addr(m, b, in->args[0]), reg_addr(m, b, in->args[1]));
+                break;
+            case I_SUB:
+                a = addr_of_sub(m, reg_addr(m, b, in->args[0]), reg_addr(m, b, in->args[1]));
+                break;
+            default:
+                for (int j = 0; j < in->nargs; j++)
+                    if (in->args[j] != 1)
+                        escape(m, reg_addr(m, b, in->args[j]));
+                break;
+        }
+        if (in->dst >= 0) {
+            if (!a)
+                a = fresh_value(m);
+            // Other blocks cannot tell which definition of a multi-def
+            // register they see. gen.c never keeps r0 across blocks.
+            if (in->dst != 0 && !is_ssa(f, in->dst))
+                escape(m, a);
+            set_reg_addr(m, b, in->dst, a);
+        }
+        prev = in;
+    }
+    for (int i = 0; i < vec_len(b->kids); i++)
+        describe_block(m, vec_get(b->kids, i));
+}
+
+static bool addr_must_alias(Addr *a, Addr *b) {
+    return a->exact && b->exact && a->kind == b->kind && a->off == b->off && (a->kind != A_VALUE || a->base == b->base);
+}
+
+// True if the frame slots described by `a` may be reached from offset
+// `floor` upwards.
+static bool frame_above(Addr *a, long floor) {
+    if (floor == NO_OFFSET)
+        return false;
+    return !a->exact || a->off >= floor;
+}
+
+static bool addr_may_alias(Mem *m, Addr *a, Addr *b) {
+    if (a->kind == b->kind) {
+        if (a->kind == A_VALUE && a->base != b->base)
+            return true;
+        return !a->exact || !b->exact || a->off == b->off;
+    }
+    if (a->kind == A_VALUE || b->kind == A_VALUE) {
+        Addr *other = a->kind == A_VALUE ? b : a;
+        return other->kind == A_CONST || m->exposed;
+    }
+    return false;
+}
+
+static bool may_alias(Mem *m, Addr *a, int atag, Addr *b, int btag) {
+    if (opt_strict_aliasing && atag != T_ANY && btag != T_ANY && atag != btag)
+        return false;
+    return addr_may_alias(m, a, b);
+}
+
+static bool clobbered_by_call(Mem *m, Addr *a) {
+    if (a->kind != A_FRAME || m->exposed)
+        return true;
+    return frame_above(a, m->callfloor);
+}
+
+// A function that ipo.c found to leave memory alone still writes its own
+// frame, which starts where the caller's outgoing arguments do, and the
+// stack pointer when it makes calls of its own.
+static bool clobbered_by_readonly_call(Mem *m, Addr *a) {
+    if (a->kind == A_CONST)
+        return a->off == 1;
+    if (a->kind == A_FRAME)
+        return frame_above(a, m->callfloor);
+    return false;
+}
+
+static bool is_readonly_call(Insn *in) {
+    return in->op == I_CALL && !strncmp(in->sym, "func.", 5) && is_readonly_func(in->sym + 5);
+}
+
+static MemVal *make_memval(Addr *addr, int tag, int reg) {
+    MemVal *r = arena_malloc(MEM_IR, sizeof(MemVal));
+    r->addr = addr;
+    r->tag = tag;
+    r->reg = reg;
+    return r;
+}
+
+static Vector *kill_reg(Vector *vals, int reg) {
+    Vector *r = make_vector();
+    for (int i = 0; i < vec_len(vals); i++) {
+        MemVal *v = vec_get(vals, i);
+        if (v->reg != reg)
+            vec_push(r, v);
+    }
+    return r;
+}
+
+static Vector *kill_store(Mem *m, Vector *vals, Addr *addr, int tag) {
+    Vector *r = make_vector();
+    for (int i = 0; i < vec_len(vals); i++) {
+        MemVal *v = vec_get(vals, i);
+        if (!may_alias(m, v->addr, v->tag, addr, tag))
+            vec_push(r, v);
+    }
+    return r;
+}
+
+static Vector *kill_call(Mem *m, Vector *vals, bool readonly) {
+    Vector *r = make_vector();
+    for (int i = 0; i < vec_len(vals); i++) {
+        MemVal *v = vec_get(vals, i);
+        if (!(readonly ? clobbered_by_readonly_call(m, v->addr) : clobbered_by_call(m, v->addr)))
+            vec_push(r, v);
+    }
+    return r;
+}
+
+// Replaces loads of a location whose value is already in a register.
+// Blocks whose only predecessor is their immediate dominator start with
+// the values known at the end of that predecessor.
+static void forward_loads(Mem *m, Block *b, Vector *in) {
+    Func *f = m->f;
+    Vector *vals = make_vector();
+    if (in && vec_len(b->preds) == 1 && vec_get(b->preds, 0) == b->idom) {
+        for (int i = 0; i < vec_len(in); i++) {
+            MemVal *v = vec_get(in, i);
+            if (is_ssa(f, v->reg))
+                vec_push(vals, v);
+        }
+    }
+    for (int i = b->beg; i < b->end; i++) {
+        Insn *in = insn_at(f, i);
+        if (in->dead)
+            continue;
+        if (in->op == I_GET) {
+            Addr *addr = m->memaddr[i];
+            MemVal *found = NULL;
+            for (int j = 0; j < vec_len(vals) && !found; j++) {
+                MemVal *v = vec_get(vals, j);
+                if (addr_must_alias(v->addr, addr))
+                    found = v;
+            }
+            if (found) {
+                in->op = I_REG;
+                in->args[0] = found->reg;
+                in->nargs = 1;
+                in->tag = T_ANY;
+                m->loads++;
+                if (found->reg != in->dst)
+                    vals = kill_reg(vals, in->dst);
+                continue;
+            }
+            vals = kill_reg(vals, in->dst);
+            if (addr->exact && in->dst != in->args[1])
+                vec_push(vals, make_memval(addr, in->tag, in->dst));
+            continue;
+        }
+        if (in->op == I_SET) {
+            Addr *addr = m->memaddr[i];
+            vals = kill_store(m, vals, addr, in->tag);
+            if (addr->exact)
+                vec_push(vals, make_memval(addr, in->tag, in->args[2]));
+            continue;
+        }
+        if (in->op == I_CALL || in->op == I_DCALL)
+            vals = kill_call(m, vals, is_readonly_call(in));
+        if (in->dst >= 0)
+            vals = kill_reg(vals, in->dst);
+    }
+    for (int i = 0; i < vec_len(b->kids); i++)
+        forward_loads(m, vec_get(b->kids, i), vals);
+}
+
+// Removes stores that are overwritten later in the same block before
+// anything can read them.
+static void eliminate_local_stores(Mem *m, Block *b) {
+    Func *f = m->f;
+    Vector *over = make_vector();
+    for (int i = b->end - 1; i >= b->beg; i--) {
+        Insn *in = insn_at(f, i);
+        if (in->dead)
+            continue;
+        if (in->op == I_SET) {
+            Addr *addr = m->memaddr[i];
+            bool dead = false;
+            for (int j = 0; j < vec_len(over) && !dead; j++)
+                dead = addr_must_alias(((MemVal *)vec_get(over, j))->addr, addr);
+            if (dead) {
+                in->dead = true;
+                m->stores++;
+            } else if (addr->exact) {
+                vec_push(over, make_memval(addr, in->tag, 0));
+            }
+        } else if (in->op == I_GET) {
+            over = kill_store(m, over, m->memaddr[i], in->tag);
+        } else if (in->op == I_CALL || in->op == I_DCALL || in->op == I_RET) {
+            over = make_vector();
+        }
+    }
+}
+
+// Removes stores to frame slots that are neither read in this function nor
+// reachable from anywhere else.
+static void eliminate_frame_stores(Mem *m, Vector *rpo) {
+    Func *f = m->f;
+    if (m->exposed)
+        return;
+    Map *read = make_map();
+    for (int i = 0; i < vec_len(rpo); i++) {
+        Block *b = vec_get(rpo, i);
+        for (int j = b->beg; j < b->end; j++) {
+            Insn *in = insn_at(f, j);
+            if (in->dead || in->op != I_GET || m->memaddr[j]->kind != A_FRAME)
+                continue;
+            Addr *addr = m->memaddr[j];
+            // A read at an unknown offset may read any slot.
+            if (!addr->exact)
+                return;
+            map_put(read, arena_format("%ld", addr->off), addr);
+        }
+    }
+    for (int i = 0; i < vec_len(rpo); i++) {
+        Block *b = vec_get(rpo, i);
+        for (int j = b->beg; j < b->end; j++) {
+            Insn *in = insn_at(f, j);
+            if (in->dead || in->op != I_SET)
+                continue;
+            Addr *addr = m->memaddr[j];
+            if (addr->kind != A_FRAME || !addr->exact || addr->off >= m->callfloor)
+                continue;
+            if (map_get(read, arena_format("%ld", addr->off)))
+                continue;
+            in->dead = true;
+            m->stores++;
+        }
+    }
+}
+
+static void optimize_memory(Func *f, Vector *rpo, int *loads, int *stores) {
+    *loads = *stores = 0;
+    if (!is_ssa(f, 2))
+        return;
+    Mem m = {0};
+    m.f = f;
+    m.val = arena_calloc(MEM_IR, f->nregs, sizeof(Addr *));
+    m.valblock = arena_calloc(MEM_IR, f->nregs, sizeof(Block *));
+    m.memaddr = arena_calloc(MEM_IR, vec_len(f->insns), sizeof(Addr *));
+    m.callfloor = NO_OFFSET;
+    Block *entry = vec_get(f->blocks, 0);
+    describe_block(&m, entry);
+    forward_loads(&m, entry, NULL);
+    for (int i = 0; i < vec_len(rpo); i++)
+        eliminate_local_stores(&m, vec_get(rpo, i));
+    eliminate_frame_stores(&m, rpo);
+    *loads = m.loads;
+    *stores = m.stores;
+}
+
+/*
+ * Dead code elimination
+ */
+
+static int eliminate_dead_code(Func *f, Vector *rpo) {
+    int n = 0;
+    int words = BITS_WORDS(f->nregs);
+    uint64_t *live = arena_calloc(MEM_IR, words, sizeof(uint64_t));
+    for (bool changed = true; changed;) {
+        changed = false;
+        compute_liveness(f, rpo);
+        for (int i = 0; i < vec_len(rpo); i++) {
+            Block *b = vec_get(rpo, i);
+            memcpy(live, b->liveout, words * sizeof(uint64_t));
+            for (int j = b->end - 1; j >= b->beg; j--) {
+                Insn *in = insn_at(f, j);
+                if (in->dead)
+                    continue;
+                if (in->dst >= 0 && is_pure(in) && (!BIT_GET(live, in->dst) || (in->op == I_REG && in->args[0] == in->dst))) {
+                    in->dead = true;
+                    changed = true;
+                    n++;
+                    continue;
+                }
+                if (in->dst >= 0)
+                    BIT_CLR(live, in->dst);
+                for (int k = 0; k < in->nargs; k++)
+                    BIT_SET(live, in->args[k]);
+            }
+        }
+    }
+    return n;
+}
+
+/*
+ * Block layout
+ *
+ * Branches in the VM always name both of their targets, so the only jumps
+ * that can be saved are unconditional ones: jumps to a block that does
+ * nothing but jump again are threaded to the final target, and blocks are
+ * ordered so that a jump to the block that follows can be dropped.
+ *
+ * With a profile, hot jumps are preferred when deciding which block follows
+ * which, and blocks that never ran are moved to the end of the function.
+ */
+
+typedef struct {
+    Func *f;
+    int nblocks;
+    Vector **code;  // live instructions of each block, ending in a terminator
+    char **label;
+    bool *reachable;
+    int threaded;
+    int jumps;
+    int unreachable;
+} Layout;
+
+// Maps the labels of the function as emitted by gen.c to their execution
+// counts plus one, if the profile has them.
+static Map *profile_counts(Func *f) {
+    if (!has_profile())
+        return NULL;
+    int nlabels = 0;
+    for (int i = 0; i < vec_len(f->insns); i++)
+        if (insn_at(f, i)->op == I_LABEL)
+            nlabels++;
+    Map *r = make_map();
+    int n = 0;
+    for (int i = 0; i < vec_len(f->insns); i++) {
+        Insn *in = insn_at(f, i);
+        if (in->op != I_LABEL)
+            continue;
+        long count = profile_block_count(f->name, n++, nlabels);
+        if (count < 0)
+            return NULL;
+        map_put(r, in->sym, (void *)(intptr_t)(count + 1));
+    }
+    return r;
+}
+
+// Executions of a block, or -1 if not known.
+static long block_count(Func *f, Block *b) {
+    Insn *first = insn_at(f, b->beg);
+    if (!f->counts || first->op != I_LABEL)
+        return -1;
+    return (intptr_t)map_get(f->counts, first->sym) - 1;
+}
+
+static char *layout_label(Layout *l, Block *b) {
+    if (!l->label[b->id]) {
+        char *name = arena_format("%s.B%d", l->f->name, b->id);
+        Insn *in = make_insn(I_LABEL);
+        in->sym = name;
+        Vector *code = make_vector1(in);
+        vec_append(code, l->code[b->id]);
+        l->code[b->id] = code;
+        l->label[b->id] = name;
+        map_put(l->f->labels, name, b);
+    }
+    return l->label[b->id];
+}
+
+static Insn *layout_term(Layout *l, Block *b) {
+    Vector *code = l->code[b->id];
+    Insn *last = vec_len(code) ? vec_tail(code) : NULL;
+    return last && is_terminator(last) ? last : NULL;
+}
+
+// Follows blocks that consist of labels and a single jump.
+static Block *resolve_jump(Layout *l, Block *b) {
+    for (int n = 0; n < l->nblocks; n++) {
+        Vector *code = l->code[b->id];
+        Insn *last = layout_term(l, b);
+        if (!last || last->op != I_JUMP)
+            return b;
+        for (int i = 0; i < vec_len(code) - 1; i++)
+            if (((Insn *)vec_get(code, i))->op != I_LABEL)
+                return b;
+        Block *next = label_block(l->f, last->target[0]);
+        if (next == b)
+            return b;
+        b = next;
+    }
+    return b;
+}
+
+static void thread_target(Layout *l, char **target) {
+    Block *t = label_block(l->f, *target);
+    Block *r = resolve_jump(l, t);
+    if (r != t) {
+        *target = layout_label(l, r);
+        l->threaded++;
+    }
+}
+
+static void mark_reachable(Layout *l, Block *b) {
+    if (l->reachable[b->id])
+        return;
+    l->reachable[b->id] = true;
+    Insn *term = layout_term(l, b);
+    if (!term)
+        return;
+    if (term->op == I_JUMP || term->op == I_BEQ || term->op == I_BLT)
+        mark_reachable(l, label_block(l->f, term->target[0]));
+    if (term->op == I_BEQ || term->op == I_BLT)
+        mark_reachable(l, label_block(l->f, term->target[1]));
+}
+
+static Vector *layout_blocks(Func *f, int *threaded, int *jumps, int *unreachable) {
+    Layout l = {0};
+    l.f = f;
+    l.nblocks = vec_len(f->blocks);
+    l.code = arena_calloc(MEM_IR, l.nblocks, sizeof(Vector *));
+    l.label = arena_calloc(MEM_IR, l.nblocks, sizeof(char *));
+    l.reachable = arena_calloc(MEM_IR, l.nblocks, sizeof(bool));
+    for (int i = 0; i < l.nblocks; i++) {
+        Block *b = vec_get(f->blocks, i);
+        l.code[i] = make_vector();
+        for (int j = b->beg; j < b->end; j++) {
+            Insn *in = insn_at(f, j);
+            if (!in->dead)
+                vec_push(l.code[i], in);
+        }
+        Insn *first = insn_at(f, b->beg);
+        if (first->op == I_LABEL)
+            l.label[i] = first->sym;
+    }
+
+    // Make fall-through edges explicit so that blocks can be reordered.
+    for (int i = 0; i + 1 < l.nblocks; i++) {
+        Block *b = vec_get(f->blocks, i);
+        if (layout_term(&l, b))
+            continue;
+        Insn *jump = make_insn(I_JUMP);
+        jump->target[0] = layout_label(&l, vec_get(f->blocks, i + 1));
+        vec_push(l.code[i], jump);
+    }
+
+    for (int i = 0; i < l.nblocks; i++) {
+        Insn *term = layout_term(&l, vec_get(f->blocks, i));
+        if (!term || term->op == I_RET || term->op == I_EXIT)
+            continue;
+        thread_target(&l, &term->target[0]);
+        if (term->op == I_JUMP)
+            continue;
+        thread_target(&l, &term->target[1]);
+        if (!strcmp(term->target[0], term->target[1])) {
+            term->op = I_JUMP;
+            term->nargs = 0;
+        }
+    }
+
+    mark_reachable(&l, vec_get(f->blocks, 0));
+    for (int i = 0; i < vec_len(f->insns); i++) {
+        Insn *in = insn_at(f, i);
+        if (!in->dead && in->op == I_ADDR && map_get(f->labels, in->sym))
+            mark_reachable(&l, map_get(f->labels, in->sym));
+    }
+
+    // A block that ends in a jump pulls its target up behind it when it is
+    // the only way into the target, or the jump that runs most often. Otherwise
+    // the original order is kept, which puts the body of a rotated loop right
+    // before its test.
+    int *npreds = arena_calloc(MEM_IR, l.nblocks, sizeof(int));
+    Block **hottest = arena_calloc(MEM_IR, l.nblocks, sizeof(Block *));
+    for (int i = 0; i < l.nblocks; i++) {
+        Block *b = vec_get(f->blocks, i);
+        Insn *term = layout_term(&l, b);
+        if (!l.reachable[i] || !term || term->op == I_RET || term->op == I_EXIT)
+            continue;
+        Block *t = label_block(f, term->target[0]);
+        npreds[t->id]++;
+        if (term->op != I_JUMP)
+            npreds[label_block(f, term->target[1])->id]++;
+        else if (block_count(f, b) > 0 && (!hottest[t->id] || block_count(f, b) > block_count(f, hottest[t->id])))
+            hottest[t->id] = b;
+    }
+    bool *placed = arena_calloc(MEM_IR, l.nblocks, sizeof(bool));
+    Vector *order = make_vector();
+    for (int i = 0; i < l.nblocks; i++) {
+        Block *b = vec_get(f->blocks, i);
+        while (b && l.reachable[b->id] && !placed[b->id]) {
+            placed[b->id] = true;
+            vec_push(order, b);
+            Insn *term = layout_term(&l, b);
+            if (!term || term->op != I_JUMP)
+                break;
+            Block *t = label_block(f, term->target[0]);
+            b = npreds[t->id] == 1 || hottest[t->id] == b ? t : NULL;
+        }
+    }
+    if (f->counts && profile_func_count(f->name) > 0) {
+        Vector *cold = make_vector();
+        Vector *hot = make_vector();
+        for (int i = 0; i < vec_len(order); i++) {
+            Block *b = vec_get(order, i);
+            vec_push(i > 0 && block_count(f, b) == 0 ? cold : hot, b);
+        }
+        vec_append(hot, cold);
+        order = hot;
+    }
+
+    Map *used = make_map();
+    Vector *r = make_vector();
+    for (int i = 0; i < vec_len(order); i++) {
+        Block *b = vec_get(order, i);
+        Vector *code = l.code[b->id];
+        Insn *term = layout_term(&l, b);
+        if (term && term->op == I_JUMP && i + 1 < vec_len(order) && label_block(f, term->target[0]) == vec_get(order, i + 1)) {
+            vec_pop(code);
+            l.jumps++;
+        }
+        for (int j = 0; j < vec_len(code); j++) {
+            Insn *in = vec_get(code, j);
+            vec_push(r, in);
+            if (in->op == I_JUMP || in->op == I_BEQ || in->op == I_BLT)
+                map_put(used, in->target[0], in);
+            if (in->op == I_BEQ || in->op == I_BLT)
+                map_put(used, in->target[1], in);
+            if (in->op == I_ADDR)
+                map_put(used, in->sym, in);
+        }
+    }
+    for (int i = 0; i < l.nblocks; i++)
+        if (!l.reachable[i])
+            l.unreachable += vec_len(l.code[i]);
+    for (int i = 0; i < vec_len(r); i++) {
+        Insn *in = vec_get(r, i);
+        if (in->op == I_LABEL && !map_get(used, in->sym))
+            in->dead = true;
+    }
+    *threaded = l.threaded;
+    *jumps = l.jumps;
+    *unreachable = l.unreachable;
+    return r;
+}
+
+/*
+ * Driver
+ */
+
+static int max_reg(Vector *insns) {
+    int r = 3;
+    for (int i = 0; i < vec_len(insns); i++) {
+        Insn *in = vec_get(insns, i);
+        if (in->dst >= r)
+            r = in->dst + 1;
+        for (int j = 0; j < in->nargs; j++)
+            if (in->args[j] >= r)
+                r = in->args[j] + 1;
+    }
+    return r;
+}
+
+// Copies the body to the output as is, minus the alias class tags that the
+// VM assembler does not understand.
+static void print_unoptimized(Buffer *out, char *body) {
+    for (char *p = body; *p; p++) {
+        if (p[0] == ' ' && p[1] == ':') {
+            while (*p && *p != '\n')
+                p++;
+            if (!*p)
+                break;
+        }
+        buf_write(out, *p);
+    }
+}
+
+static long func_size(Func *f) {
+    if (!pass_stats)
+        return 0;
+    long r = 0;
+    for (int i = 0; i < vec_len(f->insns); i++)
+        if (!((Insn *)vec_get(f->insns, i))->dead)
+            r++;
+    return r;
+}
+
+static bool begin_pass(Func *f, int pass) {
+    if (!pass_enabled(pass))
+        return false;
+    pass_start(pass, func_size(f));
+    return true;
+}
+
+static void end_pass(Func *f, int pass) {
+    pass_stop(pass);
+    if (!pass_finish(pass, func_size(f)))
+        return;
+    Buffer *b = make_buffer();
+    for (int i = 0; i < vec_len(f->insns); i++) {
+        Insn *in = vec_get(f->insns, i);
+        if (!in->dead)
+            print_insn(b, in);
+    }
+    fprintf(stderr, "; after %s: func.%s\n%s", pass_name(pass), f->name, buf_body(b));
+    buf_free(b);
+}
+
+static bool any_pass_enabled(void) {
+    for (int p = PASS_SSA; p <= PASS_LAYOUT; p++)
+        if (pass_enabled(p))
+            return true;
+    return false;
+}
+
+static char *copy_body(Buffer *body) {
+    char *r = arena_malloc(MEM_IR, buf_len(body));
+    memcpy(r, buf_body(body), buf_len(body));
+    return r;
+}
+
+static void optimize_func(Buffer *out, char *name, Buffer *body) {
+    buf_write(body, '\0');
+    Vector *insns = any_pass_enabled() ? parse_body(copy_body(body)) : NULL;
+    if (!insns || vec_len(insns) == 0) {
+        print_unoptimized(out, buf_body(body));
+        return;
+    }
+    Func *f = arena_calloc(MEM_IR, 1, sizeof(Func));
+    f->name = name;
+    f->insns = insns;
+    f->nregs = max_reg(insns);
+    f->counts = profile_counts(f);
+    build_cfg(f);
+    Vector *rpo = compute_dominators(f);
+    count_defs_uses(f);
+
+    int slots = 0, gvn = 0, copies = 0, loads = 0, stores = 0, dead = 0, coalesced = 0;
+    int threaded = 0, jumps = 0, unreachable = 0;
+    if (begin_pass(f, PASS_SSA)) {
+        slots = build_ssa(f, rpo);
+        if (slots >= 0) {
+            rpo = compute_dominators(f);
+            count_defs_uses(f);
+        } else {
+            slots = 0;
+        }
+        end_pass(f, PASS_SSA);
+    }
+    if (begin_pass(f, PASS_GVN)) {
+        gvn = run_gvn(f);
+        end_pass(f, PASS_GVN);
+    }
+    if (begin_pass(f, PASS_COPYPROP)) {
+        copies += copyprop_local(f);
+        count_defs_uses(f);
+        copies += copyprop_global(f);
+        end_pass(f, PASS_COPYPROP);
+    }
+    count_defs_uses(f);
+    if (begin_pass(f, PASS_MEMORY)) {
+        optimize_memory(f, rpo, &loads, &stores);
+        end_pass(f, PASS_MEMORY);
+    }
+    if (begin_pass(f, PASS_COPYPROP)) {
+        copies += copyprop_local(f);
+        count_defs_uses(f);
+        copies += copyprop_global(f);
+        end_pass(f, PASS_COPYPROP);
+    }
+    if (begin_pass(f, PASS_DCE)) {
+        dead += eliminate_dead_code(f, rpo);
+        end_pass(f, PASS_DCE);
+    }
+    count_defs_uses(f);
+    if (begin_pass(f, PASS_COALESCE)) {
+        coalesced = coalesce_moves(f);
+        end_pass(f, PASS_COALESCE);
+    }
+    if (begin_pass(f, PASS_COPYPROP)) {
+        copies += copyprop_local(f);
+        end_pass(f, PASS_COPYPROP);
+    }
+    if (begin_pass(f, PASS_DCE)) {
+        dead += eliminate_dead_code(f, rpo);
+        end_pass(f, PASS_DCE);
+    }
+    if (begin_pass(f, PASS_LAYOUT)) {
+        f->insns = layout_blocks(f, &threaded, &jumps, &unreachable);
+        end_pass(f, PASS_LAYOUT);
+    }
+
+    if (opt_report)
+        fprintf(stderr, "opt: func.%s: promoted %d frame slots, gvn eliminated %d expressions, forwarded %d loads, removed %d dead stores, propagated %d copies, coalesced %d moves, removed %d dead instructions, threaded %d jumps, removed %d jumps, removed %d unreachable instructions\n",
+                name, slots, gvn, loads, stores, copies, coalesced, dead, threaded, jumps, unreachable);
+    for (int i = 0; i < vec_len(f->insns); i++) {
+        Insn *in = vec_get(f->insns, i);
+        if (!in->dead)
+            print_insn(out, in);
+    }
+}
+
+// Optimizes a function into `out`. Everything made on the way lives in an
+// arena that is freed when it is done.
+void opt_func(Buffer *out, char *name, Buffer *body) {
+    static Arena *arena;
+    if (!arena)
+        arena = make_arena("optimizer");
+    Arena *old = use_arena(arena);
+    optimize_func(out, name, body);
+    use_arena(old);
+    arena_reset(arena);
+}
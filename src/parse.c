@@ -25,24 +25,34 @@
 // source code.
 SourceLoc *source_loc;
 
+// If set, function bodies are allocated in it, and the caller frees it
+// once it is done with them.
+Arena *body_arena;
+
 // Objects representing various scopes. Did you know C has so many different
 // scopes? You can use the same name for global variable, local variable,
 // struct/union/enum tag, and goto label!
-static Map *globalenv = &EMPTY_MAP;
+static Map *globalenv = &EMPTY_SYMBOL_MAP;
 static Map *localenv;
-static Map *tags = &EMPTY_MAP;
+static Map *tags = &EMPTY_SYMBOL_MAP;
 static Map *labels;
 
+// Scopes, labels and gotos are only needed while their function is read.
+static Arena *scope_arena;
+
 static Vector *toplevels;
 static Vector *localvars;
 static Vector *gotos;
 static Vector *cases;
+static Vector *loops;
 static Type *current_func_type;
 
 static char *defaultcase;
 static char *lbreak;
 static char *lcontinue;
 
+static int unroll_mode;  // of the function being read
+
 // Objects representing basic types. All variables will be of one of these types
 // or a derived type from one of them. Note that (typename){initializer} is C99
 // feature to write struct literals.
@@ -104,6 +114,8 @@ static Node *read_cast_expr(void);
 static Node *read_comma_expr(void);
 static Token *get(void);
 static Token *peek(void);
+static int take_unroll(Token *tok);
+static void misplaced_unroll(Token *tok, int unroll);
 
 typedef struct {
     int beg;
@@ -132,7 +144,7 @@ enum {
 
 static void mark_location() {
     Token *tok = peek();
-    source_loc = malloc(sizeof(SourceLoc));
+    source_loc = arena_malloc(MEM_NODE, sizeof(SourceLoc));
     source_loc->file = tok->file->name;
     source_loc->line = tok->line;
 }
@@ -141,23 +153,24 @@ static void mark_location() {
  * Constructors
  */
 
+// Counters for the names below. parse_reset starts them over, so that a
+// translation unit gets the same names however many came before it.
+static int ntemps, nlabels, nstatics;
+
 char *make_tempname() {
-    static int c = 0;
-    return format(".T%d", c++);
+    return intern(format(".T%d", ntemps++));
 }
 
 char *make_label() {
-    static int c = 0;
-    return format(".L%d", c++);
+    return format(".L%d", nlabels++);
 }
 
 static char *make_static_label(char *name) {
-    static int c = 0;
-    return format(".S%d.%s", c++, name);
+    return format(".S%d.%s", nstatics++, name);
 }
 
 static Case *make_case(int beg, int end, char *label) {
-    Case *r = malloc(sizeof(Case));
+    Case *r = arena_malloc(MEM_NODE, sizeof(Case));
     r->beg = beg;
     r->end = end;
     r->label = label;
@@ -168,8 +181,8 @@ static Map *env() {
     return localenv ? localenv : globalenv;
 }
 
-static Node *make_ast(Node *tmpl) {
-    Node *r = malloc(sizeof(Node));
+Node *make_ast(Node *tmpl) {
+    Node *r = arena_malloc(MEM_NODE, sizeof(Node));
     *r = *tmpl;
     r->sourceLoc = source_loc;
     return r;
@@ -179,14 +192,14 @@ static Node *ast_uop(int kind, Type *ty, Node *operand) {
     return make_ast(&(Node){kind, ty, .operand = operand});
 }
 
-static Node *ast_binop(Type *ty, int kind, Node *left, Node *right) {
+Node *ast_binop(Type *ty, int kind, Node *left, Node *right) {
     Node *r = make_ast(&(Node){kind, ty});
     r->left = left;
     r->right = right;
     return r;
 }
 
-static Node *ast_inttype(Type *ty, long val) {
+Node *ast_inttype(Type *ty, long val) {
     return make_ast(&(Node){AST_LITERAL, ty, .ival = val});
 }
 
@@ -253,7 +266,7 @@ static Node *ast_string(int enc, char *str, int len) {
     return make_ast(&(Node){AST_LITERAL, .ty = ty, .sval = body});
 }
 
-static Node *ast_funcall(Type *ftype, char *fname, Vector *args) {
+Node *ast_funcall(Type *ftype, char *fname, Vector *args) {
     return make_ast(&(Node){
         .kind = AST_FUNCALL,
         .ty = ftype->rettype,
@@ -298,7 +311,7 @@ static Node *ast_conv(Type *totype, Node *val) {
     return make_ast(&(Node){AST_CONV, totype, .operand = val});
 }
 
-static Node *ast_if(Node *cond, Node *then, Node *els) {
+Node *ast_if(Node *cond, Node *then, Node *els) {
     return make_ast(&(Node){AST_IF, .cond = cond, .then = then, .els = els});
 }
 
@@ -310,7 +323,7 @@ static Node *ast_return(Node *retval) {
     return make_ast(&(Node){AST_RETURN, .retval = retval});
 }
 
-static Node *ast_compound_stmt(Vector *stmts) {
+Node *ast_compound_stmt(Vector *stmts) {
     return make_ast(&(Node){AST_COMPOUND_STMT, .stmts = stmts});
 }
 
@@ -322,7 +335,7 @@ static Node *ast_goto(char *label) {
     return make_ast(&(Node){AST_GOTO, .label = label});
 }
 
-static Node *ast_jump(char *label) {
+Node *ast_jump(char *label) {
     return make_ast(&(Node){AST_GOTO, .label = label, .newlabel = label});
 }
 
@@ -334,7 +347,7 @@ static Node *ast_label(char *label) {
     return make_ast(&(Node){AST_LABEL, .label = label});
 }
 
-static Node *ast_dest(char *label) {
+Node *ast_dest(char *label) {
     return make_ast(&(Node){AST_LABEL, .label = label, .newlabel = label});
 }
 
@@ -343,19 +356,19 @@ static Node *ast_label_addr(char *label) {
 }
 
 static Type *make_type(Type *tmpl) {
-    Type *r = malloc(sizeof(Type));
+    Type *r = arena_malloc(MEM_TYPE, sizeof(Type));
     *r = *tmpl;
     return r;
 }
 
 static Type *copy_type(Type *ty) {
-    Type *r = malloc(sizeof(Type));
+    Type *r = arena_malloc(MEM_TYPE, sizeof(Type));
     memcpy(r, ty, sizeof(Type));
     return r;
 }
 
 static Type *make_numtype(int kind, bool usig) {
-    Type *r = calloc(1, sizeof(Type));
+    Type *r = arena_calloc(MEM_TYPE, 1, sizeof(Type));
     r->kind = kind;
     r->usig = usig;
     if (kind == KIND_VOID)
@@ -1218,7 +1231,7 @@ static Node *read_unary_expr() {
 }
 
 static Node *read_compound_literal(Type *ty) {
-    char *name = make_label();
+    char *name = intern(make_label());
     Vector *init = read_decl_init(ty);
     Node *r = ast_lvar(ty, name);
     r->lvarinit = init;
@@ -1618,6 +1631,8 @@ static Dict *read_rectype_fields(int *rsize, int *align, bool is_struct) {
 }
 
 static Type *read_rectype_def(bool is_struct) {
+    // Tags are not scoped, so a struct defined in a function outlives it.
+    Arena *arena = use_arena(NULL);
     char *tag = read_rectype_tag();
     Type *r;
     if (tag) {
@@ -1638,6 +1653,7 @@ static Type *read_rectype_def(bool is_struct) {
         r->fields = fields;
         r->size = size;
     }
+    use_arena(arena);
     return r;
 }
 
@@ -1957,8 +1973,11 @@ static void read_declarator_params(Vector *types, Vector *vars, bool *ellipsis)
         Type *ty = read_func_param(&name, typeonly);
         ensure_not_void(ty);
         vec_push(types, ty);
-        if (!typeonly)
+        if (!typeonly) {
+            Arena *prev = use_arena(body_arena);
             vec_push(vars, ast_lvar(ty, name));
+            use_arena(prev);
+        }
         tok = get();
         if (is_keyword(tok, ')'))
             return;
@@ -2442,15 +2461,24 @@ static Vector *param_types(Vector *params) {
  * Function definition
  */
 
+static Map *make_scope(Map *parent) {
+    Arena *prev = use_arena(scope_arena);
+    Map *r = make_symbol_map_parent(parent);
+    use_arena(prev);
+    return r;
+}
+
 static Node *read_func_body(Type *functype, char *fname, Vector *params) {
-    localenv = make_map_parent(localenv);
+    localenv = make_scope(localenv);
     localvars = make_vector();
+    loops = make_vector();
     current_func_type = functype;
     Node *funcname = ast_string(ENC_NONE, fname, strlen(fname) + 1);
-    map_put(localenv, "__func__", funcname);
-    map_put(localenv, "__FUNCTION__", funcname);
+    map_put(localenv, intern("__func__"), funcname);
+    map_put(localenv, intern("__FUNCTION__"), funcname);
     Node *body = read_compound_stmt();
     Node *r = ast_func(functype, fname, params, body, localvars);
+    optimize_loops(r, loops);
     current_func_type = NULL;
     localenv = NULL;
     localvars = NULL;
@@ -2476,7 +2504,8 @@ static void skip_parentheses(Vector *buf) {
 // definition. (Usually '{' comes after a closing parenthesis.
 // A type keyword is allowed for K&R-style function definitions.)
 static bool is_funcdef() {
-    Vector *buf = make_vector();
+    static Vector lookahead = EMPTY_VECTOR;  // empty again on return
+    Vector *buf = &lookahead;
     bool r = false;
     for (;;) {
         Token *tok = get();
@@ -2519,14 +2548,23 @@ static void backfill_labels() {
     }
 }
 
-static Node *read_funcdef() {
+static Node *read_funcdef(int unroll) {
+    unroll_mode = unroll;
+    mark_location();
+    SourceLoc *loc = source_loc;
     int sclass = 0;
     Type *basetype = read_decl_spec_opt(&sclass);
-    localenv = make_map_parent(globalenv);
+    if (!scope_arena)
+        scope_arena = make_arena("scopes");
+    Arena *prev = use_arena(scope_arena);
+    localenv = make_symbol_map_parent(globalenv);
     gotos = make_vector();
-    labels = make_map();
-    char *name;
+    labels = make_symbol_map();
+    // The parameters go with the body.
+    use_arena(body_arena);
     Vector *params = make_vector();
+    use_arena(prev);
+    char *name;
     Type *functype = read_declarator(&name, basetype, params, DECL_BODY);
     if (functype->oldstyle) {
         if (vec_len(params) == 0)
@@ -2537,9 +2575,18 @@ static Node *read_funcdef() {
     functype->isstatic = (sclass == S_STATIC);
     ast_gvar(functype, name);
     expect('{');
+    use_arena(body_arena);
     Node *r = read_func_body(functype, name, params);
+    // Where the definition starts, not its last statement.
+    r->sourceLoc = loc;
     backfill_labels();
+    use_arena(NULL);
+    if (body_arena) {
+        lex_keep_tokens();
+        source_loc = NULL;
+    }
     localenv = NULL;
+    arena_reset(scope_arena);
     return r;
 }
 
@@ -2585,13 +2632,17 @@ static Node *read_opt_decl_or_stmt() {
     lcontinue = ocontinue;    \
     lbreak = obreak
 
-static Node *read_for_stmt() {
+// Loops are rotated so that the condition is tested at the bottom. Entering
+// the loop jumps to the test once; every iteration after that costs a
+// single conditional branch instead of a branch plus a jump back.
+static Node *read_for_stmt(int unroll) {
     expect('(');
     char *beg = make_label();
     char *mid = make_label();
+    char *test = make_label();
     char *end = make_label();
     Map *orig = localenv;
-    localenv = make_map_parent(localenv);
+    localenv = make_scope(localenv);
     Node *init = read_opt_decl_or_stmt();
     Node *cond = read_expr_opt();
     if (cond && is_flotype(cond->ty))
@@ -2607,17 +2658,27 @@ static Node *read_for_stmt() {
     Vector *v = make_vector();
     if (init)
         vec_push(v, init);
-    vec_push(v, ast_dest(beg));
     if (cond)
-        vec_push(v, ast_if(cond, NULL, ast_jump(end)));
+        vec_push(v, ast_jump(test));
+    vec_push(v, ast_dest(beg));
     if (body)
         vec_push(v, body);
     vec_push(v, ast_dest(mid));
     if (step)
         vec_push(v, step);
-    vec_push(v, ast_jump(beg));
+    vec_push(v, ast_dest(test));
+    if (cond)
+        vec_push(v, ast_if(cond, ast_jump(beg), NULL));
+    else
+        vec_push(v, ast_jump(beg));
     vec_push(v, ast_dest(end));
-    return ast_compound_stmt(v);
+    Node *r = ast_compound_stmt(v);
+    if (cond && step && body && loops) {
+        Loop *l = arena_malloc(MEM_NODE, sizeof(Loop));
+        *l = (Loop){r, init, cond, step, body, end, unroll ? unroll : unroll_mode};
+        vec_push(loops, l);
+    }
+    return r;
 }
 
 /*
@@ -2630,15 +2691,20 @@ static Node *read_while_stmt() {
     expect(')');
 
     char *beg = make_label();
+    char *test = make_label();
     char *end = make_label();
-    SET_JUMP_LABELS(beg, end);
+    SET_JUMP_LABELS(test, end);
     Node *body = read_stmt();
     RESTORE_JUMP_LABELS();
 
+    // Rotated like for loops above.
     Vector *v = make_vector();
+    vec_push(v, ast_jump(test));
     vec_push(v, ast_dest(beg));
-    vec_push(v, ast_if(cond, body, ast_jump(end)));
-    vec_push(v, ast_jump(beg));
+    if (body)
+        vec_push(v, body);
+    vec_push(v, ast_dest(test));
+    vec_push(v, ast_if(cond, ast_jump(beg), NULL));
     vec_push(v, ast_dest(end));
     return ast_compound_stmt(v);
 }
@@ -2701,6 +2767,24 @@ static void check_case_duplicates(Vector *cases) {
     }
 }
 
+// With a profile, the cases that ran most often are tested first. Case
+// values never overlap, so the order of the tests does not matter
+// otherwise.
+static Vector *order_cases(Vector *cases) {
+    Vector *r = vec_copy(cases);
+    if (!has_profile())
+        return r;
+    for (int i = 1; i < vec_len(r); i++) {
+        Case *c = vec_get(r, i);
+        long n = profile_label_count(c->label);
+        int j = i;
+        for (; j > 0 && profile_label_count(((Case *)vec_get(r, j - 1))->label) < n; j--)
+            vec_set(r, j, vec_get(r, j - 1));
+        vec_set(r, j, c);
+    }
+    return r;
+}
+
 #define SET_SWITCH_CONTEXT(brk)       \
     Vector *ocases = cases;           \
     char *odefaultcase = defaultcase; \
@@ -2725,9 +2809,11 @@ static Node *read_switch_stmt() {
     Node *body = read_stmt();
     Vector *v = make_vector();
     Node *var = ast_lvar(expr->ty, make_tempname());
+    vec_push(v, ast_decl(var, NULL));
     vec_push(v, ast_binop(expr->ty, '=', var, expr));
-    for (int i = 0; i < vec_len(cases); i++)
-        vec_push(v, make_switch_jump(var, vec_get(cases, i)));
+    Vector *order = order_cases(cases);
+    for (int i = 0; i < vec_len(order); i++)
+        vec_push(v, make_switch_jump(var, vec_get(order, i)));
     vec_push(v, ast_jump(defaultcase ? defaultcase : end));
     if (body)
         vec_push(v, body);
@@ -2838,7 +2924,7 @@ static Node *read_stmt() {
             case KIF:
                 return read_if_stmt();
             case KFOR:
-                return read_for_stmt();
+                return read_for_stmt(take_unroll(tok));
             case KWHILE:
                 return read_while_stmt();
             case KDO:
@@ -2869,7 +2955,7 @@ static Node *read_stmt() {
 
 static Node *read_compound_stmt() {
     Map *orig = localenv;
-    localenv = make_map_parent(localenv);
+    localenv = make_scope(localenv);
     Vector *list = make_vector();
     for (;;) {
         if (next_token('}'))
@@ -2900,16 +2986,33 @@ static void read_decl_or_stmt(Vector *list) {
  * Compilation unit
  */
 
-Vector *read_toplevels() {
+// Reads a declaration or a function definition and returns the toplevels
+// it makes, with the static local variables of a function before it, or
+// NULL at the end of the input.
+Vector *read_toplevel() {
+    Token *tok = peek();
+    int unroll = take_unroll(tok);
+    bool funcdef = tok->kind != TEOF && is_funcdef();
+    if (unroll && !funcdef)
+        misplaced_unroll(tok, unroll);
+    if (tok->kind == TEOF)
+        return NULL;
+    // Only needed until the caller is done with the toplevel, like a body.
+    Arena *prev = use_arena(body_arena);
     toplevels = make_vector();
-    for (;;) {
-        if (peek()->kind == TEOF)
-            return toplevels;
-        if (is_funcdef())
-            vec_push(toplevels, read_funcdef());
-        else
-            read_decl(toplevels, true);
-    }
+    use_arena(prev);
+    if (funcdef)
+        vec_push(toplevels, read_funcdef(unroll));
+    else
+        read_decl(toplevels, true);
+    return toplevels;
+}
+
+Vector *read_toplevels() {
+    Vector *r = make_vector();
+    for (Vector *v; (v = read_toplevel());)
+        vec_append(r, v);
+    return r;
 }
 
 /*
@@ -2936,10 +3039,30 @@ static void concatenate_string(Token *tok) {
     tok->enc = enc;
 }
 
+static void misplaced_unroll(Token *tok, int unroll) {
+    char *name = unroll == UNROLL_FORCE ? "unroll" : "nounroll";
+    if (tok->kind == TEOF)
+        warn("ignoring #pragma %s at the end of the input", name);
+    else
+        warnt(tok, "ignoring #pragma %s not followed by a for loop or a function definition", name);
+}
+
+// Returns the unroll mode a #pragma before the token asks for, and
+// forgets it. The pragma belongs to the first token of a for statement or
+// of a function definition, which take it before anything else reads them;
+// on any other token get() warns about it.
+static int take_unroll(Token *tok) {
+    int r = tok->unroll;
+    tok->unroll = UNROLL_DEFAULT;
+    return r;
+}
+
 static Token *get() {
     Token *r = read_token();
     if (r->kind == TINVALID)
         errort(r, "stray character in program: '%c'", r->c);
+    if (r->unroll && !is_keyword(r, KFOR))
+        misplaced_unroll(r, take_unroll(r));
     if (r->kind == TSTRING && peek()->kind == TSTRING)
         concatenate_string(r);
     return r;
@@ -2954,7 +3077,20 @@ static Token *peek() {
  */
 
 static void define_builtin(char *name, Type *rettype, Vector *paramtypes) {
-    ast_gvar(make_func_type(rettype, paramtypes, true, false), name);
+    ast_gvar(make_func_type(rettype, paramtypes, true, false), intern(name));
+}
+
+// The type of a builtin function.
+Type *builtin_type(char *name) {
+    Node *fn = map_get(globalenv, intern(name));
+    return fn->ty;
+}
+
+// Forgets the declarations of the files read so far.
+void parse_reset(void) {
+    globalenv = make_symbol_map();
+    tags = make_symbol_map();
+    ntemps = nlabels = nstatics = 0;
 }
 
 void parse_init() {
@@ -2968,4 +3104,15 @@ void parse_init() {
     define_builtin("__builtin_reg_class", type_int, voidptr);
     define_builtin("__builtin_va_arg", type_void, two_voidptrs);
     define_builtin("__builtin_va_start", type_void, voidptr);
+    Vector *words = make_vector();
+    vec_push(words, make_ptr_type(type_void));
+    vec_push(words, make_ptr_type(type_void));
+    vec_push(words, type_long);
+    define_builtin("__builtin_copy_words", type_void, words);
+    define_builtin("__builtin_mismatch_words", type_long, words);
+    Vector *fill = make_vector();
+    vec_push(fill, make_ptr_type(type_void));
+    vec_push(fill, type_long);
+    vec_push(fill, type_long);
+    define_builtin("__builtin_fill_words", type_void, fill);
 }
@@ -0,0 +1,167 @@
+/*
+ * Pass manager.
+ *
+ * Every optimization is a named pass that runs at some of the -O levels.
+ * The level picks the default pipeline; -f<pass> and -fno-<pass> override
+ * it for a single pass no matter where they appear on the command line.
+ *
+ * The passes themselves stay where they are (loop.c, ipo.c and opt.c) and
+ * ask pass_enabled before running. Around each run the caller reports the
+ * size of the code it works on, in AST nodes for the passes over the
+ * program and in instructions for the passes over one function, which is
+ * what -fpass-stats prints along with the time spent.
+ */
+
+#include "8cc.h"
+
+enum {
+    L1 = 1,
+    L2 = 2,
+    LS = 4,
+};
+
+typedef struct {
+    char *name;
+    char *desc;
+    int levels;
+    int force;  // 1 if forced on, -1 if forced off, 0 to follow the level
+    int runs;
+    long before;
+    long after;
+    double time;
+    clock_t start;
+    bool dump;
+} Pass;
+
+static Pass passes[NUM_PASSES] = {
+    [PASS_IDIOMS] = {"idioms", "recognize fill, copy and compare loops", L2 | LS},
+    [PASS_UNROLL] = {"unroll", "unroll counted for loops", L2},
+    [PASS_UNREACHABLE] = {"unreachable", "drop unreachable functions and globals", L1 | L2 | LS},
+    [PASS_DEVIRTUALIZE] = {"devirtualize", "call function pointers with known targets directly", L2 | LS},
+    [PASS_INLINE] = {"inline", "inline hot calls of small functions (needs a profile)", L2},
+    [PASS_CONSTGLOBALS] = {"constglobals", "fold reads of globals that are never written", L2 | LS},
+    [PASS_IPCP] = {"ipcp", "propagate constant arguments into callees", L2 | LS},
+    [PASS_EVALUATE] = {"evaluate", "evaluate pure calls with constant arguments", L2 | LS},
+    [PASS_HEAP2STACK] = {"heap2stack", "move non-escaping allocations to the stack", L2 | LS},
+    [PASS_SPECIALIZE] = {"specialize", "clone functions for constant arguments", L2},
+    [PASS_DEADPARAMS] = {"deadparams", "remove unused parameters", L2 | LS},
+    [PASS_DEADRETURNS] = {"deadreturns", "remove unused return values", L2 | LS},
+    [PASS_DEADCALLS] = {"deadcalls", "remove calls without effects", L2 | LS},
+    [PASS_READONLY] = {"readonly", "find functions that do not write memory", L2 | LS},
+    [PASS_REGGLOBALS] = {"regglobals", "keep hot globals in registers", L2 | LS},
+    [PASS_PLACEMENT] = {"placement", "order functions by how often they run (needs a profile)", L2 | LS},
+    [PASS_SSA] = {"ssa", "promote frame slots to registers through SSA form", L2 | LS},
+    [PASS_GVN] = {"gvn", "global value numbering", L1 | L2 | LS},
+    [PASS_COPYPROP] = {"copyprop", "copy propagation", L1 | L2 | LS},
+    [PASS_MEMORY] = {"memory", "forward loads and remove dead stores", L2 | LS},
+    [PASS_DCE] = {"dce", "dead code elimination", L1 | L2 | LS},
+    [PASS_COALESCE] = {"coalesce", "coalesce moves into their sources", L2 | LS},
+    [PASS_LAYOUT] = {"layout", "jump threading and block layout", L1 | L2 | LS},
+};
+
+static int level = L2;
+bool pass_stats = false;
+
+static Pass *find_pass(char *name) {
+    for (int i = 0; i < NUM_PASSES; i++)
+        if (!strcmp(passes[i].name, name))
+            return &passes[i];
+    return NULL;
+}
+
+bool set_opt_level(char *s) {
+    if (!strcmp(s, "0"))
+        level = 0;
+    else if (!strcmp(s, "1"))
+        level = L1;
+    else if (!strcmp(s, "2") || !strcmp(s, "") || !strcmp(s, "3"))
+        level = L2;
+    else if (!strcmp(s, "s"))
+        level = LS;
+    else
+        return false;
+    return true;
+}
+
+bool set_pass(char *name, bool on) {
+    Pass *p = find_pass(name);
+    if (!p)
+        return false;
+    p->force = on ? 1 : -1;
+    return true;
+}
+
+bool set_dump_after(char *name) {
+    Pass *p = find_pass(name);
+    if (!p)
+        return false;
+    p->dump = true;
+    return true;
+}
+
+char *pass_name(int pass) {
+    return passes[pass].name;
+}
+
+// The level and the passes forced on or off, for the keys of cache.c.
+char *pass_config(void) {
+    Buffer *b = make_buffer();
+    buf_printf(b, "O%d", level);
+    for (int i = 0; i < NUM_PASSES; i++)
+        if (passes[i].force)
+            buf_printf(b, " %c%s", passes[i].force > 0 ? '+' : '-', passes[i].name);
+    return buf_body(b);
+}
+
+bool pass_enabled(int pass) {
+    Pass *p = &passes[pass];
+    return p->force ? p->force > 0 : (p->levels & level) != 0;
+}
+
+void pass_start(int pass, long size) {
+    Pass *p = &passes[pass];
+    p->runs++;
+    p->before += size;
+    if (pass_stats)
+        p->start = clock();
+}
+
+// Called as soon as the pass is done, so that measuring the code is not
+// counted as time spent in the pass.
+void pass_stop(int pass) {
+    Pass *p = &passes[pass];
+    if (pass_stats)
+        p->time += (double)(clock() - p->start) / CLOCKS_PER_SEC;
+}
+
+// Returns true if the code should be dumped after the pass.
+bool pass_finish(int pass, long size) {
+    Pass *p = &passes[pass];
+    p->after += size;
+    return p->dump;
+}
+
+void print_pass_list(FILE *out) {
+    for (int i = 0; i < NUM_PASSES; i++) {
+        Pass *p = &passes[i];
+        fprintf(out, "  %-14s %s%s%s%s\n", p->name, p->desc,
+                p->levels & L1 ? " [-O1]" : "",
+                p->levels & L2 ? " [-O2]" : "",
+                p->levels & LS ? " [-Os]" : "");
+    }
+}
+
+void print_pass_stats(void) {
+    if (!pass_stats)
+        return;
+    double total = 0;
+    fprintf(stderr, "%-14s %6s %10s %10s %10s\n", "pass", "runs", "before", "after", "ms");
+    for (int i = 0; i < NUM_PASSES; i++) {
+        Pass *p = &passes[i];
+        if (!p->runs)
+            continue;
+        fprintf(stderr, "%-14s %6d %10ld %10ld %10.2f\n", p->name, p->runs, p->before, p->after, p->time * 1000);
+        total += p->time;
+    }
+    fprintf(stderr, "%-14s %6s %10s %10s %10.2f\n", "total", "", "", "", total * 1000);
+}
@@ -0,0 +1,170 @@
+/*
+ * Execution profiles.
+ *
+ * With -fprofile-generate, gen.c gives every function, every label and
+ * every pair of caller and direct callee a counter in VM memory. When
+ * _start returns, the program prints the counters that are not zero after
+ * its own output, between a "minivm-profile 1" and a "minivm-profile end"
+ * line:
+ *
+ *   f <function> <count> <labels in the function>
+ *   b <function> <n> <label> <count>    (n-th label of the function)
+ *   c <caller> <callee> <count>
+ *
+ * -fprofile-use reads such output back and sums the counts of every
+ * profile in it, so the output of several runs can simply be concatenated.
+ * Blocks are matched by their position in the function, and only if the
+ * function still has as many labels as when it was profiled. The names of
+ * labels that parse.c creates do not depend on what happens after parsing,
+ * so those are also looked up by name.
+ */
+
+#include "8cc.h"
+
+#define PROFILE_MARK "minivm-profile 1"
+#define PROFILE_END "minivm-profile end"
+
+typedef struct {
+    long count;
+    int nlabels;
+} FuncProfile;
+
+bool profile_generate = false;
+char *profile_out;
+char *profile_in;
+
+static Map *funcs;   // function name -> FuncProfile
+static Map *blocks;  // "<function> <n>" -> count
+static Map *labels;  // label -> count
+static Map *edges;   // "<caller> <callee>" -> count
+static long max_edge;
+
+static void add_count(Map *m, char *key, long n) {
+    map_put(m, key, (void *)((intptr_t)map_get(m, key) + n));
+}
+
+// Calls from and to copies that ipo.c made of a function for constant
+// arguments count for the function itself.
+static char *base_name(char *name) {
+    char *dot = strrchr(name, '.');
+    if (!dot || !dot[1] || strspn(dot + 1, "0123456789") != strlen(dot + 1))
+        return name;
+    return format("%.*s", (int)(dot - name), name);
+}
+
+static void read_record(char **tok, int ntok) {
+    if (ntok == 4 && !strcmp(tok[0], "f")) {
+        FuncProfile *fp = map_get(funcs, tok[1]);
+        if (!fp) {
+            fp = calloc(1, sizeof(FuncProfile));
+            map_put(funcs, tok[1], fp);
+        }
+        fp->count += atol(tok[2]);
+        fp->nlabels = atoi(tok[3]);
+    } else if (ntok == 5 && !strcmp(tok[0], "b")) {
+        add_count(blocks, format("%s %s", tok[1], tok[2]), atol(tok[4]));
+        add_count(labels, tok[3], atol(tok[4]));
+    } else if (ntok == 4 && !strcmp(tok[0], "c")) {
+        char *key = format("%s %s", base_name(tok[1]), base_name(tok[2]));
+        add_count(edges, key, atol(tok[3]));
+        long n = (intptr_t)map_get(edges, key);
+        if (n > max_edge)
+            max_edge = n;
+    }
+}
+
+void read_profile(char *path) {
+    FILE *file = fopen(path, "r");
+    if (!file)
+        error("cannot open profile %s: %s", path, strerror(errno));
+    profile_in = path;
+    funcs = make_map();
+    blocks = make_map();
+    labels = make_map();
+    edges = make_map();
+    bool inside = false;
+    char line[1024];
+    while (fgets(line, sizeof(line), file)) {
+        line[strcspn(line, "\n")] = '\0';
+        if (!strcmp(line, PROFILE_MARK)) {
+            inside = true;
+            continue;
+        }
+        if (!strcmp(line, PROFILE_END)) {
+            inside = false;
+            continue;
+        }
+        if (!inside)
+            continue;
+        char *tok[8];
+        int ntok = 0;
+        for (char *p = strtok(line, " "); p && ntok < 8; p = strtok(NULL, " "))
+            tok[ntok++] = strdup(p);
+        read_record(tok, ntok);
+    }
+    fclose(file);
+}
+
+bool has_profile(void) {
+    return funcs != NULL;
+}
+
+// Number of calls of the function, 0 if it never ran, or -1 without a
+// profile.
+long profile_func_count(char *fname) {
+    if (!funcs)
+        return -1;
+    FuncProfile *fp = map_get(funcs, fname);
+    return fp ? fp->count : 0;
+}
+
+// Executions of the n-th label of a function that has `nlabels` labels,
+// or -1 if that is not known.
+long profile_block_count(char *fname, int n, int nlabels) {
+    if (!funcs)
+        return -1;
+    FuncProfile *fp = map_get(funcs, fname);
+    if (!fp)
+        return 0;
+    if (fp->nlabels != nlabels)
+        return -1;
+    return (intptr_t)map_get(blocks, format("%s %d", fname, n));
+}
+
+// Executions of a label made by parse.c, summed over all copies of it.
+long profile_label_count(char *label) {
+    if (!funcs)
+        return -1;
+    return (intptr_t)map_get(labels, label);
+}
+
+long profile_edge_count(char *caller, char *callee) {
+    if (!funcs)
+        return -1;
+    return (intptr_t)map_get(edges, format("%s %s", caller, callee));
+}
+
+long profile_max_edge(void) {
+    return max_edge;
+}
+
+// Output of a program run by main.c with -fprofile-generate=<file>. The
+// program's own output goes on to stdout and the profile to the file.
+void write_profile_output(char *buf, size_t len) {
+    char *pat = "\n" PROFILE_MARK "\n";
+    size_t patlen = strlen(pat);
+    char *mark = NULL;
+    for (size_t i = 0; i + patlen <= len; i++)
+        if (!memcmp(buf + i, pat, patlen))
+            mark = buf + i;
+    size_t proglen = mark ? (size_t)(mark - buf) : len;
+    fwrite(buf, 1, proglen, stdout);
+    fflush(stdout);
+    if (!mark)
+        return;
+    FILE *file = fopen(profile_out, "w");
+    if (!file)
+        error("cannot write profile %s: %s", profile_out, strerror(errno));
+    fwrite(mark + 1, 1, len - proglen - 1, file);
+    fclose(file);
+}
@@ -1,6 +1,7 @@
 // Copyright 2014 Rui Ueyama. Released under the MIT license.
 
-// Sets are containers that store unique strings.
+// Sets are containers that store unique strings. The strings must be
+// interned, and are compared by address.
 //
 // The data structure is functional. Because no destructive
 // operation is defined, it's guranteed that a set will never
@@ -24,7 +25,7 @@ Set *set_add(Set *s, char *v) {
 
 bool set_has(Set *s, char *v) {
     for (; s; s = s->next)
-        if (!strcmp(s->v, v))
+        if (s->v == v)
             return true;
     return false;
 }
@@ -128,22 +128,42 @@ static void test_dict() {
 }
 
 static void test_set() {
+    char *abc = intern("abc"), *def = intern("def"), *DEF = intern("DEF");
     Set *s = NULL;
-    assert_int(0, set_has(s, "abc"));
-    s = set_add(s, "abc");
-    s = set_add(s, "def");
-    assert_int(1, set_has(s, "abc"));
-    assert_int(1, set_has(s, "def"));
-    assert_int(0, set_has(s, "xyz"));
+    assert_int(0, set_has(s, abc));
+    s = set_add(s, abc);
+    s = set_add(s, def);
+    assert_int(1, set_has(s, abc));
+    assert_int(1, set_has(s, def));
+    assert_int(0, set_has(s, intern("xyz")));
     Set *t = NULL;
-    t = set_add(t, "abc");
-    t = set_add(t, "DEF");
-    assert_int(1, set_has(set_union(s, t), "abc"));
-    assert_int(1, set_has(set_union(s, t), "def"));
-    assert_int(1, set_has(set_union(s, t), "DEF"));
-    assert_int(1, set_has(set_intersection(s, t), "abc"));
-    assert_int(0, set_has(set_intersection(s, t), "def"));
-    assert_int(0, set_has(set_intersection(s, t), "DEF"));
+    t = set_add(t, abc);
+    t = set_add(t, DEF);
+    assert_int(1, set_has(set_union(s, t), abc));
+    assert_int(1, set_has(set_union(s, t), def));
+    assert_int(1, set_has(set_union(s, t), DEF));
+    assert_int(1, set_has(set_intersection(s, t), abc));
+    assert_int(0, set_has(set_intersection(s, t), def));
+    assert_int(0, set_has(set_intersection(s, t), DEF));
+}
+
+static void test_intern() {
+    char *abc = intern("abc");
+    assert_string("abc", abc);
+    assert_true(intern(format("a%s", "bc")) == abc);
+    assert_true(intern_len("abcd", 3) == abc);
+    assert_true(intern("abd") != abc);
+    assert_true(intern("") != abc);
+
+    Map *m = make_symbol_map();
+    for (int i = 0; i < 5000; i++)
+        map_put(m, intern(format("%d", i)), (void *)(intptr_t)i);
+    for (int i = 0; i < 5000; i++)
+        assert_int(i, (intptr_t)map_get(m, intern(format("%d", i))));
+    Map *m2 = make_symbol_map_parent(m);
+    map_put(m2, intern("42"), (void *)1);
+    assert_int(1, (intptr_t)map_get(m2, intern("42")));
+    assert_int(43, (intptr_t)map_get(m2, intern("43")));
 }
 
 static void test_path() {
@@ -178,6 +198,7 @@ int main(int argc, char **argv) {
     test_map_stack();
     test_dict();
     test_set();
+    test_intern();
     test_path();
     test_file();
     printf("Passed\n");
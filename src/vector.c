@@ -22,12 +22,13 @@ static int roundup(int n) {
 }
 
 static Vector *do_make_vector(int size) {
-    Vector *r = malloc(sizeof(Vector));
+    Arena *a = current_arena();
+    Vector *r = container_alloc(a, sizeof(Vector));
     size = roundup(size);
-    if (size > 0)
-        r->body = malloc(sizeof(void *) * size);
+    r->body = size > 0 ? container_alloc(a, sizeof(void *) * size) : NULL;
     r->len = 0;
     r->nalloc = size;
+    r->arena = a;
     return r;
 }
 
@@ -39,10 +40,7 @@ static void extend(Vector *vec, int delta) {
     if (vec->len + delta <= vec->nalloc)
         return;
     int nelem = max(roundup(vec->len + delta), MIN_SIZE);
-    void *newbody = malloc(sizeof(void *) * nelem);
-    if (vec->len != 0)
-        memcpy(newbody, vec->body, sizeof(void *) * vec->len);
-    vec->body = newbody;
+    vec->body = container_grow(vec->arena, vec->body, sizeof(void *) * vec->nalloc, sizeof(void *) * nelem);
     vec->nalloc = nelem;
 }
 
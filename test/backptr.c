@@ -0,0 +1,23 @@
+#include <stdio.h>
+
+// Writes behind the pointer it is given.
+void back(int *e) {
+    e[-2] = 5;
+}
+
+int main() {
+    int a[3];
+    a[0] = 1;
+    back(a + 2);
+    putchar('0' + a[0]);
+
+    int arr[8];
+    int *p = &arr[5];
+    arr[2] = 4;
+    // An index that is not known until the program runs: -3 either way.
+    int c = getchar();
+    int k = c < 0 ? -3 : c - 100;
+    putchar('0' + p[k]);
+    putchar('\n');
+    return 0;
+}
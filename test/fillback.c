@@ -0,0 +1,21 @@
+#include <stdio.h>
+
+// Writes the digits of n backwards, ending before `end`.
+void fill_back(char *end, int n) {
+    do {
+        *--end = '0' + n % 10;
+        n /= 10;
+    } while (n);
+}
+
+int main() {
+    char buf[8];
+    buf[0] = 'x';
+    buf[1] = 'y';
+    buf[2] = 'z';
+    fill_back(buf + 7, 1234567);
+    for (int i = 0; i < 7; i++)
+        putchar(buf[i]);
+    putchar('\n');
+    return 0;
+}